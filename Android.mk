@@ -31,6 +31,12 @@ src_files := $(src_path)/entry.c \
 	     $(src_path)/matrix-ops.c \
 	     $(src_path)/gyro-calibration.c \
 	     $(src_path)/filtering.c \
+	     $(src_path)/median-window.c \
+	     $(src_path)/clock-domain.c \
+	     $(src_path)/timestamp-estimator.c \
+	     $(src_path)/direct-report.c \
+	     $(src_path)/sensor-stats.c \
+	     $(src_path)/capture.c \
 	     $(src_path)/discovery.c \
 	     $(src_path)/accel-calibration.c \
 
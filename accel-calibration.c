@@ -17,6 +17,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <math.h>
 #include <log/log.h>
 #include <hardware/sensors.h>
 #include "common.h"
@@ -31,6 +32,8 @@
 
 static float bucket_center[BUCKET_COUNT] = { -9.8, 0, 9.8 };	/* The spots we are most interested in */
 
+#define BUCKET_SPACING		9.8				/* Distance between consecutive bucket centers */
+
 #define ACCEL_CALIB_DATA_VERSION	1			/* Update this whenever the stored data structure changes */
 
 #define ACCEL_CALIBRATION_PATH    "/data/accel.conf"		/* Location of saved calibration data */
@@ -38,28 +41,71 @@ static float bucket_center[BUCKET_COUNT] = { -9.8, 0, 9.8 };	/* The spots we are
 #define REFRESH_INTERVAL	1000*1000*1000			/* Recompute bias estimation every second */
 
 
+static void update_median (accel_cal_t* cal_data, int channel, int i)
+{
+	/*
+	 * Move the running median of a bucket to the first slice at which the cumulated count reaches half of the bucket usage. Counters only
+	 * change by one sample between calls, so this takes a step at most, except when rebuilding from scratch.
+	 */
+
+	uint64_t* slice_count = cal_data->bucket[channel][i];
+	uint64_t half_of_the_samples = cal_data->bucket_usage[channel][i] / 2;
+	int* median = &cal_data->median_slice[channel][i];
+	uint64_t* below = &cal_data->below_median[channel][i];
+
+	while (*median > 0 && *below >= half_of_the_samples) {
+		(*median)--;
+		*below -= slice_count[*median];
+	}
+
+	while (*median < SLICES-1 && *below + slice_count[*median] < half_of_the_samples) {
+		*below += slice_count[*median];
+		(*median)++;
+	}
+}
+
+
+static void rebuild_medians (accel_cal_t* cal_data)
+{
+	int channel, i;
+
+	for (channel=0; channel<3; channel++)
+		for (i=0; i<BUCKET_COUNT; i++) {
+			cal_data->median_slice[channel][i] = 0;
+			cal_data->below_median[channel][i] = 0;
+			update_median(cal_data, channel, i);
+		}
+}
+
+
 static void ascribe_sample (accel_cal_t* cal_data, int channel, float value)
 {
-	/* Check if this falls within one of our ranges of interest */
+	/* Check if this falls within one of our ranges of interest ; they don't overlap, so only the one with the nearest center can match */
 	float range_min;
 	float range_max;
-	int i;
+	int i = (int) floorf(value / BUCKET_SPACING + 0.5) + BUCKET_COUNT/2;
 	int slice;
 
-	for (i=0; i<BUCKET_COUNT; i++) {
-		range_min = bucket_center[i] - BUCKET_TOLERANCE;
-		range_max = bucket_center[i] + BUCKET_TOLERANCE;
+	if (i < 0 || i >= BUCKET_COUNT)
+		return;
 
-		if (value >= range_min && value <= range_max) {
-			/* Find suitable bucket */
-			slice = (int) ((value-range_min) / (range_max-range_min) * (SLICES-1));
+	range_min = bucket_center[i] - BUCKET_TOLERANCE;
+	range_max = bucket_center[i] + BUCKET_TOLERANCE;
 
-			/* Increment counters */
-			cal_data->bucket[channel][i][slice]++;
-			cal_data->bucket_usage[channel][i]++;
-			return;
-		}
-	}
+	if (value < range_min || value > range_max)
+		return;
+
+	/* Find suitable bucket */
+	slice = (int) ((value-range_min) / (range_max-range_min) * (SLICES-1));
+
+	/* Increment counters */
+	cal_data->bucket[channel][i][slice]++;
+	cal_data->bucket_usage[channel][i]++;
+
+	if (slice < cal_data->median_slice[channel][i])
+		cal_data->below_median[channel][i]++;
+
+	update_median(cal_data, channel, i);
 }
 
 
@@ -72,8 +118,6 @@ static float estimate_bias (accel_cal_t* cal_data, int channel)
 	 */
 
 	int i;
-	uint64_t half_of_the_samples;
-	uint64_t count;
 	float median;
 	float estimated_bucket_bias[BUCKET_COUNT] = {0};
 	uint64_t bias_weight[BUCKET_COUNT];
@@ -83,25 +127,18 @@ static float estimate_bias (accel_cal_t* cal_data, int channel)
 	float estimated_bias;
 	int slice;
 
+	/* The running median of each bucket is maintained by ascribe_sample */
 	for (i=0; i<BUCKET_COUNT; i++) {
-		half_of_the_samples = cal_data->bucket_usage[channel][i] / 2;
-		count = 0;
-
-		for (slice = 0; slice < SLICES; slice++) {
-			count += cal_data->bucket[channel][i][slice];
+		slice = cal_data->median_slice[channel][i];
 
-			if (count >= half_of_the_samples) {
-				range_min = bucket_center[i] - BUCKET_TOLERANCE;
-				range_max = bucket_center[i] + BUCKET_TOLERANCE;
+		range_min = bucket_center[i] - BUCKET_TOLERANCE;
+		range_max = bucket_center[i] + BUCKET_TOLERANCE;
 
-				median = range_min + ((float) slice) / (SLICES-1) * (range_max-range_min);
+		median = range_min + ((float) slice) / (SLICES-1) * (range_max-range_min);
 
-				estimated_bucket_bias[i] = median - bucket_center[i];
+		estimated_bucket_bias[i] = median - bucket_center[i];
 
-				bias_weight[i] = count;
-				break;
-			}
-		}
+		bias_weight[i] = cal_data->below_median[channel][i] + cal_data->bucket[channel][i][slice];
 	}
 
 	/* Weight each of the estimated bucket bias values based on the number of samples collected */
@@ -178,16 +215,17 @@ void accel_cal_init (int s)
 	fd = open(ACCEL_CALIBRATION_PATH, O_RDONLY);
 
 	if (fd != -1) {
-		n = read(fd, cal_data, sizeof(accel_cal_t));
+		n = read(fd, cal_data, ACCEL_CAL_STORED_SIZE);
 
 		close(fd);
 
-		if (n == sizeof(accel_cal_t) &&
-			cal_data->version == ((ACCEL_CALIB_DATA_VERSION << 16) + sizeof(accel_cal_t)) &&
+		if (n == ACCEL_CAL_STORED_SIZE &&
+			cal_data->version == ((ACCEL_CALIB_DATA_VERSION << 16) + ACCEL_CAL_STORED_SIZE) &&
 			cal_data->bucket_count == BUCKET_COUNT &&
 			cal_data->slices == SLICES &&
 			cal_data->bucket_tolerance == BUCKET_TOLERANCE) {
 				cal_data->last_estimation_ts = 0;
+				rebuild_medians(cal_data);
 				return; /* We successfully loaded previously saved accelerometer calibration data */
 			}
 	}
@@ -196,7 +234,7 @@ void accel_cal_init (int s)
 	memset(cal_data, 0, sizeof(accel_cal_t));
 
 	/* Store the parameters that are used with that data set, so we can check them against future version of the code to prevent inadvertent reuse */
-	cal_data->version	   = (ACCEL_CALIB_DATA_VERSION << 16) + sizeof(accel_cal_t);
+	cal_data->version	   = (ACCEL_CALIB_DATA_VERSION << 16) + ACCEL_CAL_STORED_SIZE;
 	cal_data->bucket_count	   = BUCKET_COUNT;
 	cal_data->slices	   = SLICES;
 	cal_data->bucket_tolerance = BUCKET_TOLERANCE;
@@ -214,7 +252,7 @@ void accel_cal_store (int s)
 	fd = open(ACCEL_CALIBRATION_PATH, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR);
 
 	if (fd != -1) {
-		write(fd, cal_data, sizeof(accel_cal_t));
+		write(fd, cal_data, ACCEL_CAL_STORED_SIZE);
 		close(fd);
 	}
 }
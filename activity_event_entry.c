@@ -42,6 +42,10 @@
 #define CONTROL_FD		(-1)
 #define EXIT_FD			(-2)
 
+#define MAX_MODIFIERS		256	/* IIO event codes hold the channel modifier on 8 bits */
+#define EVENT_READ_BATCH	16	/* IIO events retrieved through a single read */
+#define MAX_BATCHED_EVENTS	64	/* Activity events delivered through a single callback */
+
 /*
  * This table maps syfs entries in scan_elements directories to sensor types,
  * and will also be used to determine other sysfs names as well as the iio
@@ -103,6 +107,8 @@ static struct activity_event_info supported_activities[MAX_ACTIVITIES + 1];
 static char const* supported_activity_names[MAX_ACTIVITIES + 1];
 /* Supported activities count */
 static unsigned int count;
+/* Index in supported_activities of the activity reported through a given IIO_MOD_* modifier ; 0 if none */
+static unsigned char activity_by_modifier[MAX_MODIFIERS];
 
 static int poll_fd, control_fd, exit_fd;
 static pthread_t control_thread;
@@ -338,6 +344,9 @@ static void process_enabling_activity_ev(uint8_t activity, uint8_t event)
 		if (ret < 0)
 			goto dev_err;
 
+		/* Pending events are drained on wakeup, until the fd reports there are no more */
+		fcntl(activ->event_fd, F_SETFL, O_NONBLOCK);
+
 		open_now = true;
 
 		ev_data.events	= EPOLLIN;
@@ -463,55 +472,50 @@ static void process_control_event(void)
 
 static int get_activity_index(int modifier)
 {
-	unsigned int i;
-
-	/* Start from 1 since 0 is reserved for FLUSH_COMPLETE event. */
-	for (i = 1; i <= count; i++)
-		if (supported_activities[i].modifier == modifier)
-			return i;
+	if (modifier < 0 || modifier >= MAX_MODIFIERS || !activity_by_modifier[modifier])
+		return -1;
 
-	return -1;
+	return activity_by_modifier[modifier];
 }
 
-static void process_activity_event(int fd, struct activity_event events[], int *count)
+static void deliver_activity_events(struct activity_event events[], int count)
 {
-	struct iio_event_data event;
-	int ret, chann_type, ev_type, ev_dir, ev_modifier, index, activity_index;
-
-	/* Retrieve event. */
-	ret = read(fd, &event, sizeof(event));
-	if (ret < 0) {
-		ALOGE("Error reading event\n");
-		return;
+	/* Call the callback function for the retrieved events (if it has been set). */
+	pthread_mutex_lock(&callback_mutex);
+	if (activity_dev_callback.activity_callback) {
+		activity_dev_callback.activity_callback(
+							&activity_dev_callback,
+							events,
+							count);
 	}
+	pthread_mutex_unlock(&callback_mutex);
+}
+
+static int decode_activity_event(const struct iio_event_data *event, struct activity_event *activity_event)
+{
+	int chann_type, ev_type, ev_dir, ev_modifier, activity_index;
 
 	/* Extract fields we are interested in and check the generated event. */
-	chann_type = IIO_EVENT_CODE_EXTRACT_CHAN_TYPE(event.id);
+	chann_type = IIO_EVENT_CODE_EXTRACT_CHAN_TYPE(event->id);
 	if (chann_type != IIO_ACTIVITY) {
 		ALOGW("Event came from other than an activity channel\n");
-		return;
+		return -1;
 	}
 
-	ev_modifier = IIO_EVENT_CODE_EXTRACT_MODIFIER(event.id);
-	switch (ev_modifier) {
-		case IIO_MOD_STILL:
-		case IIO_MOD_WALKING:
-		case IIO_MOD_RUNNING:
-			activity_index = get_activity_index(ev_modifier);
-			if (activity_index >= 0)
-				break;
-		default:
-			ALOGW("Incompatible modifier - none of the supported activities is present\n");
-			return;
+	ev_modifier = IIO_EVENT_CODE_EXTRACT_MODIFIER(event->id);
+	activity_index = get_activity_index(ev_modifier);
+	if (activity_index < 0) {
+		ALOGW("Incompatible modifier - none of the supported activities is present\n");
+		return -1;
 	}
 
-	ev_type = IIO_EVENT_CODE_EXTRACT_TYPE(event.id);
+	ev_type = IIO_EVENT_CODE_EXTRACT_TYPE(event->id);
 	if (ev_type != IIO_EV_TYPE_THRESH) {
 		ALOGW("Event type is not threshold\n");
-		return;
+		return -1;
 	}
 
-	ev_dir = IIO_EVENT_CODE_EXTRACT_DIR(event.id);
+	ev_dir = IIO_EVENT_CODE_EXTRACT_DIR(event->id);
 	switch (ev_dir) {
 		case IIO_EV_DIR_RISING:
 			ev_dir = ACTIVITY_EVENT_ENTER;
@@ -521,23 +525,52 @@ static void process_activity_event(int fd, struct activity_event events[], int *
 			break;
 		default:
 			ALOGW("Incompatible event direction - only RISING and FALLING supported\n");
-			return;
+			return -1;
 	}
 
-	/* Add the activity event to the array for further processing. */
-	index = *count;
-	events[index].event_type	= ev_dir;
-	events[index].activity		= activity_index;
-	events[index].timestamp		= event.timestamp;
+	activity_event->event_type	= ev_dir;
+	activity_event->activity	= activity_index;
+	activity_event->timestamp	= event->timestamp;
 
-	index++;
-	*count = index;
+	return 0;
+}
+
+static void process_activity_event(int fd, struct activity_event events[], int *count)
+{
+	struct iio_event_data event[EVENT_READ_BATCH];
+	int ret, i, n;
+
+	/* Retrieve all pending events, several at a time. */
+	do {
+		ret = read(fd, event, sizeof(event));
+		if (ret < 0) {
+			if (errno != EAGAIN)
+				ALOGE("Error reading event\n");
+			return;
+		}
+
+		n = ret / sizeof(struct iio_event_data);
+
+		/* Add the activity events to the array for further processing. */
+		for (i = 0; i < n; i++) {
+			if (decode_activity_event(&event[i], &events[*count]))
+				continue;
+
+			(*count)++;
+
+			/* Unlikely, but don't overflow the batch ; hand over what we have so far */
+			if (*count == MAX_BATCHED_EVENTS) {
+				deliver_activity_events(events, *count);
+				*count = 0;
+			}
+		}
+	} while (n == EVENT_READ_BATCH);
 }
 
 static void* events_routine(void *arg __attribute((unused)))
 {
 	struct epoll_event events[MAX_ACTIVITIES + 2];
-	struct activity_event data_events[MAX_ACTIVITIES];
+	struct activity_event data_events[MAX_BATCHED_EVENTS];
 	int no_events, i, no_activity_events;
 
 	while (1) {
@@ -571,17 +604,11 @@ static void* events_routine(void *arg __attribute((unused)))
 			} else
 				ALOGW("Epoll events %i not expected\n", events[i].events);
 
-		/* Call the callback function for the retrieved events (if it
-		 * has been set).
+		/* Whatever the count of devices that woke us up, deliver their
+		 * events in a single batch.
 		 */
-		pthread_mutex_lock(&callback_mutex);
-		if (activity_dev_callback.activity_callback) {
-			activity_dev_callback.activity_callback(
-								&activity_dev_callback,
-								data_events,
-								no_activity_events);
-		}
-		pthread_mutex_unlock(&callback_mutex);
+		if (no_activity_events)
+			deliver_activity_events(data_events, no_activity_events);
 	}
 }
 
@@ -716,12 +743,14 @@ static bool is_activity_valid(const char *activity_name)
 static void discover_activity_events(void)
 {
 	channel_descriptor_t *chann;
-	int i, num_channels, dev_num;
+	int i, num_channels, dev_num, dev_count;
 	unsigned int index;
 	char event_sensors[catalog_size];
 
+	dev_count = get_iio_device_count();
+
 	/* Discover event sensors */
-	for (dev_num = 0; dev_num < MAX_DEVICES; dev_num++) {
+	for (dev_num = 0; dev_num < dev_count; dev_num++) {
 		discover_sensors(dev_num, EVENTS_PATH, event_sensors, check_event_sensors);
 		for (index = 0; index < catalog_size; index++) {
 			if (!event_sensors[index])
@@ -737,6 +766,11 @@ static void discover_activity_events(void)
 		}
 	}
 
+	/* Direct lookup of activities from the modifier of the events we'll get */
+	memset(activity_by_modifier, 0, sizeof(activity_by_modifier));
+	for (index = 1; index <= count; index++)
+		activity_by_modifier[supported_activities[index].modifier] = index;
+
 	ALOGI("Discovered %d activities\n", count);
 }
 
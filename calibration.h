@@ -17,9 +17,13 @@
 #ifndef __CALIBRATION_H__
 #define __CALIBRATION_H__
 
+#include <stddef.h>
 #include "common.h"
 
 #define MAGN_DS_SIZE 32
+#define FIT_TERMS 10            /* Ellipsoid equation terms, plus the term they are regressed against */
+#define FIT_SUMS (FIT_TERMS * (FIT_TERMS + 1) / 2)
+#define COMPASS_GRID_BINS 512
 
 
 typedef struct {
@@ -32,10 +36,30 @@ typedef struct {
     /* geomagnetic strength */
     double bfield;
 
-    /* selection data */
-    float sample[MAGN_DS_SIZE][3];
+    /* single precision copies of offset and w_invert (row major), applied to each sample */
+    float offset_f[3];
+    float w_invert_f[9];
+
+    /* selection data ; in streaming mode, sample_count is the number of points selected since the last fit */
+    int streaming;
     unsigned int sample_count;
-    float average[3];
+
+    union {
+        /* Sample set mode */
+        struct {
+            float sample[MAGN_DS_SIZE][3];
+            float average[3];
+        };
+
+        /*
+         * Streaming mode: exponentially decayed sums of the products of ellipsoid fit terms over selected points (upper triangle, packed
+         * by rows), and space grid occupancy bitmap used to reject points too close to the ones selected since the last fit.
+         */
+        struct {
+            double sums[FIT_SUMS];
+            uint32_t grid[COMPASS_GRID_BINS / 32];
+        };
+    };
 }
 compass_cal_t;
 
@@ -45,6 +69,7 @@ typedef struct {
     int count;
     float min_x, min_y, min_z;
     float max_x, max_y, max_z;
+    int64_t start_ts;   /* Timestamp of the first sample of the current stable run */
 }
 gyro_cal_t;
 
@@ -70,9 +95,18 @@ typedef struct
     float accel_bias_z;
 
     uint64_t last_estimation_ts;
+
+    /*
+     * Running median of each bucket: the first slice at which the cumulated count reaches half of the bucket usage, and the number of
+     * samples in the slices below it. These are maintained as samples come in, and rebuilt from the counters after loading stored data.
+     */
+    int median_slice[3][BUCKET_COUNT];
+    uint64_t below_median[3][BUCKET_COUNT];
 }
 accel_cal_t;
 
+#define ACCEL_CAL_STORED_SIZE offsetof(accel_cal_t, median_slice)	/* Running medians are not part of the stored data */
+
 
 typedef double mat_input_t[MAGN_DS_SIZE][3];
 
@@ -80,6 +114,7 @@ typedef double mat_input_t[MAGN_DS_SIZE][3];
 void calibrate_compass  (int s, sensors_event_t* event);
 void compass_read_data  (int s);
 void compass_store_data (int s);
+void compass_cal_shutdown (void);
 
 void calibrate_gyro     (int s, sensors_event_t* event);
 void gyro_cal_init      (int s);
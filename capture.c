@@ -0,0 +1,124 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <log/log.h>
+#include <hardware/sensors.h>
+#include "common.h"
+#include "description.h"
+#include "capture.h"
+
+#define CAPTURE_BUFFER_SIZE	65536	/* stdio buffer size ; scans are small and we don't want a write call for each of them */
+
+static FILE*	capture_file;
+static long	capture_size;		/* Bytes written so far */
+
+
+void capture_start (void)
+{
+	/* Open the capture file and save the sensor table, if capture has been requested through ro.iio.hal.capture */
+
+	capture_header_t header;
+	sensor_info_t info;
+	int enabled = 0;
+	int ok;
+	int s;
+	int c;
+
+	if (capture_file || hal_get_prop("capture", &enabled) || !enabled)
+		return;
+
+	capture_file = fopen(CAPTURE_PATH, "w");
+
+	if (!capture_file) {
+		ALOGW("Could not create scan capture file: %s\n", strerror(errno));
+		return;
+	}
+
+	setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+	memset(&header, 0, sizeof(header));
+	header.magic		= CAPTURE_MAGIC;
+	header.version		= CAPTURE_VERSION;
+	header.info_size	= sizeof(sensor_info_t);
+	header.sensor_count	= sensor_count;
+
+	ok = fwrite(&header, sizeof(header), 1, capture_file) == 1;
+
+	/* Same treatment as for enumeration snapshots: pointers are cleared, and rebuilt by whoever replays the capture */
+	for (s=0; s<sensor_count && ok; s++) {
+		info = sensor[s];
+		info.cal_data		= NULL;
+		info.filter		= NULL;
+		info.avail_freqs	= NULL;
+		memset(&info.ops, 0, sizeof(info.ops));
+
+		for (c=0; c<MAX_CHANNELS; c++)
+			info.channel[c].decode = NULL;
+
+		ok = fwrite(&info, sizeof(info), 1, capture_file) == 1;
+	}
+
+	if (!ok) {
+		ALOGW("Could not write scan capture header\n");
+		capture_stop();
+		return;
+	}
+
+	capture_size = sizeof(header) + sensor_count * sizeof(sensor_info_t);
+	ALOGI("Capturing iio scans to %s\n", CAPTURE_PATH);
+}
+
+
+void capture_scan (int dev_num, const unsigned char* scan, int size, int64_t ts, int age)
+{
+	capture_record_t record;
+
+	if (!capture_file)
+		return;
+
+	if (capture_size + (long) sizeof(record) + size > CAPTURE_MAX_SIZE) {
+		ALOGI("Scan capture size limit reached\n");
+		capture_stop();
+		return;
+	}
+
+	record.dev_num	= dev_num;
+	record.age	= age;
+	record.size	= size;
+	record.ts	= ts;
+
+	if (fwrite(&record, sizeof(record), 1, capture_file) != 1 || fwrite(scan, size, 1, capture_file) != 1) {
+		ALOGW("Scan capture write failed\n");
+		capture_stop();
+		return;
+	}
+
+	capture_size += sizeof(record) + size;
+}
+
+
+void capture_stop (void)
+{
+	if (!capture_file)
+		return;
+
+	fclose(capture_file);
+	capture_file = NULL;
+	capture_size = 0;
+}
@@ -0,0 +1,56 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+
+/*
+ * Raw scan capture, for off-device replay of the sample pipeline (see sample-bench.c). When ro.iio.hal.capture is set to 1, the scans read
+ * from iio character devices are appended to CAPTURE_PATH, after a header holding the sensor table, channel type specs and offsets included.
+ * The file layout is: capture_header_t, sensor_count sensor_info_t entries with pointers cleared, then capture_record_t entries, each one
+ * followed by size bytes of scan data.
+ */
+
+#define CAPTURE_PATH		"/data/iio-sensors.capture"
+#define CAPTURE_MAGIC		0x43505349	/* "ISPC" */
+#define CAPTURE_VERSION		1
+#define CAPTURE_MAX_SIZE	(64 << 20)	/* Stop recording past that many bytes, so we don't fill up the data partition */
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t info_size;	/* sizeof(sensor_info_t), as the table is saved verbatim */
+	uint32_t sensor_count;
+}
+capture_header_t;
+
+typedef struct
+{
+	int32_t dev_num;
+	uint16_t age;		/* Scans read after this one in the same batch ; ts is then the date of the read, as in queue_device_scan */
+	uint16_t size;		/* Scan length, in bytes */
+	int64_t ts;
+}
+capture_record_t;
+
+void	capture_start	(void);
+void	capture_scan	(int dev_num, const unsigned char* scan, int size, int64_t ts, int age);
+void	capture_stop	(void);
+
+#endif
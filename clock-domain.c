@@ -0,0 +1,119 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <log/log.h>
+#include <hardware/sensors.h>
+#include "common.h"
+#include "utils.h"
+#include "clock-domain.h"
+
+#define CLOCK_OFFSET_REFRESH_NS	1000000000LL	/* How often we sample the boot time to real time offset			*/
+#define CLOCK_OFFSET_STEP_NS	1000000LL	/* Offset changes beyond this are real time clock being set, not drift	*/
+#define CLOCK_OFFSET_PROBES	3		/* Clock reads per refresh, we keep the tightest one			*/
+#define CLOCK_OFFSET_WEIGHT	8		/* Inverse gain of the offset low pass filter				*/
+
+static int* device_boottime;			/* Set if the device timestamps are already on CLOCK_BOOTTIME	*/
+static int boottime_count;			/* Allocated device_boottime entries				*/
+
+static int64_t boot_to_rt_offset;		/* Filtered offset, boot time minus real time			*/
+static int64_t offset_refresh_ts;		/* Boot time at which the offset gets sampled again ; 0 if never	*/
+
+
+void setup_device_clock (int dev_num)
+{
+	/* Try to get timestamps from this device using the boot time clock ; this needs a recent kernel, and the buffer to be disabled */
+
+	char sysfs_path[PATH_MAX];
+	char clock_name[MAX_NAME_SIZE];
+	int* grown;
+
+	if (dev_num >= boottime_count) {
+		grown = (int*) realloc(device_boottime, (dev_num + 1) * sizeof(int));
+
+		if (!grown)
+			return;
+
+		memset(grown + boottime_count, 0, (dev_num + 1 - boottime_count) * sizeof(int));
+		device_boottime = grown;
+		boottime_count = dev_num + 1;
+	}
+
+	sprintf(sysfs_path, CLOCK_PATH, dev_num);
+
+	device_boottime[dev_num] =	sysfs_attr_exists(sysfs_path) &&
+					sysfs_write_str(sysfs_path, "boottime") >= 0 &&
+					sysfs_read_str(sysfs_path, clock_name, sizeof(clock_name)) > 0 &&
+					!strcmp(clock_name, "boottime");
+
+	if (device_boottime[dev_num])
+		ALOGI("Using boot time clock for iio device %d timestamps\n", dev_num);
+}
+
+
+static int64_t probe_clock_offset (void)
+{
+	/* Read the real time clock between two boot time reads, several times, and return the offset measured over the tightest interval */
+
+	int64_t before, rt, after;
+	int64_t best_offset = 0;
+	int64_t best_span = INT64_MAX;
+	int i;
+
+	for (i = 0; i < CLOCK_OFFSET_PROBES; i++) {
+		before	= get_timestamp_boot();
+		rt	= get_timestamp_realtime();
+		after	= get_timestamp_boot();
+
+		if (after - before < best_span) {
+			best_span = after - before;
+			best_offset = before + (after - before) / 2 - rt;
+		}
+	}
+
+	return best_offset;
+}
+
+
+static void refresh_clock_offset (int64_t now)
+{
+	int64_t offset = probe_clock_offset();
+	int64_t delta = offset - boot_to_rt_offset;
+
+	/* Smooth out read jitter and slow drift, but follow steps, e.g. when the real time clock gets set */
+	if (!offset_refresh_ts || delta > CLOCK_OFFSET_STEP_NS || delta < -CLOCK_OFFSET_STEP_NS)
+		boot_to_rt_offset = offset;
+	else
+		boot_to_rt_offset += delta / CLOCK_OFFSET_WEIGHT;
+
+	offset_refresh_ts = now + CLOCK_OFFSET_REFRESH_NS;
+}
+
+
+int64_t device_ts_to_boot (int dev_num, int64_t ts, int64_t now)
+{
+	/* Convert a timestamp from a device report to the boot time clock ; now is a recent boot time reading, used to schedule refreshes */
+
+	if (dev_num < boottime_count && device_boottime[dev_num])
+		return ts;
+
+	if (now >= offset_refresh_ts)
+		refresh_clock_offset(now);
+
+	return ts + boot_to_rt_offset;
+}
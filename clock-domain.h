@@ -0,0 +1,31 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#ifndef __CLOCK_DOMAIN_H__
+#define __CLOCK_DOMAIN_H__
+
+#include <stdint.h>
+
+/*
+ * iio drivers timestamp samples and events using a per device clock, CLOCK_REALTIME by default, while Android expects boot time based
+ * timestamps. We ask devices to use CLOCK_BOOTTIME where the kernel allows it, and otherwise convert using a boot time to real time offset
+ * that is tracked over time rather than sampled for each report.
+ */
+
+void	setup_device_clock	(int dev_num);
+int64_t	device_ts_to_boot	(int dev_num, int64_t ts, int64_t now);
+
+#endif
@@ -23,11 +23,8 @@
 
 #define PATH_MAX 4096
 
-#define MAX_DEVICES	9	/* Check iio devices 0 to MAX_DEVICES-1 */
-#define MAX_SENSORS	12	/* We can handle as many sensors */
 #define MAX_CHANNELS	4	/* We can handle as many channels per sensor */
 #define MAX_EVENTS	2	/* We can handle as many events per channel */
-#define MAX_TRIGGERS	8	/* Check for triggers 0 to MAX_TRIGGERS-1 */
 
 #define DEV_FILE_PATH		"/dev/iio:device%d"
 #define BASE_PATH		"/sys/bus/iio/devices/iio:device%d/"
@@ -37,6 +34,7 @@
 #define CHANNEL_PATH		BASE_PATH "scan_elements/"
 #define ENABLE_PATH		BASE_PATH "buffer/enable"
 #define BUFFER_LENGTH_PATH	BASE_PATH "buffer/length"
+#define BUFFER_WATERMARK_PATH	BASE_PATH "buffer/watermark"
 #define NAME_PATH		BASE_PATH "name"
 #define TRIGGER_PATH		BASE_PATH "trigger/current_trigger"
 #define EVENTS_PATH		BASE_PATH "events/"
@@ -49,18 +47,29 @@
 #define ILLUMINATION_CALIBPATH	BASE_PATH "in_illuminance_calibscale"
 #define SENSOR_CALIB_BIAS_PATH	BASE_PATH "in_%s_calibbias"
 #define MOUNTING_MATRIX_PATH	BASE_PATH "mounting_matrix"
+#define CLOCK_PATH		BASE_PATH "current_timestamp_clock"
 
 #define CONFIGFS_TRIGGER_PATH	"/sys/kernel/config/iio/triggers/"
 
 #define PROP_BASE		"ro.iio.%s.%s" /* Note: PROPERTY_KEY_MAX is small */
+#define HAL_PROP_BASE		"ro.iio.hal.%s" /* Properties that aren't related to a specific sensor */
 
 #define MAX_TYPE_SPEC_LEN	32	/* Channel type spec len; ex: "le:u10/16>>0" */
 #define MAX_SENSOR_REPORT_SIZE	32	/* Sensor report buffer size */
 #define MAX_DEVICE_REPORT_SIZE	32	/* iio device scan buffer size */
+#define REPORT_QUEUE_SIZE	16	/* Sensor reports we can queue per sensor */
+#define THREAD_RING_SIZE	16	/* Samples an acquisition thread can queue per poll mode sensor ; power of two */
 
 #define MAX_NAME_SIZE		64
 
+#define BUFFER_LENGTH		16	/* Default iio buffer length, in scans */
+
 #define MAX_SENSOR_BASES	3	/* Max number of base sensors a sensor can rely on */
+/*
+ * Max number of virtual sensors that can be built on top of a sensor. Each virtual catalog entry is instantiated at most once per base sensor,
+ * so this only needs to cover the virtual entries of the catalog ; keeping it a fixed array lets sensor_info_t be snapshotted as is.
+ */
+#define MAX_SENSOR_DEPENDENTS	4
 
 #define ARRAY_SIZE(x) sizeof(x)/sizeof(x[0])
 #define REPORTING_MODE(x)	((x) & 0x06)
@@ -68,6 +77,7 @@
 #define FILTER_TYPE_NONE		0
 #define FILTER_TYPE_MOVING_AVERAGE	1
 #define FILTER_TYPE_MEDIAN		2
+#define FILTER_TYPE_EXPONENTIAL		3
 
 #define MODE_AUTO	0 /* autodetect */
 #define MODE_POLL	1
@@ -137,12 +147,15 @@ typedef struct
 	float scale;	/* Scale for each channel */
 	char type_spec[MAX_TYPE_SPEC_LEN];	/* From driver; ex: le:u10/16>>0 */
 	datum_info_t type_info;	   		/* Decoded contents of type spec */
+	int64_t (*decode) (const unsigned char* sample, const datum_info_t* type);	/* Extraction routine matching type_info */
 	float opt_scale; /*
 			  * Optional correction scale read from a property such as iio.accel.x.scale, allowing late compensation of
 			  * problems such as misconfigured axes ; set to 1 by default. Applied at the end of the scaling process.
 			  */
 	int raw_path_present;   /* Flag signalling the presence of in_<sens>_<axis>_raw file */
 	int input_path_present; /* Flag signalling the presence of in_<sens>_input file */
+	int raw_fd;		/* Cached fd on the _raw file, for poll mode acquisition ; -1 if not open   */
+	int input_fd;		/* Cached fd on the _input file, for poll mode acquisition ; -1 if not open */
 }
 channel_info_t;
 
@@ -152,12 +165,34 @@ typedef struct
 	/* Conversion function called once per channel */
 	float (*transform) (int s, int c, unsigned char* sample_data);
 
+	/* Optional conversion function handling all channels of a sample in a single call ; used instead of transform when set */
+	void (*transform_sample) (int s, unsigned char* sample_data, float* data);
+
 	/* Function called once per sample */
 	int (*finalize) (int s, sensors_event_t* data);
+
+	/* For virtual sensors: function deriving a sample from a finalized sample of one of the base sensors */
+	void (*derive) (int base, int s, sensors_event_t* data);
 }
 sample_ops_t;
 
 
+typedef struct
+{
+	unsigned char data[MAX_SENSOR_REPORT_SIZE];	/* Sensor report, extracted from a device scan */
+	int64_t ts;					/* Associated timestamp */
+}
+queued_report_t;
+
+
+typedef struct
+{
+	int offset;	/* Offset of a run of contiguous channels within device scans	*/
+	int size;	/* Run length, in bytes						*/
+}
+scan_copy_t;
+
+
 /*
  * Whenever we have sensor data recorded for a sensor in the associated
  * sensor cell, its report_pending field is set to a non-zero value
@@ -168,6 +203,49 @@ sample_ops_t;
 #define DATA_DUPLICATE	3	/* Duplicate of triggered motion sample	*/
 
 
+/*
+ * Per sensor state that the poll loop checks on every wakeup, for every sensor. It is kept in its own compact array rather than in the large
+ * sensor_info_t structure, so that scans over the sensor collection only touch a few cache lines. None of it survives a HAL restart.
+ */
+typedef struct
+{
+	/*
+	 * This flag is set if we acquired data from the sensor but did not forward it to upper layers (i.e. Android) yet. If so, report_buffer
+	 * contains that data. Valid values are 0: empty, 1: normal, 2: repeat of last acquired value after timeout.
+	 */
+	int report_pending;
+
+	/* This flag is set if we have a meta data event pending */
+	int meta_data_pending;
+
+	/* Count of reports waiting in the sensor's report queue */
+	int report_queue_count;
+
+	/* Whether or not the report buffer contains data from a device report */
+	int report_initialized;
+
+	uint32_t ref_count;		/* Dependency count - for a real sensor how many active virtual sensors are depending on it */
+
+	uint32_t directly_enabled;	/* Flag showing if a sensor was enabled directly by Android */
+
+	uint32_t direct_enabled;	/* Flag showing if a sensor is enabled on behalf of direct report channels */
+
+	/*
+	 * Timestamp closely matching the date of sampling, preferably retrieved from a iio channel alongside sample data. Value zero indicates that
+	 * we couldn't get such a closely correlated timestamp, and that one has to be generated before the report gets sent up to Android.
+	 */
+	int64_t report_ts;
+
+	/*
+	 * Currently active trigger - either a pointer to the initial (default) trigger name buffer, or a pointer to the motion trigger name buffer,
+	 * or something else (typically NULL or a pointer to some static "\n". This is used to determine if the conditions are met to switch from
+	 * the default trigger to the motion trigger for a sensor, or rather for the interrupt-driven sensors associated to a given iio device.
+	 */
+	const char* selected_trigger;
+}
+sensor_state_t;
+
+
 typedef struct
 {
 	char friendly_name[MAX_NAME_SIZE];	/* ex: Accelerometer	     */
@@ -181,18 +259,12 @@ typedef struct
 	float resolution;
 	float power;
 
-	/*
-	 * Currently active trigger - either a pointer to the initial (default) trigger name buffer, or a pointer to the motion trigger name buffer,
-	 * or something else (typically NULL or a pointer to some static "\n". This is used to determine if the conditions are met to switch from
-	 * the default trigger to the motion trigger for a sensor, or rather for the interrupt-driven sensors associated to a given iio device.
-	 */
-	const char* selected_trigger;
-
 	float offset;		/* (cooked = raw + offset) * scale			*/
 	float scale;		/* default:1. when set to 0, use channel specific value */
 	float illumincalib;	/* to set the calibration for the ALS			*/
 
 	float requested_rate;   /* requested events / second				*/
+	float direct_rate;	/* events / second needed by direct report channels	*/
 	float sampling_rate;	/* setup events / second				*/
 
 	float min_supported_rate;
@@ -214,26 +286,12 @@ typedef struct
 	 */
 	channel_info_t channel[MAX_CHANNELS];
 
-	/*
-	 * This flag is set if we acquired data from the sensor but did not forward it to upper layers (i.e. Android) yet. If so, report_buffer
-	 * contains that data. Valid values are 0: empty, 1: normal, 2: repeat of last acquired value after timeout.
-	 */
-	int report_pending;
-
-	/* This flag is set if we have a meta data event pending */
-	int meta_data_pending;
-
-	/*
-	 * Timestamp closely matching the date of sampling, preferably retrieved from a iio channel alongside sample data. Value zero indicates that
-	 * we couldn't get such a closely correlated timestamp, and that one has to be generated before the report gets sent up to Android.
-	 */
-	int64_t report_ts;
-
 	/* Buffer containing the last generated sensor report for this sensor */
 	unsigned char report_buffer[MAX_SENSOR_REPORT_SIZE];
 
-	/* Whether or not the above buffer contains data from a device report */
-	int report_initialized;
+	/* How to gather this sensor's report from a device scan: channel data, merged into as few copies as possible */
+	scan_copy_t report_copy[MAX_CHANNELS];
+	int report_copy_count;
 
 	/* Channel and sample finalization callbacks for this sensor */
 	sample_ops_t ops;
@@ -257,25 +315,34 @@ typedef struct
 	} prev_val;
 	/*
 	 * Certain sensors expose their readings through sysfs files that have a long response time (100-200 ms for ALS). Rather than block our
-	 * global control loop for several hundred ms each second, offload those lengthy blocking reads to dedicated threads, which will then report
-	 * their data through a fd that we can add to our poll fd set.
+	 * global control loop for several hundred ms each second, offload those lengthy blocking reads to dedicated threads, which will then queue
+	 * their samples in a single producer / single consumer ring (see control.c) and signal them through an eventfd that we can add to our poll
+	 * fd set.
 	 */
-	int thread_data_fd[2];
+	int thread_data_fd;		/* eventfd ; -1 when the sensor is not being sampled, which also serves as an exit flag	*/
 	pthread_t acquisition_thread;
 
+	/* When poll mode sensors are served by the shared acquisition thread: next sampling date on the monotonic clock, and activation flag */
+	int64_t poll_deadline;
+	int poll_scheduled;
+
 	int base_count;	/* How many base sensors is the sensor depending on */
 	int base[MAX_SENSOR_BASES];
 
+	/*
+	 * Reverse links: virtual sensors built on top of this sensor, set up once at enumeration time, and the subset of these that is currently
+	 * enabled, maintained on activation, so that samples only get propagated where they are needed. The active count is state.ref_count.
+	 */
+	int dependent_count;
+	int dependent[MAX_SENSOR_DEPENDENTS];
+	int active_dependent[MAX_SENSOR_DEPENDENTS];
+
 	uint32_t quirks; /* Bit mask expressing the need for special tweaks */
 
 	/* Note: we may have to explicitely serialize access to some fields */
 
 	int is_virtual;			/* Composite sensor, exposed from data acquired through other sensors */
 
-	uint32_t ref_count;		/* Dependency count - for a real sensor how many active virtual sensors are depending on it */
-
-	uint32_t directly_enabled;	/* Flag showing if a sensor was enabled directly by Android */
-
 	/*
 	 * Current sample for a virtual sensor - when a report is ready we'll keep the data here until it's finally processed. Can be modified for
 	 * more than one at a later time.
@@ -296,6 +363,13 @@ typedef struct
 	 */
 	float mounting_matrix[9];
 
+	/*
+	 * Affine correction used by the fused 3-axis conversion routine: data = correction_matrix * raw + correction_offset. It folds the offset,
+	 * scales, field ordering and mounting matrix, and is computed when the sensor transform is selected.
+	 */
+	float correction_matrix[9];
+	float correction_offset[3];
+
 	/** Count of available frequencies */
 	int avail_freqs_count;
 
@@ -315,14 +389,18 @@ typedef struct
 	int needs_enable;
 
 	float semi_arbitrated_rate;	/* Arbitrated sampling rate before we considered other sensors co-located on the same iio device */
+
+	int64_t max_report_latency;	/* Batching latency requested by Android, in ns ; 0 means samples are to be reported immediately */
 }
 sensor_info_t;
 
 
 /* Reference a few commonly used variables... */
 extern int			sensor_count;
-extern struct sensor_t		sensor_desc[MAX_SENSORS];
-extern sensor_info_t		sensor[MAX_SENSORS];
+extern struct sensor_t*		sensor_desc;	/* Sized from enumeration results, see reserve_sensor_entries	*/
+extern sensor_info_t*		sensor;
+extern sensor_state_t*		sensor_state;
+extern int			device_count;	/* Highest iio device number found at init time, plus one	*/
 extern sensor_catalog_entry_t	sensor_catalog[];
 extern unsigned int		catalog_size;
 
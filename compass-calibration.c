@@ -15,6 +15,10 @@
 */
 
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <hardware/sensors.h>
 #include <stdio.h>
 #include <log/log.h>
@@ -25,7 +29,6 @@
 
 /* Compass defines */
 #define COMPASS_CALIBRATION_PATH    "/data/compass.conf"
-#define EPSILON                     0.000000001
 
 #define MAGNETIC_LOW                960 /* 31 micro tesla squared */
 #define CAL_STEPS                   5
@@ -36,12 +39,63 @@ static const float          min_diffs       [CAL_STEPS] = {0.2,  0.25, 0.4, 0.6,
 static const float          max_sqr_errs    [CAL_STEPS] = {10.0, 10.0, 8.0, 5.0, 3.5};
 static const unsigned int   lookback_counts [CAL_STEPS] = {2,    3,    4,   5,   6  };
 
+/* In streaming mode, points have to land in distinct bins of a grid with that edge size, in micro tesla, to be selected */
+static const float          bin_sizes       [CAL_STEPS] = {2.0,  2.5,  4.0, 6.0, 10.0};
+
+/*
+ * Streaming mode sums are decayed by STREAM_DECAY on each selected point, so they weigh about the last STREAM_MEMORY points, and a new fit
+ * is attempted every STREAM_FIT_INTERVAL selected points once they weigh at least as much as a full sample set.
+ */
+#define STREAM_MEMORY               64
+#define STREAM_DECAY                (1 - 1.0 / STREAM_MEMORY)
+#define STREAM_FIT_INTERVAL         8
+#define STREAM_MIN_WEIGHT           MAGN_DS_SIZE
+
+/*
+ * Ellipsoid fitting is too expensive to run from the poll loop, so it gets handed over to a low priority worker thread along with a copy of
+ * the selection data ; collection of the next sample set proceeds meanwhile. Fit results are applied from the poll loop, at a sample boundary,
+ * so that compass_compute_cal always sees a consistent set of parameters. The worker also takes care of writing calibration data to storage.
+ */
+#define FIT_RUNNING     1   /* Job submitted, worker busy with it           */
+#define FIT_ACCEPTED    2   /* New parameters available in result           */
+#define FIT_REJECTED    3   /* Fit failed or did not improve on current one */
+
+#define CAL_WORKER_NICE 10
+#define STORE_BUF_SIZE  512
+
+typedef struct
+{
+    compass_cal_t* target;  /* Calibration data the job was submitted for ; NULL if the slot is free */
+    compass_cal_t input;    /* Selection data, and parameters in use at submission time */
+    compass_cal_t result;   /* Fitted parameters */
+    float max_sqr_err;
+    int state;
+}
+fit_job_t;
+
+static fit_job_t        fit_job;
+static pthread_t        cal_worker;
+static int              cal_worker_started;
+static int              cal_worker_exit;
+static pthread_mutex_t  cal_worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   cal_worker_cond = PTHREAD_COND_INITIALIZER;    /* Work available           */
+static pthread_cond_t   fit_done_cond = PTHREAD_COND_INITIALIZER;      /* A fit job just completed */
+static char             store_buf[STORE_BUF_SIZE];                     /* Pending compass.conf contents */
+static int              store_pending;
+
 
 /* Reset calibration algorithm */
 static void reset_sample (compass_cal_t* data)
 {
     int i,j;
     data->sample_count = 0;
+
+    if (data->streaming) {
+        memset(data->sums, 0, sizeof(data->sums));
+        memset(data->grid, 0, sizeof(data->grid));
+        return;
+    }
+
     for (i = 0; i < MAGN_DS_SIZE; i++)
         for (j=0; j < 3; j++)
             data->sample[i][j] = 0;
@@ -50,6 +104,22 @@ static void reset_sample (compass_cal_t* data)
 }
 
 
+static double get_sum (const double sums[FIT_SUMS], int i, int j)
+{
+    /* Symmetric access to the sum of products of fit terms i and j */
+
+    int t;
+
+    if (i > j) {
+        t = i;
+        i = j;
+        j = t;
+    }
+
+    return sums[i * FIT_TERMS - i * (i - 1) / 2 + j - i];
+}
+
+
 static double calc_square_err (compass_cal_t* data)
 {
     double err = 0;
@@ -67,8 +137,8 @@ static double calc_square_err (compass_cal_t* data)
         stdev[1] += (raw[1][0] - data->average[1]) * (raw[1][0] - data->average[1]);
         stdev[2] += (raw[2][0] - data->average[2]) * (raw[2][0] - data->average[2]);
 
-        substract (3, 1, raw, data->offset, mat_diff);
-        multiply(3, 3, 1, data->w_invert, mat_diff, result);
+        substract_3x1(raw, data->offset, mat_diff);
+        multiply_3x3_3x1(data->w_invert, mat_diff, result);
 
         diff = sqrt(result[0][0] * result[0][0] + result[1][0] * result[1][0] + result[2][0] * result[2][0]) - data->bfield;
 
@@ -88,112 +158,16 @@ static double calc_square_err (compass_cal_t* data)
 }
 
 
-/* Given an real symmetric 3x3 matrix A, compute the eigenvalues */
-static void compute_eigenvalues (double mat[3][3], double* eig1, double* eig2, double* eig3)
+static int ellipsoid_from_params (double p[9][1], double offset[3][1], double w_invert[3][3], double* bfield)
 {
-    double p = mat[0][1] * mat[0][1] + mat[0][2] * mat[0][2] + mat[1][2] * mat[1][2];
-
-    if (p < EPSILON) {
-        *eig1 = mat[0][0];
-        *eig2 = mat[1][1];
-        *eig3 = mat[2][2];
-        return;
-    }
-
-    double q = (mat[0][0] + mat[1][1] + mat[2][2]) / 3;
-    double temp1 = mat[0][0] - q;
-    double temp2 = mat[1][1] - q;
-    double temp3 = mat[2][2] - q;
-
-    p = temp1 * temp1 + temp2 * temp2 + temp3 * temp3 + 2 * p;
-    p = sqrt(p / 6);
-
-    double mat2[3][3];
-    assign(3, 3, mat, mat2);
-    mat2[0][0] -= q;
-    mat2[1][1] -= q;
-    mat2[2][2] -= q;
-    multiply_scalar_inplace(3, 3, mat2, 1/p);
-
-    double r = (mat2[0][0] * mat2[1][1] * mat2[2][2] + mat2[0][1] * mat2[1][2] * mat2[2][0]
-        + mat2[0][2] * mat2[1][0] * mat2[2][1] - mat2[0][2] * mat2[1][1] * mat2[2][0]
-        - mat2[0][0] * mat2[1][2] * mat2[2][1] - mat2[0][1] * mat2[1][0] * mat2[2][2]) / 2;
-
-    double phi;
-    if (r <= -1.0)
-        phi = M_PI/3;
-    else if (r >= 1.0)
-            phi = 0;
-        else
-            phi = acos(r) / 3;
+    /* Derive hard and soft iron corrections from the least squares solution of the ellipsoid equation */
 
-    *eig3 = q + 2 * p * cos(phi);
-    *eig1 = q + 2 * p * cos(phi + 2 * M_PI / 3);
-    *eig2 = 3 * q - *eig1 - *eig3;
-}
-
-
-static void calc_evector (double mat[3][3], double eig, double vec[3][1])
-{
-    double h[3][3];
-    double x_tmp[2][2];
-    assign(3, 3, mat, h);
-    h[0][0] -= eig;
-    h[1][1] -= eig;
-    h[2][2] -= eig;
-
-    double x[2][2];
-    x[0][0] = h[1][1];
-    x[0][1] = h[1][2];
-    x[1][0] = h[2][1];
-    x[1][1] = h[2][2];
-    invert(2, x, x_tmp);
-    assign(2, 2, x_tmp, x);
-
-    double temp1 = x[0][0] * (-h[1][0]) + x[0][1] * (-h[2][0]);
-    double temp2 = x[1][0] * (-h[1][0]) + x[1][1] * (-h[2][0]);
-    double norm = sqrt(1 + temp1 * temp1 + temp2 * temp2);
-
-    vec[0][0] = 1.0 / norm;
-    vec[1][0] = temp1 / norm;
-    vec[2][0] = temp2 / norm;
-}
-
-
-static int ellipsoid_fit (mat_input_t m, double offset[3][1], double w_invert[3][3], double* bfield)
-{
-    int i;
-    double h[MAGN_DS_SIZE][9];
-    double w[MAGN_DS_SIZE][1];
-    double h_trans[9][MAGN_DS_SIZE];
-    double p_temp1[9][9];
-    double p_temp2[9][MAGN_DS_SIZE];
     double temp1[3][3], temp[3][3];
     double temp1_inv[3][3];
     double temp2[3][1];
-    double result[9][9];
-    double p[9][1];
     double a[3][3], sqrt_evals[3][3], evecs[3][3], evecs_trans[3][3];
-    double evec1[3][1], evec2[3][1], evec3[3][1];
+    double evals[3];
 
-    for (i = 0; i < MAGN_DS_SIZE; i++) {
-        w[i][0] = m[i][0] * m[i][0];
-        h[i][0] = m[i][0];
-        h[i][1] = m[i][1];
-        h[i][2] = m[i][2];
-        h[i][3] = -1 * m[i][0] * m[i][1];
-        h[i][4] = -1 * m[i][0] * m[i][2];
-        h[i][5] = -1 * m[i][1] * m[i][2];
-        h[i][6] = -1 * m[i][1] * m[i][1];
-        h[i][7] = -1 * m[i][2] * m[i][2];
-        h[i][8] = 1;
-    }
-
-    transpose (MAGN_DS_SIZE, 9, h, h_trans);
-    multiply (9, MAGN_DS_SIZE, 9, h_trans, h, result);
-    invert (9, result, p_temp1);
-    multiply (9, 9, MAGN_DS_SIZE, p_temp1, h_trans, p_temp2);
-    multiply (9, MAGN_DS_SIZE, 1, p_temp2, w, p);
 
     temp1[0][0] = 2;
     temp1[0][1] = p[3][0];
@@ -209,8 +183,10 @@ static int ellipsoid_fit (mat_input_t m, double offset[3][1], double w_invert[3]
     temp2[1][0] = p[1][0];
     temp2[2][0] = p[2][0];
 
-    invert(3, temp1, temp1_inv);
-    multiply(3, 3, 1, temp1_inv, temp2, offset);
+    if (!invert_3x3(temp1, temp1_inv))
+        return 0;
+
+    multiply_3x3_3x1(temp1_inv, temp2, offset);
     double off_x = offset[0][0];
     double off_y = offset[1][0];
     double off_z = offset[2][0];
@@ -228,8 +204,9 @@ static int ellipsoid_fit (mat_input_t m, double offset[3][1], double w_invert[3]
     a[1][0] = a[0][1];
     a[2][0] = a[0][2];
 
-    double eig1 = 0, eig2 = 0, eig3 = 0;
-    compute_eigenvalues(a, &eig1, &eig2, &eig3);
+    eigen_3x3_sym(a, evals, evecs);
+
+    double eig1 = evals[0], eig2 = evals[1], eig3 = evals[2];
 
     if (eig1 <=0 || eig2 <= 0 || eig3 <= 0)
         return 0;
@@ -244,24 +221,10 @@ static int ellipsoid_fit (mat_input_t m, double offset[3][1], double w_invert[3]
     sqrt_evals[1][2] = 0;
     sqrt_evals[2][2] = sqrt(eig3);
 
-    calc_evector(a, eig1, evec1);
-    calc_evector(a, eig2, evec2);
-    calc_evector(a, eig3, evec3);
-
-    evecs[0][0] = evec1[0][0];
-    evecs[1][0] = evec1[1][0];
-    evecs[2][0] = evec1[2][0];
-    evecs[0][1] = evec2[0][0];
-    evecs[1][1] = evec2[1][0];
-    evecs[2][1] = evec2[2][0];
-    evecs[0][2] = evec3[0][0];
-    evecs[1][2] = evec3[1][0];
-    evecs[2][2] = evec3[2][0];
-
-    multiply (3, 3, 3, evecs, sqrt_evals, temp1);
-    transpose(3, 3, evecs, evecs_trans);
-    multiply (3, 3, 3, temp1, evecs_trans, temp);
-    transpose (3, 3, temp, w_invert);
+    multiply_3x3(evecs, sqrt_evals, temp1);
+    transpose_3x3(evecs, evecs_trans);
+    multiply_3x3(temp1, evecs_trans, temp);
+    transpose_3x3(temp, w_invert);
 
     *bfield = pow(sqrt(1/eig1) * sqrt(1/eig2) * sqrt(1/eig3), 1.0/3.0);
 
@@ -274,6 +237,298 @@ static int ellipsoid_fit (mat_input_t m, double offset[3][1], double w_invert[3]
 }
 
 
+static int ellipsoid_fit (mat_input_t m, double offset[3][1], double w_invert[3][3], double* bfield)
+{
+    int i;
+    double h[MAGN_DS_SIZE][9];
+    double w[MAGN_DS_SIZE][1];
+    double h_trans[9][MAGN_DS_SIZE];
+    double p_temp1[9][9];
+    double p_temp2[9][MAGN_DS_SIZE];
+    double result[9][9];
+    double p[9][1];
+
+    for (i = 0; i < MAGN_DS_SIZE; i++) {
+        w[i][0] = m[i][0] * m[i][0];
+        h[i][0] = m[i][0];
+        h[i][1] = m[i][1];
+        h[i][2] = m[i][2];
+        h[i][3] = -1 * m[i][0] * m[i][1];
+        h[i][4] = -1 * m[i][0] * m[i][2];
+        h[i][5] = -1 * m[i][1] * m[i][2];
+        h[i][6] = -1 * m[i][1] * m[i][1];
+        h[i][7] = -1 * m[i][2] * m[i][2];
+        h[i][8] = 1;
+    }
+
+    transpose (MAGN_DS_SIZE, 9, h, h_trans);
+    multiply (9, MAGN_DS_SIZE, 9, h_trans, h, result);
+    invert (9, result, p_temp1);
+    multiply (9, 9, MAGN_DS_SIZE, p_temp1, h_trans, p_temp2);
+    multiply (9, MAGN_DS_SIZE, 1, p_temp2, w, p);
+
+    return ellipsoid_from_params(p, offset, w_invert, bfield);
+}
+
+
+static void fit_terms (const float data[3], double z[FIT_TERMS])
+{
+    /* Terms of the ellipsoid equation for a point, as used in the design matrix of ellipsoid_fit, followed by the regressed x² term */
+
+    double x = data[0], y = data[1], zz = data[2];
+
+    z[0] = x;
+    z[1] = y;
+    z[2] = zz;
+    z[3] = -1 * x * y;
+    z[4] = -1 * x * zz;
+    z[5] = -1 * y * zz;
+    z[6] = -1 * y * y;
+    z[7] = -1 * zz * zz;
+    z[8] = 1;
+    z[9] = x * x;
+}
+
+
+static int ellipsoid_fit_sums (const double sums[FIT_SUMS], double offset[3][1], double w_invert[3][3], double* bfield)
+{
+    /* Same fit as ellipsoid_fit, from accumulated normal equation sums: the cost does not depend on how many points were collected */
+
+    double hth[9][9], hth_inv[9][9];
+    double htw[9][1];
+    double p[9][1];
+    int i, j;
+
+    for (i = 0; i < 9; i++) {
+        for (j = 0; j < 9; j++)
+            hth[i][j] = get_sum(sums, i, j);
+
+        htw[i][0] = get_sum(sums, i, 9);
+    }
+
+    invert (9, hth, hth_inv);
+    multiply (9, 9, 1, hth_inv, htw, p);
+
+    return ellipsoid_from_params(p, offset, w_invert, bfield);
+}
+
+
+static double calc_square_err_sums (compass_cal_t* data)
+{
+    /*
+     * Estimate calc_square_err from the normal equation sums. With M = W'W / bfield², a point x lies on the fitted sphere when
+     * q = (x - offset)' M (x - offset) is 1, and its distance to it is bfield * (sqrt(q) - 1), about bfield * (q - 1) / 2. As q - 1 is a linear
+     * combination c of the fit terms, the mean of its square over collected points is c' S c / n.
+     */
+
+    double n = get_sum(data->sums, 8, 8);
+    double mean[3], var[3];
+    double m[3][3], m_off[3];
+    double c[FIT_TERMS];
+    double e = 0;
+    int i, j, k;
+
+    if (n < 1)
+        return max_sqr_errs[0];
+
+    /* Same sanity check on the variation of each axis as calc_square_err */
+    for (k = 0; k < 3; k++)
+        mean[k] = get_sum(data->sums, k, 8) / n;
+
+    var[0] = get_sum(data->sums, 8, 9) / n - mean[0] * mean[0];
+    var[1] = -get_sum(data->sums, 6, 8) / n - mean[1] * mean[1];
+    var[2] = -get_sum(data->sums, 7, 8) / n - mean[2] * mean[2];
+
+    if (var[0] <= 1 || var[1] <= 1 || var[2] <= 1)
+        return max_sqr_errs[0];
+
+    /* Uncalibrated parameters don't describe a sphere ; anything acceptable beats them */
+    if (data->bfield <= 0)
+        return INFINITY;
+
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 3; j++) {
+            m[i][j] = 0;
+            for (k = 0; k < 3; k++)
+                m[i][j] += data->w_invert[k][i] * data->w_invert[k][j];
+            m[i][j] /= data->bfield * data->bfield;
+        }
+
+    for (i = 0; i < 3; i++)
+        m_off[i] = m[i][0] * data->offset[0][0] + m[i][1] * data->offset[1][0] + m[i][2] * data->offset[2][0];
+
+    c[0] = -2 * m_off[0];
+    c[1] = -2 * m_off[1];
+    c[2] = -2 * m_off[2];
+    c[3] = -2 * m[0][1];
+    c[4] = -2 * m[0][2];
+    c[5] = -2 * m[1][2];
+    c[6] = -m[1][1];
+    c[7] = -m[2][2];
+    c[8] = m_off[0] * data->offset[0][0] + m_off[1] * data->offset[1][0] + m_off[2] * data->offset[2][0] - 1;
+    c[9] = m[0][0];
+
+    for (i = 0; i < FIT_TERMS; i++)
+        for (j = 0; j < FIT_TERMS; j++)
+            e += c[i] * c[j] * get_sum(data->sums, i, j);
+
+    return data->bfield * data->bfield * (e / n) / 4;
+}
+
+
+static int run_fit_job (fit_job_t* job)
+{
+    /* Runs on the calibration worker, without holding the worker lock ; returns the job outcome */
+
+    mat_input_t mat;
+    int i;
+    int fitted;
+    compass_cal_t* cal_data = &job->input;
+    compass_cal_t* new_cal_data = &job->result;
+    double (*square_err) (compass_cal_t* data) = cal_data->streaming ? calc_square_err_sums : calc_square_err;
+
+    /* Check if result is good. The sample data must remain the same */
+    *new_cal_data = *cal_data;
+
+    if (cal_data->streaming)
+        fitted = ellipsoid_fit_sums(cal_data->sums, new_cal_data->offset, new_cal_data->w_invert, &new_cal_data->bfield);
+    else {
+        for (i = 0; i < MAGN_DS_SIZE; i++) {
+           mat[i][0] = cal_data->sample[i][0];
+           mat[i][1] = cal_data->sample[i][1];
+           mat[i][2] = cal_data->sample[i][2];
+        }
+
+        fitted = ellipsoid_fit(mat, new_cal_data->offset, new_cal_data->w_invert, &new_cal_data->bfield);
+    }
+
+    if (fitted) {
+        double new_err = square_err (new_cal_data);
+        ALOGI("new err is %f, max sqr err id %f", new_err, job->max_sqr_err);
+        if (new_err < job->max_sqr_err) {
+            double err = square_err(cal_data);
+            if (new_err < err) {
+                /* New cal data is better, so we switch to the new */
+                ALOGV("CompassCalibration: ready check success, caldata: %f %f %f %f %f %f %f %f %f %f %f %f %f, err %f",
+                    new_cal_data->offset[0][0], new_cal_data->offset[1][0], new_cal_data->offset[2][0], new_cal_data->w_invert[0][0],
+                    new_cal_data->w_invert[0][1], new_cal_data->w_invert[0][2], new_cal_data->w_invert[1][0], new_cal_data->w_invert[1][1],
+                    new_cal_data->w_invert[1][2], new_cal_data->w_invert[2][0], new_cal_data->w_invert[2][1], new_cal_data->w_invert[2][2],
+                    new_cal_data->bfield, new_err);
+                return FIT_ACCEPTED;
+            }
+        }
+    }
+
+    return FIT_REJECTED;
+}
+
+
+static void* cal_worker_routine (__attribute__((unused)) void* param)
+{
+    char buf[STORE_BUF_SIZE];
+    FILE* data_file;
+    int store;
+    int outcome;
+
+    /* Run behind the poll and acquisition threads */
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), CAL_WORKER_NICE))
+        ALOGW("Could not lower compass calibration worker priority\n");
+
+    pthread_mutex_lock(&cal_worker_mutex);
+
+    for (;;) {
+        store = store_pending;
+
+        if (store) {
+            memcpy(buf, store_buf, sizeof(buf));
+            store_pending = 0;
+        }
+
+        if (!store && !(fit_job.target && fit_job.state == FIT_RUNNING)) {
+            if (cal_worker_exit)
+                break;
+
+            pthread_cond_wait(&cal_worker_cond, &cal_worker_mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&cal_worker_mutex);
+
+        if (store) {
+            data_file = fopen (COMPASS_CALIBRATION_PATH, "w");
+
+            if (data_file == NULL || fputs(buf, data_file) < 0)
+                ALOGE ("Compass calibration - store data failed!");
+
+            if (data_file)
+                fclose(data_file);
+
+            pthread_mutex_lock(&cal_worker_mutex);
+            continue;
+        }
+
+        outcome = run_fit_job(&fit_job);
+
+        pthread_mutex_lock(&cal_worker_mutex);
+
+        fit_job.state = outcome;
+        pthread_cond_broadcast(&fit_done_cond);
+    }
+
+    pthread_mutex_unlock(&cal_worker_mutex);
+    return NULL;
+}
+
+
+static void start_cal_worker (void)
+{
+    /* Call with cal_worker_mutex held */
+
+    if (cal_worker_started)
+        return;
+
+    cal_worker_exit = 0;
+
+    if (pthread_create(&cal_worker, NULL, cal_worker_routine, NULL)) {
+        ALOGE("Could not start compass calibration worker\n");
+        return;
+    }
+
+    cal_worker_started = 1;
+}
+
+
+static void release_fit_job (compass_cal_t* cal_data)
+{
+    /* Wait for any fit in progress on this calibration data, and drop its outcome */
+
+    pthread_mutex_lock(&cal_worker_mutex);
+
+    while (fit_job.target == cal_data && fit_job.state == FIT_RUNNING)
+        pthread_cond_wait(&fit_done_cond, &cal_worker_mutex);
+
+    if (fit_job.target == cal_data)
+        fit_job.target = NULL;
+
+    pthread_mutex_unlock(&cal_worker_mutex);
+}
+
+
+static void update_compute_params (compass_cal_t* cal_data)
+{
+    /* Refresh the single precision copy of the correction parameters that's applied to every sample */
+
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        cal_data->offset_f[i] = cal_data->offset[i][0];
+
+        for (j = 0; j < 3; j++)
+            cal_data->w_invert_f[i * 3 + j] = cal_data->w_invert[i][j];
+    }
+}
+
+
 static void compass_cal_init (FILE* data_file, sensor_info_t* info)
 {
     compass_cal_t* cal_data = (compass_cal_t*) info->cal_data;
@@ -284,6 +539,10 @@ static void compass_cal_init (FILE* data_file, sensor_info_t* info)
         return;
 
     int data_count = 15;
+
+    /* A fit running on samples from a previous session must not override what we load */
+    release_fit_job(cal_data);
+
     reset_sample(cal_data);
 
     if (!info->cal_level && data_file != NULL) {
@@ -322,26 +581,56 @@ static void compass_cal_init (FILE* data_file, sensor_info_t* info)
 
         cal_data->bfield = 0;
     }
+
+    update_compute_params(cal_data);
 }
 
 
-static void compass_store_result (FILE* data_file, sensor_info_t* info)
+static void compass_store_result (char buf[STORE_BUF_SIZE], sensor_info_t* info)
 {
     compass_cal_t* cal_data = (compass_cal_t*) info->cal_data;
 
-    if (data_file == NULL || cal_data == NULL)
-        return;
-
-    int ret = fprintf(data_file, "%f %d %f %f %f %f %f %f %f %f %f %f %f %f %f\n",
+    snprintf(buf, STORE_BUF_SIZE, "%f %d %f %f %f %f %f %f %f %f %f %f %f %f %f\n",
         CAL_VERSION, info->cal_level,
         cal_data->offset[0][0], cal_data->offset[1][0], cal_data->offset[2][0],
         cal_data->w_invert[0][0], cal_data->w_invert[0][1], cal_data->w_invert[0][2],
         cal_data->w_invert[1][0], cal_data->w_invert[1][1], cal_data->w_invert[1][2],
         cal_data->w_invert[2][0], cal_data->w_invert[2][1], cal_data->w_invert[2][2],
         cal_data->bfield);
+}
+
 
-    if (ret < 0)
-        ALOGE ("Compass calibration - store data failed!");
+static int compass_collect_streaming (const float data[3], sensor_info_t* info, compass_cal_t* cal_data)
+{
+    /*
+     * Only accept points falling in a bin of the space grid that's not occupied since the last fit, so they get spread around the sphere,
+     * then age the normal equation sums and add the point terms to them. Bins are hashed to a fixed size bitmap, so an occasional collision
+     * just rejects a point.
+     */
+    float bin_size = bin_sizes[info->cal_level];
+    int32_t bx = (int32_t) floorf(data[0] / bin_size);
+    int32_t by = (int32_t) floorf(data[1] / bin_size);
+    int32_t bz = (int32_t) floorf(data[2] / bin_size);
+    unsigned int bin = (((uint32_t) bx * 73856093u) ^ ((uint32_t) by * 19349663u) ^ ((uint32_t) bz * 83492791u)) % COMPASS_GRID_BINS;
+    double z[FIT_TERMS];
+    int i, j, k;
+
+    if (cal_data->grid[bin / 32] & (1u << (bin % 32))) {
+        ALOGV("CompassCalibration:point reject: [%f,%f,%f], selected_count=%d", data[0], data[1], data[2], cal_data->sample_count);
+        return 0;
+    }
+
+    cal_data->grid[bin / 32] |= 1u << (bin % 32);
+
+    fit_terms(data, z);
+
+    for (i = 0, k = 0; i < FIT_TERMS; i++)
+        for (j = i; j < FIT_TERMS; j++, k++)
+            cal_data->sums[k] = cal_data->sums[k] * STREAM_DECAY + z[i] * z[j];
+
+    cal_data->sample_count++;
+    ALOGV("CompassCalibration:point collected [%f,%f,%f], selected_count=%d", (double)data[0], (double)data[1], (double)data[2], cal_data->sample_count);
+    return 1;
 }
 
 
@@ -361,6 +650,9 @@ static int compass_collect (sensors_event_t* event, sensor_info_t* info)
     if (data[0] == 0 || data[1] == 0 || data[2] == 0)
         return -1;
 
+    if (cal_data->streaming)
+        return compass_collect_streaming(data, info, cal_data);
+
     lookback_count = lookback_counts[info->cal_level];
     min_diff = min_diffs[info->cal_level];
 
@@ -413,21 +705,14 @@ static void scale_event (sensors_event_t* event)
 static void compass_compute_cal (sensors_event_t* event, sensor_info_t* info)
 {
     compass_cal_t* cal_data = (compass_cal_t*) info->cal_data;
-    double result[3][1], raw[3][1], diff[3][1];
+    float diff[3];
 
     if (!info->cal_level || cal_data == NULL)
         return;
 
-    raw[0][0] = event->magnetic.x;
-    raw[1][0] = event->magnetic.y;
-    raw[2][0] = event->magnetic.z;
-
-    substract(3, 1, raw, cal_data->offset, diff);
-    multiply (3, 3, 1, cal_data->w_invert, diff, result);
-
-    event->magnetic.x = event->data[0] = result[0][0];
-    event->magnetic.y = event->data[1] = result[1][0];
-    event->magnetic.z = event->data[2] = result[2][0];
+    /* event->magnetic.x, y and z alias event->data[0..2] */
+    substract_3x1_f(event->data, cal_data->offset_f, diff);
+    multiply_3x3_3x1_f(cal_data->w_invert_f, diff, event->data);
 
     scale_event(event);
 }
@@ -435,12 +720,10 @@ static void compass_compute_cal (sensors_event_t* event, sensor_info_t* info)
 
 static int compass_ready (sensor_info_t* info)
 {
-    mat_input_t mat;
-    int i;
-    float max_sqr_err;
-
+    int submitted = 0;
     compass_cal_t* cal_data = (compass_cal_t*) info->cal_data;
-    compass_cal_t new_cal_data;
+    compass_cal_t* target;
+    int state;
 
     /*
      * Some sensors take unrealistically long to calibrate at higher levels. We'll use a max_cal_level if we have such a property setup,
@@ -448,48 +731,72 @@ static int compass_ready (sensor_info_t* info)
      */
     int cal_steps = (info->max_cal_level && info->max_cal_level <= CAL_STEPS) ? info->max_cal_level : CAL_STEPS;
 
-    if (cal_data->sample_count < MAGN_DS_SIZE)
-        return info->cal_level;
-
-    max_sqr_err = max_sqr_errs[info->cal_level];
+    /* Pick up the outcome of a fit we submitted earlier, if it's available ; the worker is not holding the lock while fitting */
+    pthread_mutex_lock(&cal_worker_mutex);
 
-    /* Enough points have been collected, do the ellipsoid calibration */
+    target = fit_job.target;
+    state = fit_job.state;
 
-    /* Compute average per axis */
-    cal_data->average[0] /= MAGN_DS_SIZE;
-    cal_data->average[1] /= MAGN_DS_SIZE;
-    cal_data->average[2] /= MAGN_DS_SIZE;
+    if (target == cal_data && state != FIT_RUNNING) {
+        if (state == FIT_ACCEPTED) {
+            memcpy(cal_data->offset, fit_job.result.offset, sizeof(cal_data->offset));
+            memcpy(cal_data->w_invert, fit_job.result.w_invert, sizeof(cal_data->w_invert));
+            cal_data->bfield = fit_job.result.bfield;
+            update_compute_params(cal_data);
+            if (info->cal_level < (cal_steps - 1))
+                info->cal_level++;
+        }
 
-    for (i = 0; i < MAGN_DS_SIZE; i++) {
-       mat[i][0] = cal_data->sample[i][0];
-       mat[i][1] = cal_data->sample[i][1];
-       mat[i][2] = cal_data->sample[i][2];
+        fit_job.target = NULL;
     }
 
-    /* Check if result is good. The sample data must remain the same */
-    new_cal_data = *cal_data;
+    pthread_mutex_unlock(&cal_worker_mutex);
 
-    if (ellipsoid_fit(mat, new_cal_data.offset, new_cal_data.w_invert, &new_cal_data.bfield)) {
-        double new_err = calc_square_err (&new_cal_data);
-        ALOGI("new err is %f, max sqr err id %f", new_err,max_sqr_err);
-        if (new_err < max_sqr_err) {
-            double err = calc_square_err(cal_data);
-            if (new_err < err) {
-                /* New cal data is better, so we switch to the new */
-                memcpy(cal_data->offset, new_cal_data.offset, sizeof(cal_data->offset));
-                memcpy(cal_data->w_invert, new_cal_data.w_invert, sizeof(cal_data->w_invert));
-                cal_data->bfield = new_cal_data.bfield;
-                if (info->cal_level < (cal_steps - 1))
-                    info->cal_level++;
-                ALOGV("CompassCalibration: ready check success, caldata: %f %f %f %f %f %f %f %f %f %f %f %f %f, err %f",
-                    cal_data->offset[0][0], cal_data->offset[1][0], cal_data->offset[2][0], cal_data->w_invert[0][0],
-                    cal_data->w_invert[0][1], cal_data->w_invert[0][2], cal_data->w_invert[1][0], cal_data->w_invert[1][1],
-                    cal_data->w_invert[1][2], cal_data->w_invert[2][0], cal_data->w_invert[2][1], cal_data->w_invert[2][2],
-                    cal_data->bfield, new_err);
+    if (cal_data->streaming) {
+        if (cal_data->sample_count < STREAM_FIT_INTERVAL || get_sum(cal_data->sums, 8, 8) < STREAM_MIN_WEIGHT)
+            return info->cal_level;
+    } else if (cal_data->sample_count < MAGN_DS_SIZE)
+        return info->cal_level;
+
+    /* Enough points have been collected, hand them over for ellipsoid calibration - unless the worker is still busy */
+    pthread_mutex_lock(&cal_worker_mutex);
+
+    if (!fit_job.target) {
+        start_cal_worker();
+
+        if (cal_worker_started) {
+            fit_job.input = *cal_data;
+
+            /* Compute average per axis */
+            if (!cal_data->streaming) {
+                fit_job.input.average[0] /= MAGN_DS_SIZE;
+                fit_job.input.average[1] /= MAGN_DS_SIZE;
+                fit_job.input.average[2] /= MAGN_DS_SIZE;
             }
+
+            fit_job.max_sqr_err = max_sqr_errs[info->cal_level];
+            fit_job.state = FIT_RUNNING;
+            fit_job.target = cal_data;
+            pthread_cond_signal(&cal_worker_cond);
+            submitted = 1;
         }
     }
-    reset_sample(cal_data);
+
+    pthread_mutex_unlock(&cal_worker_mutex);
+
+    /*
+     * Start collecting the next sample set while the fit runs ; if we could not submit, wait for the worker to be available. Streaming sums
+     * carry over from fit to fit, only the grid starts over.
+     */
+    if (submitted) {
+        cal_data->sample_count = 0;
+
+        if (cal_data->streaming)
+            memset(cal_data->grid, 0, sizeof(cal_data->grid));
+        else
+            reset_sample(cal_data);
+    }
+
     return info->cal_level;
 }
 
@@ -529,6 +836,12 @@ void calibrate_compass (int s, sensors_event_t* event)
 void compass_read_data (int s)
 {
     FILE* data_file = fopen (COMPASS_CALIBRATION_PATH, "r");
+    compass_cal_t* cal_data = (compass_cal_t*) sensor[s].cal_data;
+    char mode[MAX_NAME_SIZE];
+
+    /* Select the sample selection and fitting flavor ; ro.iio.magn.cal_mode = streaming avoids storing sample sets */
+    if (cal_data)
+        cal_data->streaming = !sensor_get_st_prop(s, "cal_mode", mode) && !strcmp(mode, "streaming");
 
     compass_cal_init(data_file, &sensor[s]);
 
@@ -539,10 +852,42 @@ void compass_read_data (int s)
 
 void compass_store_data (int s)
 {
-    FILE* data_file = fopen (COMPASS_CALIBRATION_PATH, "w");
+    /* Hand the file update over to the calibration worker */
 
-    compass_store_result(data_file, &sensor[s]);
+    if (sensor[s].cal_data == NULL)
+        return;
 
-    if (data_file)
-        fclose(data_file);
+    pthread_mutex_lock(&cal_worker_mutex);
+
+    start_cal_worker();
+
+    if (cal_worker_started) {
+        compass_store_result(store_buf, &sensor[s]);
+        store_pending = 1;
+        pthread_cond_signal(&cal_worker_cond);
+    }
+
+    pthread_mutex_unlock(&cal_worker_mutex);
+}
+
+
+void compass_cal_shutdown (void)
+{
+    /* Let the calibration worker complete pending work, then stop it */
+
+    pthread_mutex_lock(&cal_worker_mutex);
+
+    if (!cal_worker_started) {
+        pthread_mutex_unlock(&cal_worker_mutex);
+        return;
+    }
+
+    cal_worker_exit = 1;
+    pthread_cond_signal(&cal_worker_cond);
+    pthread_mutex_unlock(&cal_worker_mutex);
+
+    pthread_join(cal_worker, NULL);
+
+    cal_worker_started = 0;
+    fit_job.target = NULL;
 }
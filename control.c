@@ -21,8 +21,14 @@
 #include <time.h>
 #include <math.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <unistd.h>
 #include <log/log.h>
 #include <hardware/sensors.h>
 #include <linux/ioctl.h>
@@ -33,37 +39,191 @@
 #include "calibration.h"
 #include "description.h"
 #include "filtering.h"
+#include "clock-domain.h"
+#include "timestamp-estimator.h"
+#include "direct-report.h"
+#include "sensor-stats.h"
+#include "capture.h"
 #ifndef __NO_EVENTS__
 #include <linux/iio/events.h>
 #endif
 #include <errno.h>
 
-/* Currently active sensors count, per device */
-static int poll_sensors_per_dev[MAX_DEVICES];		/* poll-mode sensors				*/
-static int trig_sensors_per_dev[MAX_DEVICES];		/* trigger, event based				*/
+int device_count;					/* Per device tables below have that many entries */
 
-static int device_fd[MAX_DEVICES];			/* fd on the /dev/iio:deviceX file		*/
-static int events_fd[MAX_DEVICES];			/* fd on the /sys/bus/iio/devices/iio:deviceX/events/<event_name> file */
-static int has_iio_ts[MAX_DEVICES];			/* ts channel available on this iio dev		*/
-static int expected_dev_report_size[MAX_DEVICES];	/* expected iio scan len			*/
-static int poll_fd;					/* epoll instance covering all enabled sensors	*/
+/* Currently active sensors count, per device */
+static int* poll_sensors_per_dev;			/* poll-mode sensors				*/
+static int* trig_sensors_per_dev;			/* trigger, event based				*/
+
+static int* device_fd;					/* fd on the /dev/iio:deviceX file		*/
+static int* events_fd;					/* fd on the /sys/bus/iio/devices/iio:deviceX/events/<event_name> file */
+static int* has_iio_ts;					/* ts channel available on this iio dev		*/
+static int* expected_dev_report_size;			/* expected iio scan len			*/
+static int* device_watermark;				/* iio buffer watermark, in scans		*/
+static int* device_backlog;				/* batched scans may be left in the iio buffer	*/
+static int** dev_sensor;				/* enabled sensors, per iio device		*/
+static int* dev_sensor_count;
+static ts_estimator_t* ts_estimator;			/* scan timing model, per iio device		*/
+static int* buffer_state;				/* last state written to buffer/enable ; -1: unknown	*/
+static int* buffer_target;				/* state to commit at the end of the configuration transaction ; -1: untouched */
+static float* device_rate;				/* last value written to sampling_frequency ; -1: unknown	*/
+static int poll_fd = -1;				/* epoll instance covering all enabled sensors	*/
 
 static int active_poll_sensors;				/* Number of enabled poll-mode sensors		*/
 
-static int flush_event_fd[2];				/* Pipe used for flush signaling */
+static int flush_event_fd[2] = { -1, -1 };	/* Pipe used for flush signaling */
+
+/*
+ * Bit mask of the sensors that may have something to return: a pending or queued report, or flush complete events. Bits are raised by the
+ * paths that bring in data and lowered by sensor_poll once a sensor has nothing left, so it doesn't have to check the whole collection on
+ * each pass. Flush requests come from other threads than the poll loop, hence the atomic accesses.
+ */
+#define PENDING_WORD_BITS	32
+#define PENDING_WORDS(count)	(((count) + PENDING_WORD_BITS - 1) / PENDING_WORD_BITS)
+
+static uint32_t* pending_sensors;
+static int pending_words;
+
+/*
+ * Per sensor runtime queues. These are a few KB each and only get touched when the sensor has data, so they are kept out of both the sensor
+ * descriptions and the compact sensor_state array.
+ */
+typedef struct
+{
+	/*
+	 * Reports extracted from device scans that were not moved to report_buffer yet, oldest first. Several scans can be read at once from a
+	 * iio device, and we queue them here so that none of them gets overwritten before sensor_poll gets a chance to return it.
+	 */
+	queued_report_t report_queue[REPORT_QUEUE_SIZE];
+	int report_queue_head;		/* Oldest queued report ; the queued report count lives in sensor_state */
+
+	/* Samples handed over by the acquisition thread of a sensor, see acquisition_routine */
+	sensors_event_t thread_ring[THREAD_RING_SIZE];
+	uint32_t thread_ring_head;	/* Written by the acquisition thread only	*/
+	uint32_t thread_ring_tail;	/* Written by the poll loop only		*/
+}
+sensor_queue_t;
+
+static sensor_queue_t* sensor_queue;			/* per sensor					*/
+
+static int64_t next_duplicate_ts;			/* Nearest date at which samples may have to be duplicated ; 0 forces a review */
+
+/*
+ * Configuration transactions: the HAL entry points that change sensor states, rates or batching parameters open a transaction for their
+ * duration. Within it, iio buffers get disabled once, on the first change affecting their device, and are only enabled back at commit time,
+ * after all co-located and dependent sensors have been reconfigured. The sampling rate attribute that applies to each sensor is found once,
+ * and the values we write are cached, so that we don't have to read attributes before deciding whether to write them.
+ */
+#define RATE_ATTR_UNKNOWN	0
+#define RATE_ATTR_SENSOR	1			/* in_<tag>_sampling_frequency	*/
+#define RATE_ATTR_DEVICE	2			/* sampling_frequency		*/
+#define RATE_ATTR_NONE		3
+
+static int config_depth;				/* Nesting level of the configuration transaction in progress, 0 if none */
+static pthread_mutex_t config_mutex;			/* Held through configuration transactions, by the HAL or the poll thread */
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static int* rate_attr;					/* RATE_ATTR_ flavor, per sensor		*/
+static float* sensor_rate;				/* last value written to in_<tag>_sampling_frequency ; -1: unknown	*/
+static float* hrtimer_rate;				/* last value written to the hrtimer trigger frequency ; -1: unknown	*/
+
+/*
+ * Idle governor: accelerometer and gyroscope samples that stay within a narrow band for a while tell us the device is stationary. The iio
+ * devices of sensors opting in through their idle property are then run at their lowest supported rate, or switched to their any-motion
+ * trigger, and the HAL duplicates the last sample so that the reporting rate seen by Android does not change. The first sample falling out
+ * of the band restores the requested configuration.
+ */
+#define IDLE_OFF		0
+#define IDLE_RATE		1			/* Use the lowest rate while stationary		*/
+#define IDLE_MOTION		2			/* Use the any-motion trigger while stationary	*/
+
+#define STILL_SAMPLES		50			/* Consecutive in band samples after which we consider we're stationary */
+#define STILL_TOLERANCE_ACCEL	0.2			/* Maximum per axis spread of accelerometer samples, in m/s²	*/
+#define STILL_TOLERANCE_GYRO	0.05			/* Maximum per axis spread of gyroscope samples, in rad/s	*/
+
+typedef struct
+{
+	int count;					/* Consecutive samples within tolerance		*/
+	float min[3];
+	float max[3];
+}
+still_window_t;
+
+static int* idle_policy;				/* IDLE_ policy, per sensor			*/
+static float* idle_rate;				/* rate the sensor can be run at while idle, per sensor	*/
+static float* still_tolerance;				/* per sensor ; 0 if the sensor isn't used to detect stillness	*/
+static still_window_t* still_window;			/* per sensor					*/
+static int still_samples = STILL_SAMPLES;
+static int* device_idle;				/* IDLE_ policy currently applied, per iio device	*/
+static float* device_idle_rate;				/* rate used by a iio device while in IDLE_RATE mode	*/
 
 /* We use pthread condition variables to get worker threads out of sleep */
-static pthread_condattr_t thread_cond_attr	[MAX_SENSORS];
-static pthread_cond_t     thread_release_cond	[MAX_SENSORS];
-static pthread_mutex_t    thread_release_mutex	[MAX_SENSORS];
+static pthread_condattr_t* thread_cond_attr;
+static pthread_cond_t*     thread_release_cond;
+static pthread_mutex_t*    thread_release_mutex;
+
+/*
+ * Poll mode sensors can optionally be served by a single acquisition thread, rather than one thread per sensor. This thread keeps a deadline
+ * ordered queue of the sensors it samples, and serves the sensors whose deadlines are within a slack of the earliest one in a single wakeup.
+ */
+static int		shared_poll_scheduler;		/* Set through the ro.iio.hal.poll_scheduler property	*/
+static int64_t		poll_slack;			/* Coalescing window, in ns				*/
+static pthread_t	scheduler_thread;
+static int		scheduler_started;
+static int		scheduler_busy;			/* Set while the thread samples sensors			*/
+static pthread_mutex_t	scheduler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_condattr_t scheduler_cond_attr;
+static pthread_cond_t	scheduler_cond;			/* Signaled when the queue gets updated			*/
+static pthread_cond_t	scheduler_idle_cond;		/* Signaled when the thread is done sampling		*/
+static int*		scheduled_sensor;		/* Queued poll mode sensors, by increasing deadline	*/
+static int*		due_sensor;			/* Sensors the thread is currently sampling		*/
+static int		scheduled_count;
+
+#define DEFAULT_POLL_SLACK_MS		2
+
+/*
+ * The poll loop and acquisition threads run with default scheduling parameters, unless configured otherwise through properties, e.g.
+ * ro.iio.hal.poll_sched = fifo, ro.iio.hal.poll_priority = 2, ro.iio.hal.poll_cpus = 2-3. Acquisition threads use the acq_ HAL wide
+ * properties, or the sched, priority and cpus properties of their sensor.
+ */
+#define SCHED_INHERIT		-1
+
+typedef struct
+{
+	int policy;					/* SCHED_FIFO, SCHED_RR, SCHED_OTHER or SCHED_INHERIT	*/
+	int priority;					/* Real-time priority, or nice value for other policies	*/
+	unsigned long cpus;				/* Affinity mask ; 0 leaves affinity alone		*/
+}
+thread_sched_t;
+
+static thread_sched_t	poll_sched;			/* Applies to sensor_poll callers		*/
+static thread_sched_t	scheduler_sched;		/* Applies to the shared acquisition thread	*/
+static thread_sched_t*	acq_sched;			/* Applies to acquisition threads, per sensor	*/
+static pid_t		poll_sched_tid;			/* Thread poll_sched was last applied to	*/
+
+#define MAX_LOCKED_REGIONS	8
+
+typedef struct
+{
+	void* addr;
+	size_t len;
+}
+locked_region_t;
+
+static locked_region_t	locked_region[MAX_LOCKED_REGIONS];	/* Tables locked in memory if ro.iio.hal.mlock is set	*/
+static int		locked_region_count;
 
-#define FLUSH_REPORT_TAG			900
 /*
  * We associate tags to each of our poll set entries. These tags have the following values:
  * - a iio device number if the fd is a iio character device fd
- * - THREAD_REPORT_TAG_BASE + sensor handle if the fd is the receiving end of a pipe used by a sysfs data acquisition thread
+ * - THREAD_REPORT_TAG_BASE + sensor handle if the fd is the eventfd signaling samples queued by a sysfs data acquisition thread
+ * - FLUSH_REPORT_TAG for the flush signaling pipe
+ * The ranges are wide enough not to overlap whatever the number of devices and sensors.
  */
-#define THREAD_REPORT_TAG_BASE		1000
+#define THREAD_REPORT_TAG_BASE		0x40000000U
+#define FLUSH_REPORT_TAG		0x80000000U
+
+/* Maximum number of scans we read from a iio device at once */
+#define MAX_SCANS_PER_READ		REPORT_QUEUE_SIZE
 
 /* If buffer enable fails, we may want to retry a few times before giving up */
 #define ENABLE_BUFFER_RETRIES		3
@@ -72,20 +232,26 @@ static pthread_mutex_t    thread_release_mutex	[MAX_SENSORS];
 
 inline int is_enabled (int s)
 {
-	return sensor[s].directly_enabled || sensor[s].ref_count;
+	return sensor_state[s].directly_enabled || sensor_state[s].ref_count || sensor_state[s].direct_enabled;
+}
+
+
+static void mark_sensor_pending (int s)
+{
+	__atomic_fetch_or(&pending_sensors[s / PENDING_WORD_BITS], 1U << (s % PENDING_WORD_BITS), __ATOMIC_SEQ_CST);
 }
 
 
 static int check_state_change (int s, int enabled, int from_virtual)
 {
 	if (enabled) {
-		if (sensor[s].directly_enabled)
+		if (sensor_state[s].directly_enabled)
 			return 0;			/* We're being enabled but already were directly activated: no change. */
 
 		if (!from_virtual)
-			sensor[s].directly_enabled = 1;	/* We're being directly enabled */
+			sensor_state[s].directly_enabled = 1;	/* We're being directly enabled */
 
-		if (sensor[s].ref_count)
+		if (sensor_state[s].ref_count || sensor_state[s].direct_enabled)
 			return 0;			/* We were already indirectly enabled */
 
 		return 1; 				/* Do continue enabling this sensor */
@@ -94,12 +260,12 @@ static int check_state_change (int s, int enabled, int from_virtual)
 	if (!is_enabled(s))
 		return 0;				/* We are being disabled but already were: no change */
 
-	if (from_virtual && sensor[s].directly_enabled)
+	if (from_virtual && (sensor_state[s].directly_enabled || sensor_state[s].direct_enabled))
 		return 0;				/* We're indirectly disabled but the base is still active */
 
-	sensor[s].directly_enabled = 0;			/* We're now directly disabled */
+	sensor_state[s].directly_enabled = 0;			/* We're now directly disabled */
 
-	if (!from_virtual && sensor[s].ref_count)
+	if (!from_virtual && (sensor_state[s].ref_count || sensor_state[s].direct_enabled))
 		return 0;				/* We still have ref counts */
 
 	return 1;					/* Do continue disabling this sensor */
@@ -111,12 +277,17 @@ static int enable_buffer (int dev_num, int enabled)
 	char sysfs_path[PATH_MAX];
 	int retries = ENABLE_BUFFER_RETRIES;
 
+	if (buffer_state[dev_num] == enabled)
+		return 0;
+
 	sprintf(sysfs_path, ENABLE_PATH, dev_num);
 
 	while (retries) {
 		/* Low level, non-multiplexed, enable/disable routine */
-		if (sysfs_write_int(sysfs_path, enabled) > 0)
+		if (sysfs_write_int(sysfs_path, enabled) > 0) {
+			buffer_state[dev_num] = enabled;
 			return 0;
+		}
 
 		ALOGE("Failed enabling buffer on dev%d, retrying", dev_num);
 		usleep(ENABLE_BUFFER_RETRY_DELAY_MS*1000);
@@ -124,10 +295,96 @@ static int enable_buffer (int dev_num, int enabled)
 	}
 
 	ALOGE("Could not enable buffer\n");
+	buffer_state[dev_num] = -1;
 	return -EIO;
 }
 
 
+static void suspend_buffer (int dev_num)
+{
+	/* Disable a iio device buffer so it can be reconfigured ; it stays disabled until resume_buffer is called */
+
+	if (config_depth)
+		buffer_target[dev_num] = 0;
+
+	enable_buffer(dev_num, 0);
+}
+
+
+static void resume_buffer (int dev_num)
+{
+	/* Enable a iio device buffer back after reconfiguration ; if a configuration transaction is in progress, wait for it to complete */
+
+	if (config_depth) {
+		buffer_target[dev_num] = 1;
+		return;
+	}
+
+	enable_buffer(dev_num, 1);
+}
+
+
+static void init_config_mutex (void)
+{
+	pthread_mutexattr_t attr;
+
+	/* Transactions nest, e.g. batch calls set_delay */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&config_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+
+void sensor_config_begin (void)
+{
+	/*
+	 * The HAL entry points and the poll thread both reconfigure iio devices, and the cached buffer states and rates are only accessed within
+	 * a transaction, so they are serialized.
+	 */
+	pthread_once(&config_once, init_config_mutex);
+	pthread_mutex_lock(&config_mutex);
+	config_depth++;
+}
+
+
+void sensor_config_commit (void)
+{
+	int dev_num;
+
+	if (--config_depth) {
+		pthread_mutex_unlock(&config_mutex);
+		return;
+	}
+
+	for (dev_num=0; dev_num<device_count; dev_num++) {
+		if (buffer_target[dev_num] == 1 && trig_sensors_per_dev[dev_num])
+			enable_buffer(dev_num, 1);
+
+		buffer_target[dev_num] = -1;
+	}
+
+	pthread_mutex_unlock(&config_mutex);
+}
+
+
+static void invalidate_device_config (int dev_num)
+{
+	/* Forget the buffer state and rates we think an iio device has, so they get written again */
+
+	int i, s;
+
+	buffer_state[dev_num] = -1;
+	device_rate[dev_num] = -1;
+
+	for (i=0; i<dev_sensor_count[dev_num]; i++) {
+		s = dev_sensor[dev_num][i];
+		sensor_rate[s] = -1;
+		hrtimer_rate[s] = -1;
+	}
+}
+
+
 static int setup_trigger (int s, const char* trigger_val)
 {
 	char sysfs_path[PATH_MAX];
@@ -143,9 +400,10 @@ static int setup_trigger (int s, const char* trigger_val)
 		attempts--;
 	}
 
-	if (ret != -1)
-		sensor[s].selected_trigger = trigger_val;
-	else
+	if (ret != -1) {
+		sensor_state[s].selected_trigger = trigger_val;
+		next_duplicate_ts = 0;
+	} else
 		ALOGE("Setting S%d (%s) trigger to %s FAILED.\n", s, sensor[s].friendly_name, trigger_val);
 	return ret;
 }
@@ -238,6 +496,40 @@ static int decode_type_spec (const char type_buf[MAX_TYPE_SPEC_LEN], datum_info_
 }
 
 
+static void setup_report_copy_plan (int s)
+{
+	/* Describe how to extract the report of a sensor from device scans, coalescing channels that are adjacent in both */
+
+	int c;
+	int n = 0;
+
+	for (c=0; c<sensor[s].num_channels; c++) {
+		if (!sensor[s].channel[c].size)
+			continue;
+
+		if (n && sensor[s].report_copy[n-1].offset + sensor[s].report_copy[n-1].size == sensor[s].channel[c].offset) {
+			sensor[s].report_copy[n-1].size += sensor[s].channel[c].size;
+			continue;
+		}
+
+		sensor[s].report_copy[n].offset	= sensor[s].channel[c].offset;
+		sensor[s].report_copy[n].size	= sensor[s].channel[c].size;
+		n++;
+	}
+
+	sensor[s].report_copy_count = n;
+}
+
+
+typedef struct
+{
+	int handle;	/* Sensor this scan element belongs to		*/
+	int channel;	/* Channel number within the sensor		*/
+	int size;	/* Size in bytes ; 0 if the index is unused	*/
+}
+scan_slot_t;
+
+
 void build_sensor_report_maps (int dev_num)
 {
 	/*
@@ -261,9 +553,9 @@ void build_sensor_report_maps (int dev_num)
 	char sysfs_path[PATH_MAX];
 	int known_channels;
 	int offset;
-	int channel_size_from_index[MAX_SENSORS * MAX_CHANNELS] = { 0 };
-	int sensor_handle_from_index[MAX_SENSORS * MAX_CHANNELS] = { 0 };
-	int channel_number_from_index[MAX_SENSORS * MAX_CHANNELS] = { 0 };
+	scan_slot_t* slot = NULL;	/* What each scan index is about, grown to fit the highest index we see */
+	scan_slot_t* grown;
+	int slot_count = 0;
 
 	known_channels = 0;
 
@@ -295,6 +587,8 @@ void build_sensor_report_maps (int dev_num)
 
 			size = decode_type_spec(ch_spec, ch_info);
 
+			sensor[s].channel[c].decode = select_decoder(ch_info);
+
 			/* Read _index file */
 			sprintf(sysfs_path, CHANNEL_PATH "%s", sensor[s].dev_num, sensor_catalog[i].channel[c].index_path);
 
@@ -305,16 +599,29 @@ void build_sensor_report_maps (int dev_num)
 					continue;
 			}
 
-			if (ch_index >= MAX_SENSORS) {
+			if (ch_index < 0) {
 				ALOGE("Index out of bounds!: %s\n", sysfs_path);
 				continue;
 			}
 
+			if (ch_index >= slot_count) {
+				grown = (scan_slot_t*) realloc(slot, (ch_index + 1) * sizeof(scan_slot_t));
+
+				if (!grown) {
+					ALOGE("Could not map scan index %d of iio device %d\n", ch_index, dev_num);
+					continue;
+				}
+
+				memset(grown + slot_count, 0, (ch_index + 1 - slot_count) * sizeof(scan_slot_t));
+				slot = grown;
+				slot_count = ch_index + 1;
+			}
+
 			/* Record what this index is about */
 
-			sensor_handle_from_index [ch_index] = s;
-			channel_number_from_index[ch_index] = c;
-			channel_size_from_index  [ch_index] = size;
+			slot[ch_index].handle	= s;
+			slot[ch_index].channel	= c;
+			slot[ch_index].size	= size;
 
 			known_channels++;
 		}
@@ -342,10 +649,10 @@ void build_sensor_report_maps (int dev_num)
 	 */
 	 offset = 0;
 
-	 for (i=0; i<MAX_SENSORS * MAX_CHANNELS; i++) {
-		s =	sensor_handle_from_index[i];
-		c =	channel_number_from_index[i];
-		size = 	channel_size_from_index[i];
+	 for (i=0; i<slot_count; i++) {
+		s =	slot[i].handle;
+		c =	slot[i].channel;
+		size = 	slot[i].size;
 
 		if (!size)
 			continue;
@@ -358,8 +665,15 @@ void build_sensor_report_maps (int dev_num)
 		offset += size;
 	 }
 
-	/* Enable the timestamp channel if there is one available */
+	free(slot);
+
+	for (s=0; s<sensor_count; s++)
+		if (sensor[s].dev_num == dev_num)
+			setup_report_copy_plan(s);
+
+	/* Enable the timestamp channel if there is one available, and see if it can be driven by the boot time clock, while the buffer is off */
 	enable_iio_timestamp(dev_num, known_channels);
+	setup_device_clock(dev_num);
 
 	/* Add padding and timestamp size if it's enabled on this iio device */
 	if (has_iio_ts[dev_num])
@@ -376,6 +690,25 @@ void build_sensor_report_maps (int dev_num)
 }
 
 
+static void update_device_sensor_list (int s, int enabled)
+{
+	/* Keep track of the enabled sensors of each iio device, so that the per scan processing only goes through these */
+
+	int dev_num = sensor[s].dev_num;
+	int i;
+
+	for (i=0; i<dev_sensor_count[dev_num]; i++)
+		if (dev_sensor[dev_num][i] == s) {
+			if (!enabled)
+				dev_sensor[dev_num][i] = dev_sensor[dev_num][--dev_sensor_count[dev_num]];
+			return;
+		}
+
+	if (enabled)
+		dev_sensor[dev_num][dev_sensor_count[dev_num]++] = s;
+}
+
+
 int adjust_counters (int s, int enabled, int from_virtual)
 {
 	/*
@@ -409,8 +742,9 @@ int adjust_counters (int s, int enabled, int from_virtual)
 	} else {
 		ALOGI("Disabling sensor %d (iio device %d: %s)\n", s, dev_num, sensor[s].friendly_name);
 
-		/* Sensor disabled, lower report available flag */
-		sensor[s].report_pending = 0;
+		/* Sensor disabled, lower report available flag and forget queued reports */
+		sensor_state[s].report_pending = 0;
+		sensor_state[s].report_queue_count = 0;
 
 		/* Save calibration data to persistent storage */
 		switch (sensor[s].type) {
@@ -430,6 +764,8 @@ int adjust_counters (int s, int enabled, int from_virtual)
 
 	/* We changed the state of a sensor: adjust device ref counts */
 
+	update_device_sensor_list(s, enabled);
+
 	switch(sensor[s].mode) {
 	case MODE_TRIGGER:
 		if (enabled)
@@ -511,213 +847,749 @@ void set_report_ts(int s, int64_t ts)
 	*  this may not be the case. Perhaps we'll get rid of this when
 	*  we'll be reading the timestamp from the iio channel for all sensors
 	*/
-	if (sensor[s].report_ts && sensor[s].sampling_rate &&
+	if (sensor_state[s].report_ts && sensor[s].sampling_rate &&
 		REPORTING_MODE(sensor_desc[s].flags) == SENSOR_FLAG_CONTINUOUS_MODE)
 	{
 		period = (int64_t) (1000000000.0 / sensor[s].sampling_rate);
-		maxTs = sensor[s].report_ts + THRESHOLD * period;
+		maxTs = sensor_state[s].report_ts + THRESHOLD * period;
 		/* If we're too far behind get back on track */
 		if (ts - maxTs >= MAX_DELAY)
 			maxTs = ts;
-		sensor[s].report_ts = (ts < maxTs ? ts : maxTs);
+		sensor_state[s].report_ts = (ts < maxTs ? ts : maxTs);
 	} else {
-		sensor[s].report_ts = ts;
+		sensor_state[s].report_ts = ts;
 	}
 }
 
-static void* acquisition_routine (void* param)
+static void queue_thread_report (int s, sensors_event_t* data)
 {
-	/*
-	 * Data acquisition routine run in a dedicated thread, covering a single sensor. This loop will periodically retrieve sampling data through
-	 * sysfs, then package it as a sample and transfer it to our master poll loop through a report fd. Checks for a cancellation signal quite
-	 * frequently, as the thread may be disposed of at any time. Note that Bionic does not provide pthread_cancel / pthread_testcancel...
-	 */
+	/* Producer side of the ring linking an acquisition thread to the poll loop ; the eventfd acts as a doorbell */
 
-	int s = (int) (size_t) param;
-	int num_fields;
-	sensors_event_t data = {0};
-	int c;
-	int ret;
-	struct timespec target_time;
-	int64_t timestamp, period, start, stop;
-	size_t field_size;
+	uint32_t head = sensor_queue[s].thread_ring_head;
+	uint32_t tail = __atomic_load_n(&sensor_queue[s].thread_ring_tail, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+	int fd = sensor[s].thread_data_fd;
 
-	if (s < 0 || s >= sensor_count) {
-		ALOGE("Invalid sensor handle!\n");
-		return NULL;
+	if (head - tail == THREAD_RING_SIZE) {
+		ALOGV("S%d sample dropped, poll loop lagging\n", s);
+		stats_count(s, STAT_DROPPED);
+		return;
 	}
 
-	ALOGI("Entering S%d (%s) data acquisition thread: rate:%g\n", s, sensor[s].friendly_name, sensor[s].sampling_rate);
+	memcpy(&sensor_queue[s].thread_ring[head % THREAD_RING_SIZE], data, sizeof(sensors_event_t));
 
-	if (sensor[s].sampling_rate <= 0) {
-		ALOGE("Invalid rate in acquisition routine for sensor %d: %g\n", s, sensor[s].sampling_rate);
-		return NULL;
-	}
+	/* Publish the sample before ringing */
+	__atomic_store_n(&sensor_queue[s].thread_ring_head, head + 1, __ATOMIC_RELEASE);
 
-	/* Initialize data fields that will be shared by all sensor reports */
-	data.version	= sizeof(sensors_event_t);
-	data.sensor	= s;
-	data.type	= sensor_desc[s].type;
+	if (fd != -1 && write(fd, &one, sizeof(one)) != sizeof(one))
+		ALOGE("S%d doorbell failure (%s)\n", s, strerror(errno));
+}
 
-	num_fields = get_field_count(s, &field_size);
 
-	/*
-	 * Each condition variable is associated to a mutex that has to be locked by the thread that's waiting on it. We use these condition
-	 * variables to get the acquisition threads out of sleep quickly after the sampling rate is adjusted, or the sensor is disabled.
-	 */
-	pthread_mutex_lock(&thread_release_mutex[s]);
+static int dequeue_thread_report (int s)
+{
+	/* Consumer side of the acquisition thread ring: move the oldest sample to the sensor sample field ; returns 1 if there was one */
 
-	/* Pinpoint the moment we start sampling */
-	timestamp = get_timestamp_monotonic();
+	uint32_t tail = sensor_queue[s].thread_ring_tail;
+	uint32_t head = __atomic_load_n(&sensor_queue[s].thread_ring_head, __ATOMIC_ACQUIRE);
 
-	/* Check and honor termination requests */
-	while (sensor[s].thread_data_fd[1] != -1) {
-		start = get_timestamp_boot();
+	if (head == tail)
+		return 0;
 
-		/* Read values through sysfs */
-		for (c=0; c<num_fields; c++) {
-			if (field_size == sizeof(uint64_t))
-				data.u64.data[c] = acquire_immediate_uint64_value(s, c);
-			else
-				data.data[c] = acquire_immediate_float_value(s, c);
+	memcpy(&sensor[s].sample, &sensor_queue[s].thread_ring[tail % THREAD_RING_SIZE], sizeof(sensors_event_t));
 
-			/* Check and honor termination requests */
-			if (sensor[s].thread_data_fd[1] == -1)
-				goto exit;
-		}
-		stop = get_timestamp_boot();
-		set_report_ts(s, start/2 + stop/2);
-		data.timestamp = sensor[s].report_ts;
-		/* If the sample looks good */
-		if (sensor[s].ops.finalize(s, &data)) {
+	/* Release the slot to the producer */
+	__atomic_store_n(&sensor_queue[s].thread_ring_tail, tail + 1, __ATOMIC_RELEASE);
 
-			/* Pipe it for transmission to poll loop */
-			ret = write(sensor[s].thread_data_fd[1], &data, sizeof(sensors_event_t));
+	sensor_state[s].report_pending = DATA_SYSFS;
+	return 1;
+}
 
-			if (ret != sizeof(sensors_event_t))
-				ALOGE("S%d write failure: wrote %d, got %d\n", s, sizeof(sensors_event_t), ret);
-		}
 
-		/* Check and honor termination requests */
-		if (sensor[s].thread_data_fd[1] == -1)
-			goto exit;
+static int acquire_poll_sample (int s, sensors_event_t* data, int num_fields, size_t field_size)
+{
+	/*
+	 * Read the values of a poll mode sensor through sysfs, package them as a sample and queue it for our master poll loop. Returns -1 if a
+	 * termination request was noticed while sampling.
+	 */
 
-		/* Recalculate period assuming sensor[s].sampling_rate can be changed dynamically during the thread run */
-		if (sensor[s].sampling_rate <= 0) {
-			ALOGE("Unexpected sampling rate for sensor %d: %g\n", s, sensor[s].sampling_rate);
-			goto exit;
-		}
+	int c;
+	int64_t start, stop;
 
-		period = (int64_t) (1000000000.0 / sensor[s].sampling_rate);
-		timestamp += period;
-		set_timestamp(&target_time, timestamp);
+	start = get_timestamp_boot();
 
-		/* Wait until the sampling time elapses, or a rate change is signaled, or a thread exit is requested */
-		ret = pthread_cond_timedwait(&thread_release_cond[s], &thread_release_mutex[s], &target_time);
+	/* Read values through sysfs */
+	for (c=0; c<num_fields; c++) {
+		if (field_size == sizeof(uint64_t))
+			data->u64.data[c] = acquire_immediate_uint64_value(s, c);
+		else
+			data->data[c] = acquire_immediate_float_value(s, c);
+
+		/* Check and honor termination requests */
+		if (sensor[s].thread_data_fd == -1)
+			return -1;
 	}
+	stop = get_timestamp_boot();
+	set_report_ts(s, start/2 + stop/2);
+	data->timestamp = sensor_state[s].report_ts;
+	/* If the sample looks good, queue it for transmission to poll loop */
+	if (sensor[s].ops.finalize(s, data))
+		queue_thread_report(s, data);
 
-exit:
-	ALOGV("Acquisition thread for S%d exiting\n", s);
-	pthread_mutex_unlock(&thread_release_mutex[s]);
-	pthread_exit(0);
-	return NULL;
+	return 0;
 }
 
 
-static void start_acquisition_thread (int s)
+static unsigned long decode_cpu_list (const char* list)
 {
-	int incoming_data_fd;
-	int ret;
+	/* Convert a CPU list, like 0-1,3, into an affinity mask */
 
-	struct epoll_event ev = {0};
+	unsigned long mask = 0;
+	long first, last;
+	char* end;
 
-	ALOGV("Initializing acquisition context for sensor %d\n", s);
+	for (;;) {
+		first = strtol(list, &end, 10);
 
-	/* Create condition variable and mutex for quick thread release */
-	ret = pthread_condattr_init(&thread_cond_attr[s]);
-	ret = pthread_condattr_setclock(&thread_cond_attr[s], CLOCK_MONOTONIC);
-	ret = pthread_cond_init(&thread_release_cond[s], &thread_cond_attr[s]);
-	ret = pthread_mutex_init(&thread_release_mutex[s], NULL);
+		if (end == list)
+			break;
 
-	/* Create a pipe for inter thread communication */
-	ret = pipe(sensor[s].thread_data_fd);
+		last = first;
 
-	incoming_data_fd = sensor[s].thread_data_fd[0];
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
 
-	ev.events = EPOLLIN;
-	ev.data.u32 = THREAD_REPORT_TAG_BASE + s;
+			if (end == list)
+				break;
+		}
 
-	/* Add incoming side of pipe to our poll set, with a suitable tag */
-	ret = epoll_ctl(poll_fd, EPOLL_CTL_ADD, incoming_data_fd , &ev);
-	if (ret == -1) {
-		ALOGE("Failed adding %d to poll set (%s)\n",
-			incoming_data_fd, strerror(errno));
+		for (; first <= last; first++)
+			if (first >= 0 && first < (long) (8 * sizeof(mask)))
+				mask |= 1UL << first;
+
+		if (*end != ',')
+			break;
+
+		list = end + 1;
 	}
 
-	/* Create and start worker thread */
-	ret = pthread_create(&sensor[s].acquisition_thread, NULL, acquisition_routine, (void*) (size_t) s);
+	return mask;
 }
 
 
-static void stop_acquisition_thread (int s)
+static int get_sched_prop (int s, const char* sel, const char* hal_sel, char val[MAX_NAME_SIZE])
 {
-	int incoming_data_fd = sensor[s].thread_data_fd[0];
-	int outgoing_data_fd = sensor[s].thread_data_fd[1];
+	/* Look for a sensor specific value first, if we're dealing with a sensor, then for a HAL wide value */
 
-	ALOGV("Tearing down acquisition context for sensor %d\n", s);
+	if (s != -1 && !sensor_get_st_prop(s, sel, val))
+		return 0;
 
-	/* Delete the incoming side of the pipe from our poll set */
-	epoll_ctl(poll_fd, EPOLL_CTL_DEL, incoming_data_fd, NULL);
+	return hal_get_st_prop(hal_sel, val);
+}
 
-	/* Mark the pipe ends as invalid ; that's a cheap exit flag */
-	sensor[s].thread_data_fd[0] = -1;
-	sensor[s].thread_data_fd[1] = -1;
 
-	/* Close both sides of our pipe */
-	close(incoming_data_fd);
-	close(outgoing_data_fd);
+static void read_thread_sched (int s, const char* prefix, thread_sched_t* ts)
+{
+	/* Read the scheduling parameters applying to a class of threads, e.g. poll_sched, poll_priority and poll_cpus for prefix poll */
 
-	/* Stop acquisition thread and clean up thread handle */
-	pthread_cond_signal(&thread_release_cond[s]);
-	pthread_join(sensor[s].acquisition_thread, NULL);
+	char sel[MAX_NAME_SIZE];
+	char buf[MAX_NAME_SIZE];
 
-	/* Clean up our sensor descriptor */
-	sensor[s].acquisition_thread = -1;
+	ts->policy = SCHED_INHERIT;
+	ts->priority = 0;
+	ts->cpus = 0;
 
-	/* Delete condition variable and mutex */
-	pthread_cond_destroy(&thread_release_cond[s]);
-	pthread_mutex_destroy(&thread_release_mutex[s]);
-}
+	snprintf(sel, sizeof(sel), "%s_sched", prefix);
 
+	if (!get_sched_prop(s, "sched", sel, buf)) {
+		if (!strcmp(buf, "fifo"))
+			ts->policy = SCHED_FIFO;
+		else if (!strcmp(buf, "rr"))
+			ts->policy = SCHED_RR;
+		else if (!strcmp(buf, "other"))
+			ts->policy = SCHED_OTHER;
+		else
+			ALOGW("Unknown scheduling policy %s for %s threads\n", buf, prefix);
+	}
 
-static int is_fast_accelerometer (int s)
-{
-	/*
-	 * Some games don't react well to accelerometers using any-motion triggers. Even very low thresholds seem to trip them, and they tend to
-	 * request fairly high event rates. Favor continuous triggers if the sensor is an accelerometer and uses a sampling rate of at least 25.
-	 */
+	snprintf(sel, sizeof(sel), "%s_priority", prefix);
 
-	if (sensor[s].type != SENSOR_TYPE_ACCELEROMETER)
-		return 0;
+	if (!get_sched_prop(s, "priority", sel, buf))
+		ts->priority = atoi(buf);
 
-	if (sensor[s].sampling_rate < 25)
-		return 0;
+	snprintf(sel, sizeof(sel), "%s_cpus", prefix);
 
-	return 1;
+	if (!get_sched_prop(s, "cpus", sel, buf))
+		ts->cpus = decode_cpu_list(buf);
+
+	/* Keep real-time priorities within the range the policy supports */
+	if (ts->policy == SCHED_FIFO || ts->policy == SCHED_RR) {
+		if (ts->priority < sched_get_priority_min(ts->policy))
+			ts->priority = sched_get_priority_min(ts->policy);
+
+		if (ts->priority > sched_get_priority_max(ts->policy))
+			ts->priority = sched_get_priority_max(ts->policy);
+	}
 }
 
 
-static void tentative_switch_trigger (int s)
+static int is_sched_configured (const thread_sched_t* ts)
 {
-	/*
-	 * Under certain situations it may be beneficial to use an alternate trigger:
+	return ts->policy != SCHED_INHERIT || ts->priority || ts->cpus;
+}
+
+
+static void apply_thread_sched (const thread_sched_t* ts, const char* name)
+{
+	/* Apply scheduling parameters to the calling thread */
+
+	struct sched_param param = {0};
+	pid_t tid = syscall(SYS_gettid);
+
+	if (ts->policy != SCHED_INHERIT) {
+		if (ts->policy != SCHED_OTHER)
+			param.sched_priority = ts->priority;
+
+		if (sched_setscheduler(tid, ts->policy, &param))
+			ALOGW("Could not set %s thread scheduling policy (%s)\n", name, strerror(errno));
+	}
+
+	if (ts->priority && (ts->policy == SCHED_INHERIT || ts->policy == SCHED_OTHER) && setpriority(PRIO_PROCESS, tid, ts->priority))
+		ALOGW("Could not set %s thread nice value (%s)\n", name, strerror(errno));
+
+	if (ts->cpus && syscall(SYS_sched_setaffinity, tid, sizeof(ts->cpus), &ts->cpus))
+		ALOGW("Could not set %s thread CPU affinity (%s)\n", name, strerror(errno));
+}
+
+
+static void setup_thread_sched (void)
+{
+	int s;
+
+	read_thread_sched(-1, "poll", &poll_sched);
+	read_thread_sched(-1, "acq", &scheduler_sched);
+
+	for (s=0; s<sensor_count; s++)
+		read_thread_sched(s, "acq", &acq_sched[s]);
+
+	poll_sched_tid = 0;
+}
+
+
+static void lock_region (void* addr, size_t len)
+{
+	if (!addr || !len || locked_region_count == MAX_LOCKED_REGIONS)
+		return;
+
+	if (mlock(addr, len)) {
+		ALOGW("Could not lock %zu bytes in memory (%s)\n", len, strerror(errno));
+		return;
+	}
+
+	locked_region[locked_region_count].addr = addr;
+	locked_region[locked_region_count].len = len;
+	locked_region_count++;
+}
+
+
+static void lock_hot_data (void)
+{
+	/* Optionally keep the tables the sample pipeline goes through resident, so page faults can't stall it, e.g. ro.iio.hal.mlock = 1 */
+
+	int enabled;
+
+	if (hal_get_prop("mlock", &enabled) || !enabled)
+		return;
+
+	lock_region(sensor, sensor_count * sizeof(sensor_info_t));
+	lock_region(sensor_state, sensor_count * sizeof(sensor_state_t));
+	lock_region(sensor_queue, sensor_count * sizeof(sensor_queue_t));
+	lock_region(sensor_desc, sensor_count * sizeof(struct sensor_t));
+	lock_region(ts_estimator, device_count * sizeof(ts_estimator_t));
+	lock_region(pending_sensors, pending_words * sizeof(uint32_t));
+
+	ALOGI("Locked %d sensor tables in memory\n", locked_region_count);
+}
+
+
+static void unlock_hot_data (void)
+{
+	/* Must run before the locked tables are released, as the pages they occupied may get reused for other allocations */
+
+	int i;
+
+	for (i=0; i<locked_region_count; i++)
+		munlock(locked_region[i].addr, locked_region[i].len);
+
+	locked_region_count = 0;
+}
+
+
+static void* acquisition_routine (void* param)
+{
+	/*
+	 * Data acquisition routine run in a dedicated thread, covering a single sensor. This loop will periodically retrieve sampling data through
+	 * sysfs, then package it as a sample and transfer it to our master poll loop through a report fd. Checks for a cancellation signal quite
+	 * frequently, as the thread may be disposed of at any time. Note that Bionic does not provide pthread_cancel / pthread_testcancel...
+	 */
+
+	int s = (int) (size_t) param;
+	int num_fields;
+	sensors_event_t data = {0};
+	struct timespec target_time;
+	int64_t timestamp, period;
+	size_t field_size;
+
+	if (s < 0 || s >= sensor_count) {
+		ALOGE("Invalid sensor handle!\n");
+		return NULL;
+	}
+
+	ALOGI("Entering S%d (%s) data acquisition thread: rate:%g\n", s, sensor[s].friendly_name, sensor[s].sampling_rate);
+
+	if (is_sched_configured(&acq_sched[s]))
+		apply_thread_sched(&acq_sched[s], sensor[s].friendly_name);
+
+	if (sensor[s].sampling_rate <= 0) {
+		ALOGE("Invalid rate in acquisition routine for sensor %d: %g\n", s, sensor[s].sampling_rate);
+		return NULL;
+	}
+
+	/* Initialize data fields that will be shared by all sensor reports */
+	data.version	= sizeof(sensors_event_t);
+	data.sensor	= s;
+	data.type	= sensor_desc[s].type;
+
+	num_fields = get_field_count(s, &field_size);
+
+	/*
+	 * Each condition variable is associated to a mutex that has to be locked by the thread that's waiting on it. We use these condition
+	 * variables to get the acquisition threads out of sleep quickly after the sampling rate is adjusted, or the sensor is disabled.
+	 */
+	pthread_mutex_lock(&thread_release_mutex[s]);
+
+	/* Pinpoint the moment we start sampling */
+	timestamp = get_timestamp_monotonic();
+
+	/* Check and honor termination requests */
+	while (sensor[s].thread_data_fd != -1) {
+		if (acquire_poll_sample(s, &data, num_fields, field_size))
+			goto exit;
+
+		/* Check and honor termination requests */
+		if (sensor[s].thread_data_fd == -1)
+			goto exit;
+
+		/* Recalculate period assuming sensor[s].sampling_rate can be changed dynamically during the thread run */
+		if (sensor[s].sampling_rate <= 0) {
+			ALOGE("Unexpected sampling rate for sensor %d: %g\n", s, sensor[s].sampling_rate);
+			goto exit;
+		}
+
+		period = (int64_t) (1000000000.0 / sensor[s].sampling_rate);
+		timestamp += period;
+		set_timestamp(&target_time, timestamp);
+
+		/* Sampling took us past the next deadline */
+		if (get_timestamp_monotonic() > timestamp)
+			stats_count(s, STAT_MISSED_DEADLINE);
+
+		/* Wait until the sampling time elapses, or a rate change is signaled, or a thread exit is requested */
+		pthread_cond_timedwait(&thread_release_cond[s], &thread_release_mutex[s], &target_time);
+	}
+
+exit:
+	ALOGV("Acquisition thread for S%d exiting\n", s);
+	pthread_mutex_unlock(&thread_release_mutex[s]);
+	pthread_exit(0);
+	return NULL;
+}
+
+
+static int is_scheduled (int s)
+{
+	int i;
+
+	for (i=0; i<scheduled_count; i++)
+		if (scheduled_sensor[i] == s)
+			return 1;
+
+	return 0;
+}
+
+
+static void insert_scheduled_sensor (int s)
+{
+	/* Insert a sensor in the queue of the shared acquisition thread, according to its deadline ; called with the scheduler mutex held */
+
+	int i = scheduled_count;
+
+	while (i > 0 && sensor[scheduled_sensor[i-1]].poll_deadline > sensor[s].poll_deadline) {
+		scheduled_sensor[i] = scheduled_sensor[i-1];
+		i--;
+	}
+
+	scheduled_sensor[i] = s;
+	scheduled_count++;
+}
+
+
+static void remove_scheduled_sensor (int s)
+{
+	/* Remove a sensor from the queue of the shared acquisition thread, if it's there ; called with the scheduler mutex held */
+
+	int i;
+
+	for (i=0; i<scheduled_count; i++)
+		if (scheduled_sensor[i] == s) {
+			scheduled_count--;
+			memmove(&scheduled_sensor[i], &scheduled_sensor[i+1], (scheduled_count - i) * sizeof(int));
+			return;
+		}
+}
+
+
+static void* scheduler_routine (__attribute__((unused)) void* param)
+{
+	/*
+	 * Shared data acquisition routine, covering all poll mode sensors. The sensor with the earliest deadline determines when we wake up ;
+	 * sensors whose deadlines fall within the slack of that date get sampled right away too, saving wakeups. The queue mutex is released
+	 * while sampling, as some sysfs reads are lengthy.
+	 */
+
+	int due_count;
+	int i, s;
+	int num_fields;
+	size_t field_size;
+	int64_t now, period;
+	struct timespec target_time;
+	sensors_event_t data;
+
+	ALOGI("Entering shared poll mode data acquisition thread, slack:%lld ns\n", poll_slack);
+
+	if (is_sched_configured(&scheduler_sched))
+		apply_thread_sched(&scheduler_sched, "shared acquisition");
+
+	pthread_mutex_lock(&scheduler_mutex);
+
+	for (;;) {
+		if (!scheduled_count) {
+			pthread_cond_wait(&scheduler_cond, &scheduler_mutex);
+			continue;
+		}
+
+		now = get_timestamp_monotonic();
+
+		/* Wait until the earliest deadline elapses, or the queue gets updated */
+		if (sensor[scheduled_sensor[0]].poll_deadline > now) {
+			set_timestamp(&target_time, sensor[scheduled_sensor[0]].poll_deadline);
+			pthread_cond_timedwait(&scheduler_cond, &scheduler_mutex, &target_time);
+			continue;
+		}
+
+		/* Dequeue all the sensors that are due, or close enough to be due */
+		due_count = 0;
+
+		while (scheduled_count && sensor[scheduled_sensor[0]].poll_deadline <= now + poll_slack) {
+			due_sensor[due_count++] = scheduled_sensor[0];
+			remove_scheduled_sensor(scheduled_sensor[0]);
+		}
+
+		scheduler_busy = 1;
+		pthread_mutex_unlock(&scheduler_mutex);
+
+		for (i=0; i<due_count; i++) {
+			s = due_sensor[i];
+
+			memset(&data, 0, sizeof(data));
+			data.version	= sizeof(sensors_event_t);
+			data.sensor	= s;
+			data.type	= sensor_desc[s].type;
+
+			num_fields = get_field_count(s, &field_size);
+
+			acquire_poll_sample(s, &data, num_fields, field_size);
+		}
+
+		pthread_mutex_lock(&scheduler_mutex);
+		scheduler_busy = 0;
+
+		now = get_timestamp_monotonic();
+
+		/* Requeue the sensors we sampled, unless they got disabled or rescheduled in the meantime */
+		for (i=0; i<due_count; i++) {
+			s = due_sensor[i];
+
+			if (!sensor[s].poll_scheduled || is_scheduled(s) || sensor[s].sampling_rate <= 0)
+				continue;
+
+			period = (int64_t) (1000000000.0 / sensor[s].sampling_rate);
+			sensor[s].poll_deadline += period;
+
+			/* If we fell behind, skip the missed periods rather than sampling in bursts */
+			if (sensor[s].poll_deadline <= now) {
+				sensor[s].poll_deadline = now + period;
+				stats_count(s, STAT_MISSED_DEADLINE);
+			}
+
+			insert_scheduled_sensor(s);
+		}
+
+		pthread_cond_broadcast(&scheduler_idle_cond);
+	}
+
+	return NULL;
+}
+
+
+static void schedule_poll_sensor (int s)
+{
+	/* Have the shared acquisition thread sample this sensor right away, and periodically from there */
+
+	pthread_mutex_lock(&scheduler_mutex);
+
+	remove_scheduled_sensor(s);
+
+	sensor[s].poll_scheduled = 1;
+	sensor[s].poll_deadline = get_timestamp_monotonic();
+	insert_scheduled_sensor(s);
+
+	if (!scheduler_started && !pthread_create(&scheduler_thread, NULL, scheduler_routine, NULL))
+		scheduler_started = 1;
+
+	pthread_cond_signal(&scheduler_cond);
+	pthread_mutex_unlock(&scheduler_mutex);
+}
+
+
+static void unschedule_poll_sensor (int s)
+{
+	/* Stop sampling this sensor from the shared acquisition thread ; on return the thread is guaranteed not to touch it */
+
+	pthread_mutex_lock(&scheduler_mutex);
+
+	sensor[s].poll_scheduled = 0;
+	remove_scheduled_sensor(s);
+
+	while (scheduler_busy)
+		pthread_cond_wait(&scheduler_idle_cond, &scheduler_mutex);
+
+	pthread_mutex_unlock(&scheduler_mutex);
+}
+
+
+static void start_acquisition_thread (int s)
+{
+	int incoming_data_fd;
+	int ret;
+
+	struct epoll_event ev = {0};
+
+	ALOGV("Initializing acquisition context for sensor %d\n", s);
+
+	/* Create an empty ring and its doorbell for inter thread communication */
+	sensor_queue[s].thread_ring_head = 0;
+	sensor_queue[s].thread_ring_tail = 0;
+
+	incoming_data_fd = eventfd(0, EFD_NONBLOCK);
+
+	if (incoming_data_fd == -1)
+		ALOGE("Failed creating eventfd for S%d (%s)\n", s, strerror(errno));
+
+	sensor[s].thread_data_fd = incoming_data_fd;
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = THREAD_REPORT_TAG_BASE + s;
+
+	/* Add eventfd to our poll set, with a suitable tag */
+	ret = epoll_ctl(poll_fd, EPOLL_CTL_ADD, incoming_data_fd , &ev);
+	if (ret == -1) {
+		ALOGE("Failed adding %d to poll set (%s)\n",
+			incoming_data_fd, strerror(errno));
+	}
+
+	/* Let the shared acquisition thread handle this sensor if it's in use */
+	if (shared_poll_scheduler) {
+		schedule_poll_sensor(s);
+		return;
+	}
+
+	/* Create condition variable and mutex for quick thread release */
+	ret = pthread_condattr_init(&thread_cond_attr[s]);
+	ret = pthread_condattr_setclock(&thread_cond_attr[s], CLOCK_MONOTONIC);
+	ret = pthread_cond_init(&thread_release_cond[s], &thread_cond_attr[s]);
+	ret = pthread_mutex_init(&thread_release_mutex[s], NULL);
+
+	/* Create and start worker thread */
+	ret = pthread_create(&sensor[s].acquisition_thread, NULL, acquisition_routine, (void*) (size_t) s);
+}
+
+
+static void stop_acquisition_thread (int s)
+{
+	int incoming_data_fd = sensor[s].thread_data_fd;
+
+	ALOGV("Tearing down acquisition context for sensor %d\n", s);
+
+	/* Make sure the shared acquisition thread is done with this sensor before closing the eventfd it writes to */
+	if (shared_poll_scheduler)
+		unschedule_poll_sensor(s);
+
+	/* Delete the eventfd from our poll set */
+	epoll_ctl(poll_fd, EPOLL_CTL_DEL, incoming_data_fd, NULL);
+
+	/* Mark the eventfd as invalid ; that's a cheap exit flag */
+	sensor[s].thread_data_fd = -1;
+
+	if (!shared_poll_scheduler) {
+		/* Stop acquisition thread and clean up thread handle */
+		pthread_cond_signal(&thread_release_cond[s]);
+		pthread_join(sensor[s].acquisition_thread, NULL);
+
+		/* Clean up our sensor descriptor */
+		sensor[s].acquisition_thread = -1;
+
+		/* Delete condition variable and mutex */
+		pthread_cond_destroy(&thread_release_cond[s]);
+		pthread_mutex_destroy(&thread_release_mutex[s]);
+	}
+
+	/* No one is writing to the eventfd anymore */
+	close(incoming_data_fd);
+
+	/* Forget samples that were not returned yet */
+	sensor_queue[s].thread_ring_tail = sensor_queue[s].thread_ring_head;
+
+	/* The sensor is no longer sampled, we can close the sysfs fds it was read from */
+	release_immediate_value_fds(s);
+}
+
+
+static int is_fast_accelerometer (int s)
+{
+	/*
+	 * Some games don't react well to accelerometers using any-motion triggers. Even very low thresholds seem to trip them, and they tend to
+	 * request fairly high event rates. Favor continuous triggers if the sensor is an accelerometer and uses a sampling rate of at least 25.
+	 */
+
+	if (sensor[s].type != SENSOR_TYPE_ACCELEROMETER)
+		return 0;
+
+	if (sensor[s].sampling_rate < 25)
+		return 0;
+
+	return 1;
+}
+
+
+static void tentative_switch_trigger (int s)
+{
+	/*
+	 * Under certain situations it may be beneficial to use an alternate trigger:
 	 *
 	 * - for applications using the accelerometer with high sampling rates, prefer the continuous trigger over the any-motion one, to avoid
 	 *   jumps related to motion thresholds
 	 */
 
-	if (is_fast_accelerometer(s) && !(sensor[s].quirks & QUIRK_TERSE_DRIVER) && sensor[s].selected_trigger == sensor[s].motion_trigger_name)
-		setup_trigger(s, sensor[s].init_trigger_name);
+	if (is_fast_accelerometer(s) && !(sensor[s].quirks & QUIRK_TERSE_DRIVER) && sensor_state[s].selected_trigger == sensor[s].motion_trigger_name)
+		setup_trigger(s, sensor[s].init_trigger_name);
+}
+
+
+static int64_t get_group_min_report_latency (int s)
+{
+	/* Review the report latencies requested for this sensor and the active sensors built on top of it, and return the minimum */
+
+	int i, v;
+
+	int64_t latency = INT64_MAX;
+
+	if (sensor_state[s].directly_enabled)
+		latency = sensor[s].max_report_latency;
+
+	/* Direct report channels don't batch */
+	if (sensor_state[s].direct_enabled)
+		latency = 0;
+
+	for (i = 0; i < (int) sensor_state[s].ref_count; i++) {
+		v = sensor[s].active_dependent[i];
+		if (sensor[v].max_report_latency < latency)
+			latency = sensor[v].max_report_latency;
+	}
+
+	return latency;
+}
+
+
+static int get_device_watermark (int dev_num)
+{
+	/*
+	 * Compute how many scans the iio buffer of a device should accumulate before we get woken up, from the smallest report latency requested
+	 * among the enabled sensors of this device and their sampling rate. Samples get reported as soon as they are available if any of the
+	 * sensors can't batch, or uses a motion trigger, as the timestamp channel is not reliable in that case.
+	 */
+
+	int s;
+	int64_t latency = INT64_MAX;
+	int64_t l;
+	float rate = 0;
+	int64_t watermark;
+	int max_watermark = 0;
+
+	if (!has_iio_ts[dev_num])
+		return 1;
+
+	for (s=0; s<sensor_count; s++)
+		if (sensor[s].dev_num == dev_num && !sensor[s].is_virtual && sensor[s].mode == MODE_TRIGGER && is_enabled(s)) {
+			if (!sensor_desc[s].fifoMaxEventCount || sensor_state[s].selected_trigger == sensor[s].motion_trigger_name)
+				return 1;
+
+			l = get_group_min_report_latency(s);
+
+			if (l < latency)
+				latency = l;
+
+			if (sensor[s].sampling_rate > rate)
+				rate = sensor[s].sampling_rate;
+
+			max_watermark = sensor_desc[s].fifoMaxEventCount;
+		}
+
+	if (latency == INT64_MAX || latency <= 0 || rate <= 0)
+		return 1;
+
+	watermark = (int64_t) (latency * rate / 1000000000.0);
+
+	if (watermark > max_watermark)
+		watermark = max_watermark;
+
+	if (watermark < 1)
+		watermark = 1;
+
+	return (int) watermark;
+}
+
+
+static void setup_watermark (int dev_num)
+{
+	/* Update the watermark of a iio device buffer, if needed ; this has to be done while the buffer is disabled */
+
+	char sysfs_path[PATH_MAX];
+	int watermark = get_device_watermark(dev_num);
+
+	if (watermark == device_watermark[dev_num])
+		return;
+
+	sprintf(sysfs_path, BUFFER_WATERMARK_PATH, dev_num);
+
+	if (sysfs_write_int(sysfs_path, watermark) <= 0)
+		ALOGW("Failed to set buffer watermark on dev%d to %d\n", dev_num, watermark);
+	else
+		ALOGI("Buffer watermark on dev%d set to %d\n", dev_num, watermark);
+
+	/* Record the value even if the write failed, so we don't retry it over and over */
+	device_watermark[dev_num] = watermark;
 }
 
 
@@ -733,10 +1605,11 @@ static float get_group_max_sampling_rate (int s)
 		arbitrated_rate = sensor[s].requested_rate;
 
 	/* If any of the currently active sensors built on top of this one need a higher sampling rate, switch to this rate */
-	for (i = 0; i < sensor_count; i++)
-		for (vi = 0; vi < sensor[i].base_count; vi++)
-			if (sensor[i].base[vi] == s && is_enabled(i) && sensor[i].requested_rate > arbitrated_rate)	/* If sensor i depends on sensor s */
-				arbitrated_rate = sensor[i].requested_rate;
+	for (vi = 0; vi < (int) sensor_state[s].ref_count; vi++) {
+		i = sensor[s].active_dependent[vi];
+		if (sensor[i].requested_rate > arbitrated_rate)
+			arbitrated_rate = sensor[i].requested_rate;
+	}
 
 	/* If any of the currently active sensors we rely on is using a higher sampling rate, switch to this rate */
 	for (vi = 0; vi < sensor[s].base_count; vi++) {
@@ -816,6 +1689,10 @@ static int sensor_set_rate (int s, float requested_rate)
 
 	arb_sampling_rate = requested_rate;
 
+	/* Direct report channels may need a higher rate than Android requested through the poll interface */
+	if (sensor_state[s].direct_enabled && sensor[s].direct_rate > arb_sampling_rate)
+		arb_sampling_rate = sensor[s].direct_rate;
+
 	if (arb_sampling_rate < sensor[s].min_supported_rate) {
 		ALOGV("Sampling rate %g too low for %s, using %g instead\n", arb_sampling_rate, sensor[s].friendly_name, sensor[s].min_supported_rate);
 		arb_sampling_rate = sensor[s].min_supported_rate;
@@ -842,38 +1719,56 @@ static int sensor_set_rate (int s, float requested_rate)
 
 	/* If we're dealing with a poll-mode sensor */
 	if (sensor[s].mode == MODE_POLL) {
-		if (is_enabled(s))
-			pthread_cond_signal(&thread_release_cond[s]); /* Wake up thread so the new sampling rate gets used */
+		if (is_enabled(s)) {
+			/* Wake up thread so the new sampling rate gets used */
+			if (shared_poll_scheduler)
+				schedule_poll_sensor(s);
+			else
+				pthread_cond_signal(&thread_release_cond[s]);
+		}
 		return 0;
 	}
 
-	sprintf(sysfs_path, SENSOR_SAMPLING_PATH, dev_num, prefix);
+	/* Find out, once, which attribute controls the rate of this sensor, and what its current value is */
+	if (rate_attr[s] == RATE_ATTR_UNKNOWN) {
+		sprintf(sysfs_path, SENSOR_SAMPLING_PATH, dev_num, prefix);
 
-	if (sysfs_read_float(sysfs_path, &cur_sampling_rate) != -1) {
-		per_sensor_sampling_rate = 1;
-		per_device_sampling_rate = 0;
-	} else {
-		per_sensor_sampling_rate = 0;
+		if (sysfs_read_float(sysfs_path, &sensor_rate[s]) != -1)
+			rate_attr[s] = RATE_ATTR_SENSOR;
+		else {
+			sprintf(sysfs_path, DEVICE_SAMPLING_PATH, dev_num);
 
-		sprintf(sysfs_path, DEVICE_SAMPLING_PATH, dev_num);
+			if (device_rate[dev_num] != -1 || sysfs_read_float(sysfs_path, &device_rate[dev_num]) != -1)
+				rate_attr[s] = RATE_ATTR_DEVICE;
+			else
+				rate_attr[s] = RATE_ATTR_NONE;
+		}
 
-		if (sysfs_read_float(sysfs_path, &cur_sampling_rate) != -1)
-			per_device_sampling_rate = 1;
-		else
-			per_device_sampling_rate = 0;
+		hrtimer_rate[s] = -1;
 	}
 
+	per_sensor_sampling_rate = rate_attr[s] == RATE_ATTR_SENSOR;
+	per_device_sampling_rate = rate_attr[s] == RATE_ATTR_DEVICE;
+
 	if (!per_sensor_sampling_rate && !per_device_sampling_rate) {
 		ALOGE("No way to adjust sampling rate on sensor %d\n", s);
 		return -ENOSYS;
 	}
 
+	if (per_sensor_sampling_rate) {
+		sprintf(sysfs_path, SENSOR_SAMPLING_PATH, dev_num, prefix);
+		cur_sampling_rate = sensor_rate[s];
+	} else {
+		sprintf(sysfs_path, DEVICE_SAMPLING_PATH, dev_num);
+		cur_sampling_rate = device_rate[dev_num];
+	}
+
 	if (sensor[s].hrtimer_trigger_name[0] != '\0') {
 		snprintf(trigger_path, PATH_MAX, "%s%s%d/", IIO_DEVICES, "trigger", sensor[s].trigger_nr);
 		snprintf(hrtimer_sampling_path, PATH_MAX, "%s%s", trigger_path, "sampling_frequency");
-		/* Enforce frequency update when software trigger
-		 * frequency and current sampling rate are different */
-		if (sysfs_read_float(hrtimer_sampling_path, &sr) != -1 && sr != cur_sampling_rate)
+
+		/* Enforce frequency update when software trigger frequency and current sampling rate are different */
+		if (hrtimer_rate[s] != cur_sampling_rate)
 			cur_sampling_rate = -1;
 	} else {
 		arb_sampling_rate = select_closest_available_rate(s, arb_sampling_rate);
@@ -900,6 +1795,13 @@ static int sensor_set_rate (int s, float requested_rate)
 			if (sensor[n].dev_num == dev_num && n != s && sensor[n].num_channels)
 				sensor[n].sampling_rate = arb_sampling_rate;
 
+	/* Duplicate sample deadlines depend on the sampling rate */
+	next_duplicate_ts = 0;
+
+	/* While stationary, run the device at its idle rate ; duplicate samples make up for the difference */
+	if (device_idle[dev_num] == IDLE_RATE && device_idle_rate[dev_num] < arb_sampling_rate)
+		arb_sampling_rate = device_idle_rate[dev_num];
+
 	/* If the desired rate is already active we're all set */
 	if (arb_sampling_rate == cur_sampling_rate)
 		return 0;
@@ -907,22 +1809,33 @@ static int sensor_set_rate (int s, float requested_rate)
 	ALOGI("Sensor %d (%s) sampling rate set to %g\n", s, sensor[s].friendly_name, arb_sampling_rate);
 
 	if (sensor[s].hrtimer_trigger_name[0] != '\0')
-		sysfs_write_float(hrtimer_sampling_path, ceilf(arb_sampling_rate));
+		hrtimer_rate[s] = sysfs_write_float(hrtimer_sampling_path, ceilf(arb_sampling_rate)) > 0 ? arb_sampling_rate : -1;
 
 	if (trig_sensors_per_dev[dev_num])
-		enable_buffer(dev_num, 0);
+		suspend_buffer(dev_num);
 
-	if (sensor[s].hrtimer_trigger_name[0] != '\0') {
-		sysfs_write_float(sysfs_path, select_closest_available_rate(s, arb_sampling_rate));
-	} else {
-		sysfs_write_float(sysfs_path, arb_sampling_rate);
-	}
+	if (sensor[s].hrtimer_trigger_name[0] != '\0')
+		sr = select_closest_available_rate(s, arb_sampling_rate);
+	else
+		sr = arb_sampling_rate;
+
+	/* Cache the rate we agreed on rather than the one we wrote, so we can tell when a different rate is requested */
+	if (sysfs_write_float(sysfs_path, sr) <= 0)
+		arb_sampling_rate = -1;
+
+	if (per_sensor_sampling_rate)
+		sensor_rate[s] = arb_sampling_rate;
+	else
+		device_rate[dev_num] = arb_sampling_rate;
 
 	/* Check if it makes sense to use an alternate trigger */
 	tentative_switch_trigger(s);
 
+	/* The number of scans matching the requested report latency depends on the sampling rate */
+	setup_watermark(dev_num);
+
 	if (trig_sensors_per_dev[dev_num])
-		enable_buffer(dev_num, 1);
+		resume_buffer(dev_num);
 
 	return 0;
 }
@@ -936,7 +1849,7 @@ static void reapply_sampling_rates (int s)
 	 * that ended up being used after arbitration.
 	 */
 
-	int i, j, base;
+	int i, base;
 
 	if (sensor[s].is_virtual) {
 		/* Take care of downwards dependencies */
@@ -948,10 +1861,30 @@ static void reapply_sampling_rates (int s)
 	}
 
 	/* Upwards too */
-	for (i=0; i<sensor_count; i++)
-		for (j=0; j<sensor[i].base_count; j++)
-			if (sensor[i].base[j] == s) /* If sensor i depends on sensor s */
-				sensor_set_rate(i, sensor[i].requested_rate);
+	for (i=0; i<sensor[s].dependent_count; i++)
+		sensor_set_rate(sensor[s].dependent[i], sensor[sensor[s].dependent[i]].requested_rate);
+}
+
+
+static void update_active_dependents (int base, int s, int enabled)
+{
+	/* Add or remove virtual sensor s from the list of active sensors built on top of base ; the list length is the base ref count */
+
+	int i;
+	int count = sensor_state[base].ref_count;
+
+	if (enabled) {
+		sensor[base].active_dependent[count] = s;
+		sensor_state[base].ref_count++;
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		if (sensor[base].active_dependent[i] == s) {
+			sensor[base].active_dependent[i] = sensor[base].active_dependent[count - 1];
+			sensor_state[base].ref_count--;
+			return;
+		}
 }
 
 
@@ -960,7 +1893,7 @@ static int sensor_activate_virtual (int s, int enabled, int from_virtual)
 	int i, base;
 
 	sensor[s].event_count = 0;
-	sensor[s].meta_data_pending = 0;
+	sensor_state[s].meta_data_pending = 0;
 
 	if (!check_state_change(s, enabled, from_virtual))
 		return 0;	/* The state of the sensor remains the same ; we're done */
@@ -970,17 +1903,13 @@ static int sensor_activate_virtual (int s, int enabled, int from_virtual)
 	else
 		ALOGI("Disabling sensor %d (%s)\n", s, sensor[s].friendly_name);
 
-	sensor[s].report_pending = 0;
+	sensor_state[s].report_pending = 0;
 
 	for (i=0; i<sensor[s].base_count; i++) {
 
 		base = sensor[s].base[i];
 		sensor_activate(base, enabled, 1);
-
-		if (enabled)
-			sensor[base].ref_count++;
-		else
-			sensor[base].ref_count--;
+		update_active_dependents(base, s, enabled);
 	}
 
 	/* Reevaluate sampling rates of linked sensors */
@@ -989,6 +1918,285 @@ static int sensor_activate_virtual (int s, int enabled, int from_virtual)
 }
 
 
+static int can_use_motion_trigger (int dev_num, int stationary)
+{
+	/* Check that all the active sensors of an iio device are ready to switch to their motion trigger ; accelerometer rates don't matter if we know we're stationary */
+
+	int i, s;
+
+	for (i=0; i<dev_sensor_count[dev_num]; i++) {
+		s = dev_sensor[dev_num][i];
+
+		if (sensor[s].num_channels &&
+		    (!sensor[s].motion_trigger_name[0] || !sensor_state[s].report_initialized || (!stationary && is_fast_accelerometer(s)) ||
+		     (sensor[s].quirks & QUIRK_FORCE_CONTINUOUS)))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static void select_device_trigger (int dev_num, int motion)
+{
+	/* Switch the active sensors of an iio device to either their motion or their default trigger */
+
+	int s;
+	int i;
+	int candidate[dev_sensor_count[dev_num] ? dev_sensor_count[dev_num] : 1];
+	int candidate_count = 0;
+	const char* trigger;
+
+	/* Record which particular sensors need to switch */
+
+	for (i=0; i<dev_sensor_count[dev_num]; i++) {
+		s = dev_sensor[dev_num][i];
+		trigger = motion ? sensor[s].motion_trigger_name : sensor[s].init_trigger_name;
+
+		if (sensor[s].num_channels && sensor_state[s].selected_trigger != trigger)
+				candidate[candidate_count++] = s;
+	}
+
+	if (!candidate_count)
+		return;
+
+	suspend_buffer(dev_num);
+
+	for (i=0; i<candidate_count; i++) {
+		s = candidate[i];
+		setup_trigger(s, motion ? sensor[s].motion_trigger_name : sensor[s].init_trigger_name);
+	}
+
+	/* Motion triggers do not mix with batching */
+	setup_watermark(dev_num);
+
+	resume_buffer(dev_num);
+}
+
+
+static void setup_idle_policy (int s)
+{
+	/* Read the idle policy of a sensor from its idle property, which can be set to "rate" or "motion" */
+
+	char buf[MAX_NAME_SIZE];
+
+	idle_policy[s] = IDLE_OFF;
+	still_tolerance[s] = 0;
+
+	if (sensor[s].is_virtual || sensor[s].mode != MODE_TRIGGER || sensor_get_st_prop(s, "idle", buf))
+		return;
+
+	if (!strcmp(buf, "rate"))
+		idle_policy[s] = IDLE_RATE;
+	else if (!strcmp(buf, "motion"))
+		idle_policy[s] = IDLE_MOTION;
+	else
+		return;
+
+	if (sensor_get_fl_prop(s, "idle_rate", &idle_rate[s]) || idle_rate[s] <= 0)
+		idle_rate[s] = sensor[s].min_supported_rate;
+
+	/* Accelerometers and gyroscopes serve as stillness detectors for the sensors of their iio device */
+	switch (sensor[s].type) {
+		case SENSOR_TYPE_ACCELEROMETER:
+			still_tolerance[s] = STILL_TOLERANCE_ACCEL;
+			break;
+
+		case SENSOR_TYPE_GYROSCOPE:
+			still_tolerance[s] = STILL_TOLERANCE_GYRO;
+			break;
+	}
+
+	sensor_get_fl_prop(s, "still_tolerance", &still_tolerance[s]);
+
+	ALOGI("Sensor %d (%s) idle policy: %s at %g Hz\n", s, sensor[s].friendly_name, buf, idle_rate[s]);
+}
+
+
+static int collect_still_sample (int s, const float* data)
+{
+	/* Same statistics as the gyroscope calibration routine: track per axis extremes, and start over when their spread is out of tolerance */
+
+	still_window_t* w = &still_window[s];
+	int c;
+
+	if (w->count)
+		for (c=0; c<3; c++) {
+			if (data[c] < w->min[c])
+				w->min[c] = data[c];
+
+			if (data[c] > w->max[c])
+				w->max[c] = data[c];
+
+			if (w->max[c] - w->min[c] > still_tolerance[s]) {
+				w->count = 0;
+				break;
+			}
+		}
+
+	/* Out of spec sample ; start over from here */
+	if (!w->count) {
+		for (c=0; c<3; c++)
+			w->min[c] = w->max[c] = data[c];
+
+		w->count = 1;
+		return 0;
+	}
+
+	if (w->count < still_samples)
+		w->count++;
+
+	return 1;
+}
+
+
+static int get_idle_policy (int dev_num)
+{
+	/* Return the idle policy applicable to an iio device given its active sensors, or IDLE_OFF if it should run as requested */
+
+	int i, s;
+	int policy = IDLE_MOTION;
+	int detectors = 0;
+	int gain = 0;
+	float rate = 0;
+
+	if (!dev_sensor_count[dev_num] || device_watermark[dev_num] > 1)
+		return IDLE_OFF;
+
+	for (i=0; i<dev_sensor_count[dev_num]; i++) {
+		s = dev_sensor[dev_num][i];
+
+		if (!sensor[s].num_channels)
+			continue;
+
+		/* Every active sensor has to agree, and direct report channels get the rate they asked for */
+		if (!idle_policy[s] || sensor_state[s].direct_enabled)
+			return IDLE_OFF;
+
+		if (idle_policy[s] < policy)
+			policy = idle_policy[s];
+
+		if (still_tolerance[s]) {
+			if (still_window[s].count < still_samples)
+				return IDLE_OFF;
+
+			detectors++;
+		}
+
+		if (idle_rate[s] > rate)
+			rate = idle_rate[s];
+	}
+
+	if (!detectors)
+		return IDLE_OFF;
+
+	if (policy == IDLE_MOTION && can_use_motion_trigger(dev_num, 1)) {
+		/* Nothing to gain if the regular logic already engaged motion triggers */
+		for (i=0; i<dev_sensor_count[dev_num]; i++) {
+			s = dev_sensor[dev_num][i];
+
+			if (sensor[s].num_channels && sensor_state[s].selected_trigger != sensor[s].motion_trigger_name)
+				return IDLE_MOTION;
+		}
+
+		return IDLE_OFF;
+	}
+
+	/* Otherwise fall back to using a lower rate, if there is one */
+	for (i=0; i<dev_sensor_count[dev_num]; i++) {
+		s = dev_sensor[dev_num][i];
+
+		if (sensor[s].num_channels && sensor[s].sampling_rate > rate && sensor_state[s].selected_trigger != sensor[s].motion_trigger_name)
+			gain = 1;
+	}
+
+	if (!gain || rate <= 0)
+		return IDLE_OFF;
+
+	device_idle_rate[dev_num] = rate;
+	return IDLE_RATE;
+}
+
+
+static void apply_idle_policy (int dev_num, int policy)
+{
+	/* Enter or leave idle mode on an iio device */
+
+	int i, s;
+	int previous;
+
+	/* This gets called for every sample of a stillness detector, so only take the configuration lock if a transition seems due */
+	if (policy == device_idle[dev_num])
+		return;
+
+	/* Transitions may originate from the poll thread */
+	sensor_config_begin();
+
+	previous = device_idle[dev_num];
+
+	if (policy == previous) {
+		sensor_config_commit();
+		return;
+	}
+
+	ALOGV("Idle policy on iio device %d switching from %d to %d\n", dev_num, previous, policy);
+
+	device_idle[dev_num] = policy;
+
+	/* The scan rate changes ; scans get dated from their read date while idle */
+	ts_estimator_reset(&ts_estimator[dev_num], 0);
+
+	if (policy == IDLE_MOTION || previous == IDLE_MOTION) {
+		/* Keep the motion trigger if the regular logic would use it */
+		if (policy == IDLE_MOTION || !can_use_motion_trigger(dev_num, 0))
+			select_device_trigger(dev_num, policy == IDLE_MOTION);
+	}
+
+	/* Rewrite rates ; sensor_set_rate applies the idle rate as appropriate */
+	if (policy == IDLE_RATE || previous == IDLE_RATE)
+		for (i=0; i<dev_sensor_count[dev_num]; i++) {
+			s = dev_sensor[dev_num][i];
+
+			if (sensor[s].num_channels)
+				sensor_set_rate(s, sensor[s].requested_rate);
+		}
+
+	/* Duplicate sample deadlines need a review */
+	next_duplicate_ts = 0;
+
+	sensor_config_commit();
+}
+
+
+static void review_stillness (int s, const float* data)
+{
+	/* A fresh sample was received from a stillness detector ; engage or release idle mode on its iio device */
+
+	int dev_num = sensor[s].dev_num;
+
+	if (!collect_still_sample(s, data)) {
+		apply_idle_policy(dev_num, IDLE_OFF);
+		return;
+	}
+
+	if (!device_idle[dev_num] && still_window[s].count >= still_samples)
+		apply_idle_policy(dev_num, get_idle_policy(dev_num));
+}
+
+
+static void wake_device (int dev_num)
+{
+	/* Leave idle mode before the configuration of an iio device changes ; it will be reengaged once we got enough samples again */
+
+	int i;
+
+	apply_idle_policy(dev_num, IDLE_OFF);
+
+	for (i=0; i<dev_sensor_count[dev_num]; i++)
+		still_window[dev_sensor[dev_num][i]].count = 0;
+}
+
+
 int sensor_activate (int s, int enabled, int from_virtual)
 {
 	char device_name[PATH_MAX];
@@ -1003,7 +2211,10 @@ int sensor_activate (int s, int enabled, int from_virtual)
 		return sensor_activate_virtual(s, enabled, from_virtual);
 
 	/* Prepare the report timestamp field for the first event, see set_report_ts method */
-	sensor[s].report_ts = 0;
+	sensor_state[s].report_ts = 0;
+
+	if (sensor[s].mode == MODE_TRIGGER && is_enabled(s) != !!enabled)
+		wake_device(dev_num);
 
 	ret = adjust_counters(s, enabled, from_virtual);
 
@@ -1012,7 +2223,7 @@ int sensor_activate (int s, int enabled, int from_virtual)
 		return ret;
 
 	sensor[s].event_count = 0;
-	sensor[s].meta_data_pending = 0;
+	sensor_state[s].meta_data_pending = 0;
 
 	if (enabled)
 		setup_noise_filtering(s);	/* Initialize filtering data if required */
@@ -1020,7 +2231,7 @@ int sensor_activate (int s, int enabled, int from_virtual)
 	if (sensor[s].mode == MODE_TRIGGER) {
 
 		/* Stop sampling */
-		enable_buffer(dev_num, 0);
+		suspend_buffer(dev_num);
 		setup_trigger(s, "\n");
 
 		/* If there's at least one sensor enabled on this iio device */
@@ -1032,7 +2243,8 @@ int sensor_activate (int s, int enabled, int from_virtual)
 			else
 				setup_trigger(s, sensor[s].init_trigger_name);
 
-			enable_buffer(dev_num, 1);
+			setup_watermark(dev_num);
+			resume_buffer(dev_num);
 		}
 	} else if (sensor[s].mode == MODE_POLL) {
 		if (sensor[s].needs_enable) {
@@ -1108,6 +2320,12 @@ int sensor_activate (int s, int enabled, int from_virtual)
 				return -1;
 			}
 
+			/* The driver may have reset the device while it was closed ; don't trust what we wrote before */
+			invalidate_device_config(dev_num);
+
+			if (sensor[s].requested_rate)
+				sensor_set_rate(s, sensor[s].requested_rate);
+
 			/* Note: poll-mode fds are not readable */
 #ifdef __NO_EVENTS__
 		}
@@ -1175,70 +2393,140 @@ static void enable_motion_trigger (int dev_num)
 	 * not appropriate conditions are met at the sensor level.
 	 */
 
-	int s;
-	int i;
 	int active_sensors = trig_sensors_per_dev[dev_num];
-	int candidate[MAX_SENSORS];
-	int candidate_count = 0;
 
-	if  (!active_sensors)
+	/* Cheap early check, confirmed below with the configuration lock held */
+	if  (!active_sensors || !can_use_motion_trigger(dev_num, 0))
 		return;
 
-	/* Check that all active sensors are ready to switch */
+	sensor_config_begin();
+
+	/* Check that all active sensors are ready to switch, then engage the motion trigger for sensors which aren't using it */
+	if (trig_sensors_per_dev[dev_num] && can_use_motion_trigger(dev_num, 0))
+		select_device_trigger(dev_num, 1);
+
+	sensor_config_commit();
+}
+
+static void queue_device_scan (int dev_num, unsigned char *scan, int64_t ts, int age)
+{
+	/*
+	 * Split a device scan into sensor reports, and queue them. ts is the date of the scan, or if age is nonzero the date of the read, age then
+	 * indicating how many scans were acquired after this one, so we can back-date it using the sampling period.
+	 */
+
+	int s, i, c;
+	int sr_offset;
+	queued_report_t *report;
+
+	capture_scan(dev_num, scan, expected_dev_report_size[dev_num], ts, age);
+
+	for (i=0; i<dev_sensor_count[dev_num]; i++) {
+		s = dev_sensor[dev_num][i];
+
+		if (sensor[s].mode == MODE_TRIGGER) {
+
+			report = &sensor_queue[s].report_queue[(sensor_queue[s].report_queue_head + sensor_state[s].report_queue_count) % REPORT_QUEUE_SIZE];
+
+			sr_offset = 0;
+
+			/* Copy data from device scan to sensor report */
+			for (c=0; c<sensor[s].report_copy_count; c++) {
+				memcpy(report->data + sr_offset, scan + sensor[s].report_copy[c].offset, sensor[s].report_copy[c].size);
+				sr_offset += sensor[s].report_copy[c].size;
+			}
+
+			ALOGV("Sensor %d report queued (%d bytes)\n", s, sr_offset);
+
+			report->ts = ts;
+
+			if (age && sensor[s].sampling_rate)
+				report->ts -= (int64_t) (age * 1000000000.0 / sensor[s].sampling_rate);
+
+			if (sensor[s].quirks & QUIRK_SPOTTY) {
+				set_report_ts(s, report->ts);
+				report->ts = sensor_state[s].report_ts;
+			}
+
+			sensor_state[s].report_queue_count++;
+			sensor_state[s].report_initialized = 1;
+			mark_sensor_pending(s);
+		}
+	}
+}
+
+
+static int get_queued_report_count (int s)
+{
+	/* Return how many reports are waiting to be moved to the report buffer or sample field of this sensor */
+
+	if (sensor[s].mode == MODE_POLL)
+		return __atomic_load_n(&sensor_queue[s].thread_ring_head, __ATOMIC_ACQUIRE) - sensor_queue[s].thread_ring_tail;
+
+	return sensor_state[s].report_queue_count;
+}
+
 
-	for (s=0; s<MAX_SENSORS; s++)
-		if (sensor[s].dev_num == dev_num && is_enabled(s) && sensor[s].num_channels &&
-		    (!sensor[s].motion_trigger_name[0] || !sensor[s].report_initialized || is_fast_accelerometer(s) ||
-		     (sensor[s].quirks & QUIRK_FORCE_CONTINUOUS)))
-			return; /* Nope */
+static int dequeue_report (int s)
+{
+	/* Move the oldest queued report of a sensor to its report buffer ; returns 1 if there was one */
 
-	/* Record which particular sensors need to switch */
+	queued_report_t *report;
 
-	for (s=0; s<MAX_SENSORS; s++)
-		if (sensor[s].dev_num == dev_num && is_enabled(s) && sensor[s].num_channels && sensor[s].selected_trigger != sensor[s].motion_trigger_name)
-				candidate[candidate_count++] = s;
+	if (sensor[s].mode == MODE_POLL)
+		return dequeue_thread_report(s);
 
-	if (!candidate_count)
-		return;
+	if (!sensor_state[s].report_queue_count)
+		return 0;
 
-	/* Now engage the motion trigger for sensors which aren't using it */
+	report = &sensor_queue[s].report_queue[sensor_queue[s].report_queue_head];
 
-	enable_buffer(dev_num, 0);
+	memcpy(sensor[s].report_buffer, report->data, MAX_SENSOR_REPORT_SIZE);
+	sensor_state[s].report_ts = report->ts;
 
-	for (i=0; i<candidate_count; i++) {
-		s = candidate[i];
-		setup_trigger(s, sensor[s].motion_trigger_name);
-	}
+	sensor_queue[s].report_queue_head = (sensor_queue[s].report_queue_head + 1) % REPORT_QUEUE_SIZE;
+	sensor_state[s].report_queue_count--;
 
-	enable_buffer(dev_num, 1);
+	sensor_state[s].report_pending = DATA_TRIGGER;
+	return 1;
 }
 
-static void stamp_reports (int dev_num, int64_t ts)
+
+static float get_device_sampling_rate (int dev_num)
 {
-	int s;
+	/* Return the rate at which scans are expected from this iio device, which is driven by its fastest trigger mode sensor */
 
-	for (s=0; s<MAX_SENSORS; s++)
-		if (sensor[s].dev_num == dev_num && is_enabled(s) && sensor[s].mode != MODE_POLL) {
-			if (sensor[s].quirks & QUIRK_SPOTTY)
-				set_report_ts(s, ts);
-			else
-				sensor[s].report_ts = ts;
-		}
+	int i, s;
+	float rate = 0;
+
+	for (i=0; i<dev_sensor_count[dev_num]; i++) {
+		s = dev_sensor[dev_num][i];
+
+		if (sensor[s].mode == MODE_TRIGGER && sensor[s].sampling_rate > rate)
+			rate = sensor[s].sampling_rate;
+	}
+
+	if (device_idle[dev_num] == IDLE_RATE && device_idle_rate[dev_num] < rate)
+		return device_idle_rate[dev_num];
+
+	return rate;
 }
 
 
 static int integrate_device_report_from_dev(int dev_num, int fd)
 {
 	int len;
-	int s,c;
-	unsigned char buf[MAX_DEVICE_REPORT_SIZE] = { 0 };
-	int sr_offset;
-	unsigned char *target;
-	unsigned char *source;
-	int size;
-	int64_t ts = 0;
-	int ts_offset = 0;	/* Offset of iio timestamp, if provided */
-	int64_t boot_to_rt_delta;
+	int s, i;
+	unsigned char buf[MAX_DEVICE_REPORT_SIZE * MAX_SCANS_PER_READ];
+	unsigned char *scan;
+	int scan_size = expected_dev_report_size[dev_num];
+	int scans;
+	int max_scans = MAX_SCANS_PER_READ;
+	int use_iio_ts;
+	int motion_trigger = 0;
+	int64_t ts;
+	int64_t read_ts;
+	int64_t scan_ts[MAX_SCANS_PER_READ];
 
 	/* There's an incoming report on the specified iio device char dev fd */
 	if (fd == -1) {
@@ -1246,77 +2534,87 @@ static int integrate_device_report_from_dev(int dev_num, int fd)
 		return -1;
 	}
 
-	len = read(fd, buf, expected_dev_report_size[dev_num]);
+	/* Only read as many scans as we can queue for every sensor of this device, the rest stays in the iio buffer */
+	for (i=0; i<dev_sensor_count[dev_num]; i++) {
+		s = dev_sensor[dev_num][i];
 
-	if (len == -1) {
-		ALOGE("Could not read report from iio device %d (%s)\n", dev_num, strerror(errno));
-		return -1;
+		if (sensor[s].mode == MODE_TRIGGER && REPORT_QUEUE_SIZE - sensor_state[s].report_queue_count < max_scans)
+			max_scans = REPORT_QUEUE_SIZE - sensor_state[s].report_queue_count;
 	}
 
-	ALOGV("Read %d bytes from iio device %d\n", len, dev_num);
-
-	/* Map device report to sensor reports */
-
-	for (s=0; s<MAX_SENSORS; s++)
-		if (sensor[s].dev_num == dev_num && is_enabled(s)) {
-
-			sr_offset = 0;
-
-			/* Copy data from device to sensor report buffer */
-			for (c=0; c<sensor[s].num_channels; c++) {
+	if (!max_scans) {
+		device_backlog[dev_num] = 1;
+		return 0;
+	}
 
-				target = sensor[s].report_buffer + sr_offset;
+	len = read(fd, buf, scan_size * max_scans);
 
-				source = buf + sensor[s].channel[c].offset;
+	if (len == -1) {
+		/* If we were draining batched scans, we're done */
+		device_backlog[dev_num] = 0;
 
-				size = sensor[s].channel[c].size;
+		if (errno == EAGAIN)
+			return 0;
 
-				memcpy(target, source, size);
+		ALOGE("Could not read report from iio device %d (%s)\n", dev_num, strerror(errno));
+		return -1;
+	}
 
-				sr_offset += size;
-			}
+	read_ts = get_timestamp_boot();
 
-			ALOGV("Sensor %d report available (%d bytes)\n", s, sr_offset);
+	ALOGV("Read %d bytes from iio device %d\n", len, dev_num);
 
-			sensor[s].report_pending = DATA_TRIGGER;
-			sensor[s].report_initialized = 1;
+	/* A short read can't hold a timestamp ; process it as a single scan */
+	scans = len < scan_size ? 1 : len / scan_size;
 
-		}
+	/* We only get notified once the watermark is reached ; more scans may be waiting in the buffer if ours is full */
+	device_backlog[dev_num] = device_watermark[dev_num] > 1 && scans == max_scans;
 
-	/* Tentatively switch to an any-motion trigger if conditions are met */
-	enable_motion_trigger(dev_num);
+	/* Scans don't come in periodically in any-motion mode ; don't trust the driver timestamps either then */
+	for (i=0; i<dev_sensor_count[dev_num] && !motion_trigger; i++) {
+		s = dev_sensor[dev_num][i];
 
-	/* If no iio timestamp channel was detected for this device, bail out */
-	if (!has_iio_ts[dev_num]) {
-		stamp_reports(dev_num, get_timestamp_boot());
-		return 0;
+		if (sensor_state[s].selected_trigger == sensor[s].motion_trigger_name)
+			motion_trigger = 1;
 	}
 
-	/* Don't trust the timestamp channel in any-motion mode */
-	for (s=0; s<MAX_SENSORS; s++)
-		if (sensor[s].dev_num == dev_num && is_enabled(s) && sensor[s].selected_trigger == sensor[s].motion_trigger_name) {
-			stamp_reports(dev_num, get_timestamp_boot());
-			return 0;
-		}
+	/* The same goes when duplicating samples between the scans of an idle device */
+	if (motion_trigger || device_idle[dev_num]) {
+		ts_estimator_reset(&ts_estimator[dev_num], 0);
 
-	/* Align on a 64 bits boundary */
-	ts_offset = expected_dev_report_size[dev_num] - sizeof(int64_t);
+		/* Map device scans to sensor reports, back-dating them from the read date */
+		for (i=0; i<scans; i++)
+			queue_device_scan(dev_num, buf + i * scan_size, read_ts, scans - 1 - i);
+	} else {
+		/* Use the iio timestamp channel if there is one */
+		use_iio_ts = has_iio_ts[dev_num] && len >= scan_size;
+
+		for (i=0; i<scans; i++) {
+			scan = buf + i * scan_size;
+			scan_ts[i] = 0;
+
+			/* The timestamp is the last field of the scan, aligned on a 64 bits boundary */
+			if (use_iio_ts) {
+				ts = *(int64_t*) (scan + scan_size - sizeof(int64_t));
+
+				if (ts) {
+					ALOGV("Driver timestamp on iio device %d: ts=%lld\n", dev_num, ts);
+					scan_ts[i] = device_ts_to_boot(dev_num, ts, read_ts);
+				} else
+					ALOGV("Unreliable timestamp channel on iio dev %d\n", dev_num);
+			}
+		}
 
-	/* If we read an amount of data consistent with timestamp presence */
-	if (len == expected_dev_report_size[dev_num])
-		ts = *(int64_t*) (buf + ts_offset);
+		/* Fit evenly spaced dates to the scans, based on driver timestamps or read dates */
+		ts_estimator_stamp(&ts_estimator[dev_num], scan_ts, scans, read_ts, get_device_sampling_rate(dev_num));
 
-	if (ts == 0) {
-		ALOGV("Unreliable timestamp channel on iio dev %d\n", dev_num);
-		stamp_reports(dev_num, get_timestamp_boot());
-		return 0;
+		/* Map device scans to sensor reports */
+		for (i=0; i<scans; i++)
+			queue_device_scan(dev_num, buf + i * scan_size, scan_ts[i], 0);
 	}
 
-	ALOGV("Driver timestamp on iio device %d: ts=%lld\n", dev_num, ts);
-
-	boot_to_rt_delta = get_timestamp_boot() - get_timestamp_realtime();
-
-	stamp_reports(dev_num, ts + boot_to_rt_delta);
+	/* Tentatively switch to an any-motion trigger if conditions are met */
+	enable_motion_trigger(dev_num);
 
 	return 0;
 }
@@ -1324,10 +2622,9 @@ static int integrate_device_report_from_dev(int dev_num, int fd)
 #ifndef __NO_EVENTS__
 static int integrate_device_report_from_event(int dev_num, int fd)
 {
-	int len, s;
+	int len, s, i;
 	int64_t ts;
 	struct iio_event_data event;
-	int64_t boot_to_rt_delta = get_timestamp_boot() - get_timestamp_realtime();
 
 	/* There's an incoming report on the specified iio device char dev fd */
 	if (fd == -1) {
@@ -1344,20 +2641,25 @@ static int integrate_device_report_from_event(int dev_num, int fd)
 		return -1;
 	}
 
-	ts = event.timestamp + boot_to_rt_delta;
+	ts = device_ts_to_boot(dev_num, event.timestamp, get_timestamp_boot());
 
 	ALOGV("Read event %lld from fd %d of iio device %d - ts %lld\n", event.id, fd, dev_num, ts);
 
 	/* Map device report to sensor reports */
-	for (s = 0; s < MAX_SENSORS; s++)
-		if (sensor[s].dev_num == dev_num &&
-		    is_enabled(s)) {
-			sensor[s].event_id = event.id;
-			sensor[s].report_ts = ts;
-			sensor[s].report_pending = 1;
-			sensor[s].report_initialized = 1;
-			ALOGV("Sensor %d report available (1 byte)\n", s);
-		}
+	for (i = 0; i < dev_sensor_count[dev_num]; i++) {
+		s = dev_sensor[dev_num][i];
+
+		/* An event that was not returned yet gets superseded */
+		if (sensor_state[s].report_pending)
+			stats_count(s, STAT_DROPPED);
+
+		sensor[s].event_id = event.id;
+		sensor_state[s].report_ts = ts;
+		sensor_state[s].report_pending = 1;
+		sensor_state[s].report_initialized = 1;
+		mark_sensor_pending(s);
+		ALOGV("Sensor %d report available (1 byte)\n", s);
+	}
 	return 0;
 }
 #endif
@@ -1366,7 +2668,7 @@ static int integrate_device_report(int dev_num)
 {
 	int ret = 0;
 
-	if (dev_num < 0 || dev_num >= MAX_DEVICES) {
+	if (dev_num < 0 || dev_num >= device_count) {
 		ALOGE("Event reported on unexpected iio device %d\n", dev_num);
 		return -1;
 	}
@@ -1420,14 +2722,18 @@ static int propagate_sensor_report (int s, sensors_event_t *data)
 	ALOGV("Sample on sensor %d (type %d):\n", s, sensor[s].type);
 
 	if (sensor[s].mode == MODE_POLL) {
-		/* We received a good sample but we're not directly enabled so we'll drop */
-		if (!sensor[s].directly_enabled)
+		/* We received a good sample but we're not directly enabled nor used by direct report channels so we'll drop */
+		if (!sensor_state[s].directly_enabled && !sensor_state[s].direct_enabled)
 			return 0;
 		/* Use the data provided by the acquisition thread */
 		ALOGV("Reporting data from worker thread for S%d\n", s);
 		memcpy(data, &sensor[s].sample, sizeof(sensors_event_t));
-		data->timestamp = sensor[s].report_ts;
-		return 1;
+		data->timestamp = sensor_state[s].report_ts;
+
+		if (sensor_state[s].direct_enabled)
+			direct_report_write(s, data);
+
+		return sensor_state[s].directly_enabled ? 1 : 0;
 	}
 
 	memset(data, 0, sizeof(sensors_event_t));
@@ -1435,7 +2741,7 @@ static int propagate_sensor_report (int s, sensors_event_t *data)
 	data->version	= sizeof(sensors_event_t);
 	data->sensor	= s;
 	data->type	= sensor_desc[s].type;	/* sensor_desc[s].type can differ from sensor[s].type ; internal types are remapped */
-	data->timestamp = sensor[s].report_ts;
+	data->timestamp = sensor_state[s].report_ts;
 
 #ifndef __NO_EVENTS__
 	if (sensor[s].mode == MODE_EVENT) {
@@ -1464,18 +2770,29 @@ static int propagate_sensor_report (int s, sensors_event_t *data)
 
 	current_sample = sensor[s].report_buffer;
 
-	for (c=0; c<num_fields; c++) {
+	if (sensor[s].ops.transform_sample)
+		sensor[s].ops.transform_sample(s, current_sample, data->data);
+	else
+		for (c=0; c<num_fields; c++) {
 
-		data->data[c] = sensor[s].ops.transform (s, c, current_sample);
+			data->data[c] = sensor[s].ops.transform (s, c, current_sample);
 
-		ALOGV("\tfield %d: %g\n", c, data->data[c]);
-		current_sample += sensor[s].channel[c].size;
-	}
+			ALOGV("\tfield %d: %g\n", c, data->data[c]);
+			current_sample += sensor[s].channel[c].size;
+		}
+
+	/* Let the idle governor know about fresh samples from stillness detectors */
+	if (still_tolerance[s] && sensor_state[s].report_pending == DATA_TRIGGER)
+		review_stillness(s, data->data);
 
 	ret = sensor[s].ops.finalize(s, data);
 
+	/* Direct report channels get their copy of the sample without going through the poll event array */
+	if (ret && sensor_state[s].direct_enabled)
+		direct_report_write(s, data);
+
 	/* We will drop samples if the sensor is not directly enabled */
-	if (!sensor[s].directly_enabled)
+	if (!sensor_state[s].directly_enabled)
 		return 0;
 
 	/* The finalize routine, in addition to its late sample processing duty, has the final say on whether or not the sample gets sent to Android */
@@ -1489,6 +2806,7 @@ static void synthetize_duplicate_samples (void)
 	 * Some sensor types (ex: gyroscope) are defined as continuously firing by Android, despite the fact that
 	 * we can be dealing with iio drivers that only report events for new samples. For these we generate reports
 	 * periodically, duplicating the last data we got from the driver. This is not necessary for polling sensors.
+	 * We also record the nearest upcoming deadline, so that we don't need to review sensors again before then.
 	 */
 
 	int s;
@@ -1496,22 +2814,22 @@ static void synthetize_duplicate_samples (void)
 	int64_t target_ts;
 	int64_t period;
 
+	current_ts = get_timestamp_boot();
+
+	if (current_ts < next_duplicate_ts)
+		return;
+
+	next_duplicate_ts = INT64_MAX;
+
 	for (s=0; s<sensor_count; s++) {
 
 		/* Ignore disabled sensors */
 		if (!is_enabled(s))
 			continue;
 
-		/* If the sensor is continuously firing, leave it alone */
-		if (sensor[s].selected_trigger != sensor[s].motion_trigger_name)
-			continue;
-
-		/* If we haven't seen a sample, there's nothing to duplicate */
-		if (!sensor[s].report_initialized)
-			continue;
-
-		/* If a sample was recently buffered, leave it alone too */
-		if (sensor[s].report_pending)
+		/* If the sensor is continuously firing at the requested rate, leave it alone */
+		if (sensor_state[s].selected_trigger != sensor[s].motion_trigger_name &&
+		    (sensor[s].is_virtual || sensor[s].mode != MODE_TRIGGER || !device_idle[sensor[s].dev_num]))
 			continue;
 
 		/* We also need a valid sampling rate to be configured */
@@ -1519,28 +2837,78 @@ static void synthetize_duplicate_samples (void)
 			continue;
 
 		period = (int64_t) (1000000000.0 / sensor[s].sampling_rate);
+		target_ts = sensor_state[s].report_ts + period;
 
-		current_ts = get_timestamp_boot();
-		target_ts = sensor[s].report_ts + period;
-
-		if (target_ts <= current_ts) {
+		/*
+		 * If we haven't seen a sample, there's nothing to duplicate. If a sample was recently buffered, leave it alone too. Either
+		 * way, we'll check it again once the deadline is reached.
+		 */
+		if (target_ts <= current_ts && sensor_state[s].report_initialized &&
+		    !sensor_state[s].report_pending && !sensor_state[s].report_queue_count) {
 			/* Mark the sensor for event generation */
 			set_report_ts(s, current_ts);
-			sensor[s].report_pending = DATA_DUPLICATE;
+			sensor_state[s].report_pending = DATA_DUPLICATE;
+			mark_sensor_pending(s);
+			stats_count(s, STAT_DUPLICATED);
+			target_ts = sensor_state[s].report_ts + period;
 		}
+
+		if (target_ts < next_duplicate_ts)
+			next_duplicate_ts = target_ts;
 	}
 }
 
 
 static void integrate_thread_report (uint32_t tag)
 {
+	/* Acknowledge the doorbell ; the queued samples get returned by sensor_poll */
+
 	int s = tag - THREAD_REPORT_TAG_BASE;
-	int len;
+	uint64_t count;
+
+	if (s >= sensor_count) {
+		ALOGE("Thread report signaled for unexpected sensor %d\n", s);
+		return;
+	}
+
+	if (read(sensor[s].thread_data_fd, &count, sizeof(count)) == sizeof(count))
+		ALOGV("S%d: %llu samples signaled\n", s, count);
+
+	mark_sensor_pending(s);
+}
+
+
+static int drain_batched_reports (void)
+{
+	/*
+	 * Read scans left over in iio buffers after a watermark notification or flush request. These are read one at a time, so as to go
+	 * through the regular device report processing path. Returns the number of devices we tried to read from.
+	 */
+
+	int dev_num;
+	int count = 0;
+
+	for (dev_num=0; dev_num<device_count; dev_num++)
+		if (device_backlog[dev_num]) {
+			if (device_fd[dev_num] == -1)
+				device_backlog[dev_num] = 0;
+			else
+				integrate_device_report_from_dev(dev_num, device_fd[dev_num]);
+			count++;
+		}
+
+	return count;
+}
+
 
-	len = read(sensor[s].thread_data_fd[0], &sensor[s].sample, sizeof(sensors_event_t));
+static int is_flush_pending_on_batch (int s)
+{
+	/* Flush complete events have to be reported after the batched samples of the sensor, so hold them while its iio buffer gets drained */
+
+	if (sensor[s].is_virtual && sensor[s].base_count)
+		s = sensor[s].base[0];
 
-	if (len == sizeof(sensors_event_t))
-		sensor[s].report_pending = DATA_SYSFS;
+	return get_queued_report_count(s) || (sensor[s].mode == MODE_TRIGGER && device_backlog[sensor[s].dev_num]);
 }
 
 
@@ -1551,28 +2919,19 @@ static int get_poll_wait_timeout (void)
 	 * for iio device reports and incoming reports from our sensor sysfs data reader threads.
 	 */
 
-	int s;
-	int64_t target_ts = INT64_MAX;
 	int64_t ms_to_wait;
-	int64_t period;
 
 	/*
 	 * Check if we're dealing with a driver that only send events when there is motion, despite the fact that the associated Android sensor
-	 * type is continuous rather than on-change. In that case we have to duplicate events. Check deadline for the nearest upcoming event.
+	 * type is continuous rather than on-change. In that case we have to duplicate events. The deadline for the nearest upcoming event was
+	 * recorded when we last went through synthetize_duplicate_samples.
 	 */
-	for (s=0; s<sensor_count; s++)
-		if (is_enabled(s) && sensor[s].selected_trigger == sensor[s].motion_trigger_name && sensor[s].sampling_rate) {
-			period = (int64_t) (1000000000.0 / sensor[s].sampling_rate);
-
-			if (sensor[s].report_ts + period < target_ts)
-				target_ts = sensor[s].report_ts + period;
-		}
 
 	/* If we don't have such a driver to deal with */
-	if (target_ts == INT64_MAX)
+	if (next_duplicate_ts == INT64_MAX)
 		return -1; /* Infinite wait */
 
-	ms_to_wait = (target_ts - get_timestamp_boot()) / 1000000;
+	ms_to_wait = (next_duplicate_ts - get_timestamp_boot()) / 1000000;
 
 	/* If the target timestamp is already behind us, don't wait */
 	if (ms_to_wait < 1)
@@ -1582,14 +2941,117 @@ static int get_poll_wait_timeout (void)
 }
 
 
+static int has_report (int s)
+{
+	return sensor_state[s].report_pending || get_queued_report_count(s);
+}
+
+
+static int64_t get_next_report_ts (int s)
+{
+	/* Return the timestamp of the report a sensor would return next ; only valid if it has one */
+
+	if (sensor_state[s].report_pending) {
+		if (sensor[s].is_virtual || sensor[s].mode == MODE_POLL)
+			return sensor[s].sample.timestamp;
+
+		return sensor_state[s].report_ts;
+	}
+
+	if (sensor[s].mode == MODE_POLL)
+		return sensor_queue[s].thread_ring[sensor_queue[s].thread_ring_tail % THREAD_RING_SIZE].timestamp;
+
+	return sensor_queue[s].report_queue[sensor_queue[s].report_queue_head].ts;
+}
+
+
+static void update_pending_state (int s)
+{
+	/* Lower the pending flag of a sensor once it has nothing left ; check again afterwards as a flush request may have come in meanwhile */
+
+	if (has_report(s) || sensor_state[s].meta_data_pending)
+		return;
+
+	__atomic_fetch_and(&pending_sensors[s / PENDING_WORD_BITS], ~(1U << (s % PENDING_WORD_BITS)), __ATOMIC_SEQ_CST);
+
+	if (sensor_state[s].meta_data_pending)
+		mark_sensor_pending(s);
+}
+
+
+static int get_next_pending_sensor (void)
+{
+	/*
+	 * Select the pending sensor whose next report is the oldest, so that reports from all sensors get merged in timestamp order. Flush
+	 * completions that are not held by batched samples go first. Virtual sensors have the timestamp of the base sensor sample they were
+	 * derived from, and win ties so that they are returned before the base sensor moves to its next sample. Returns -1 if there is none.
+	 */
+
+	int w, s;
+	uint32_t bits;
+	int64_t ts;
+	int64_t best_ts = 0;
+	int best = -1;
+
+	for (w = 0; w < pending_words; w++) {
+		bits = __atomic_load_n(&pending_sensors[w], __ATOMIC_SEQ_CST);
+
+		while (bits) {
+			s = w * PENDING_WORD_BITS + __builtin_ctz(bits);
+			bits &= bits - 1;
+
+			if (has_report(s))
+				ts = get_next_report_ts(s);
+			else if (sensor_state[s].meta_data_pending && !is_flush_pending_on_batch(s))
+				ts = INT64_MIN;
+			else {
+				update_pending_state(s);
+				continue;
+			}
+
+			if (best == -1 || ts < best_ts || (ts == best_ts && sensor[s].is_virtual)) {
+				best = s;
+				best_ts = ts;
+			}
+		}
+	}
+
+	return best;
+}
+
+
+static void record_report_latencies (sensors_event_t* data, int count)
+{
+	/* Account for the delay between the dates of the samples we're about to return and now */
+
+	int64_t now = get_timestamp_boot();
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (data[i].type != SENSOR_TYPE_META_DATA)
+			stats_record_latency(data[i].sensor, now - data[i].timestamp);
+}
+
+
 int sensor_poll (sensors_event_t* data, int count)
 {
 	int s;
 	int i;
 	int nfds;
-	struct epoll_event ev[MAX_DEVICES];
+	struct epoll_event ev[device_count + sensor_count + 1];	/* One entry per poll set member at most */
 	int returned_events;
 	int event_count;
+	pid_t tid;
+
+	/* Apply the configured scheduling parameters to the thread polling us, the first time it does */
+	if (is_sched_configured(&poll_sched)) {
+		tid = syscall(SYS_gettid);
+
+		if (tid != poll_sched_tid) {
+			apply_thread_sched(&poll_sched, "poll");
+			poll_sched_tid = tid;
+		}
+	}
 
 	/* Get one or more events from our collection of sensors */
 return_available_sensor_reports:
@@ -1599,20 +3061,30 @@ return_available_sensor_reports:
 
 	returned_events = 0;
 
-	/* Check our sensor collection for available reports */
-	for (s=0; s<sensor_count && returned_events < count; s++) {
+	/* Return available reports from pending sensors, one at a time and oldest first */
+	while (returned_events < count && (s = get_next_pending_sensor()) != -1) {
 
-		if (sensor[s].report_pending) {
+		/* Pick the next queued report if there's nothing pending already */
+		if (!sensor_state[s].report_pending)
+			dequeue_report(s);
+
+		if (sensor_state[s].report_pending) {
 			event_count = 0;
 
 			if (sensor[s].is_virtual)
 				event_count = propagate_vsensor_report(s, &data[returned_events]);
-			else
+			else {
 				/* Report this event if it looks OK */
 				event_count = propagate_sensor_report(s, &data[returned_events]);
 
+				/* Virtual sensors built on top of this one may have derived a sample from it */
+				for (i = 0; i < (int) sensor_state[s].ref_count; i++)
+					if (sensor_state[sensor[s].active_dependent[i]].report_pending)
+						mark_sensor_pending(sensor[s].active_dependent[i]);
+			}
+
 			/* Lower flag */
-			sensor[s].report_pending = 0;
+			sensor_state[s].report_pending = 0;
 			returned_events += event_count;
 
 			/*
@@ -1621,7 +3093,7 @@ return_available_sensor_reports:
 			 */
 		}
 
-		while (sensor[s].meta_data_pending) {
+		while (sensor_state[s].meta_data_pending && !is_flush_pending_on_batch(s) && returned_events < count) {
 			/* See sensors.h on these */
 			data[returned_events].version = META_DATA_VERSION;
 			data[returned_events].sensor = 0;
@@ -1631,18 +3103,26 @@ return_available_sensor_reports:
 			data[returned_events].meta_data.sensor = s;
 			data[returned_events].meta_data.what = META_DATA_FLUSH_COMPLETE;
 			returned_events++;
-			sensor[s].meta_data_pending--;
+			sensor_state[s].meta_data_pending--;
 		}
+
+		update_pending_state(s);
 	}
 
-	if (returned_events)
+	if (returned_events) {
+		record_report_latencies(data, returned_events);
 		return returned_events;
+	}
+
+	/* Deliver batched samples still sitting in iio buffers before going back to sleep */
+	if (drain_batched_reports())
+		goto return_available_sensor_reports;
 
 await_event:
 
 	ALOGV("Awaiting sensor data\n");
 
-	nfds = epoll_wait(poll_fd, ev, MAX_DEVICES, get_poll_wait_timeout());
+	nfds = epoll_wait(poll_fd, ev, device_count + sensor_count + 1, get_poll_wait_timeout());
 
 	if (nfds == -1) {
 		ALOGE("epoll_wait returned -1 (%s)\n", strerror(errno));
@@ -1655,13 +3135,13 @@ await_event:
 	for (i=0; i<nfds; i++)
 		if (ev[i].events == EPOLLIN)
 			switch (ev[i].data.u32) {
-				case 0 ... MAX_DEVICES-1:
+				case 0 ... THREAD_REPORT_TAG_BASE-1:
 					/* Read report from iio char dev fd */
 					integrate_device_report(ev[i].data.u32);
 					break;
 
 				case THREAD_REPORT_TAG_BASE ...
-				     THREAD_REPORT_TAG_BASE + MAX_SENSORS-1:
+				     FLUSH_REPORT_TAG-1:
 					/* Get report from acquisition thread */
 					integrate_thread_report(ev[i].data.u32);
 					break;
@@ -1708,55 +3188,357 @@ int sensor_set_delay (int s, int64_t ns)
 }
 
 
+static void update_watermark (int dev_num)
+{
+	/* Reevaluate the watermark of a iio device whose sensors are running */
+
+	if (!trig_sensors_per_dev[dev_num] || get_device_watermark(dev_num) == device_watermark[dev_num])
+		return;
+
+	wake_device(dev_num);
+
+	suspend_buffer(dev_num);
+	setup_watermark(dev_num);
+	resume_buffer(dev_num);
+}
+
+
+int sensor_set_batch (int s, int64_t max_report_latency_ns)
+{
+	int i;
+
+	if (max_report_latency_ns < 0) {
+		ALOGE("Invalid report latency requested on sensor %d: %lld\n", s, max_report_latency_ns);
+		return -EINVAL;
+	}
+
+	ALOGV("Report latency %lld ns requested on S%d (%s)\n", max_report_latency_ns, s, sensor[s].friendly_name);
+
+	sensor[s].max_report_latency = max_report_latency_ns;
+
+	/* Virtual sensors get their samples batched through the iio devices of their base sensors */
+	if (sensor[s].is_virtual) {
+		for (i=0; i<sensor[s].base_count; i++)
+			update_watermark(sensor[sensor[s].base[i]].dev_num);
+		return 0;
+	}
+
+	if (sensor[s].mode == MODE_TRIGGER)
+		update_watermark(sensor[s].dev_num);
+
+	return 0;
+}
+
+
+int sensor_set_direct (int s, float rate)
+{
+	/*
+	 * Enable, reconfigure or disable sensor s on behalf of direct report channels ; a zero rate means no channel uses it anymore. Activation
+	 * goes through the regular path, as if Android had requested it, and is then handed over to direct report channels or back.
+	 */
+
+	int ret;
+
+	sensor_config_begin();
+
+	/* Direct report channels expect the sensor to run at the rate they asked for */
+	if (!sensor[s].is_virtual && sensor[s].mode == MODE_TRIGGER)
+		wake_device(sensor[s].dev_num);
+
+	if (rate > 0) {
+		if (!is_enabled(s)) {
+			ret = sensor_activate(s, 1, 0);
+
+			if (ret)
+				goto done;
+
+			sensor_state[s].directly_enabled = 0;
+		}
+
+		sensor_state[s].direct_enabled = 1;
+		sensor[s].direct_rate = rate;
+	} else {
+		ret = 0;
+
+		if (!sensor_state[s].direct_enabled)
+			goto done;
+
+		sensor_state[s].direct_enabled = 0;
+		sensor[s].direct_rate = 0;
+
+		/* If nobody else relies on this sensor, take the activation back and disable it */
+		if (!sensor_state[s].directly_enabled && !sensor_state[s].ref_count) {
+			sensor_state[s].directly_enabled = 1;
+			ret = sensor_activate(s, 0, 0);
+			goto done;
+		}
+	}
+
+	if (sensor[s].mode == MODE_TRIGGER)
+		update_watermark(sensor[s].dev_num);
+
+	ret = sensor_set_rate(s, sensor[s].requested_rate);
+
+done:
+	sensor_config_commit();
+	return ret;
+}
+
+
 int sensor_flush (int s)
 {
 	char flush_event_content = 0;
+	int b;
+
 	/* If one shot or not enabled return -EINVAL */
 	if (sensor_desc[s].flags & SENSOR_FLAG_ONE_SHOT_MODE || !is_enabled(s))
 		return -EINVAL;
 
-	sensor[s].meta_data_pending++;
+	/* Anything sitting in the iio buffer has to be returned before the flush completes */
+	b = sensor[s].is_virtual && sensor[s].base_count ? sensor[s].base[0] : s;
+
+	if (sensor[b].mode == MODE_TRIGGER && device_watermark[sensor[b].dev_num] > 1)
+		device_backlog[sensor[b].dev_num] = 1;
+
+	sensor_state[s].meta_data_pending++;
+	mark_sensor_pending(s);
 	write(flush_event_fd[1], &flush_event_content, sizeof(flush_event_content));
 	return 0;
 }
 
 
+static void setup_poll_scheduler (void)
+{
+	/* Check if poll mode sensors are to be sampled from a single shared thread, e.g. ro.iio.hal.poll_scheduler = shared */
+
+	char mode[MAX_NAME_SIZE];
+	int slack_ms;
+
+	if (hal_get_st_prop("poll_scheduler", mode) || strcmp(mode, "shared"))
+		return;
+
+	if (hal_get_prop("poll_slack", &slack_ms) || slack_ms < 0)
+		slack_ms = DEFAULT_POLL_SLACK_MS;
+
+	poll_slack = slack_ms * 1000000LL;
+
+	pthread_condattr_init(&scheduler_cond_attr);
+	pthread_condattr_setclock(&scheduler_cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&scheduler_cond, &scheduler_cond_attr);
+	pthread_cond_init(&scheduler_idle_cond, NULL);
+
+	shared_poll_scheduler = 1;
+	ALOGI("Using shared poll mode scheduler (slack: %d ms)\n", slack_ms);
+}
+
+
 int allocate_control_data (void)
 {
 	int i, ret;
+	int slots;
 	struct epoll_event ev = {0};
 
-	for (i=0; i<MAX_DEVICES; i++) {
+	setup_poll_scheduler();
+
+	/* Size per device tables from the iio devices present at this point ; devices that show up later are ignored, as before */
+	device_count = get_iio_device_count();
+	slots = device_count ? device_count : 1;
+
+	poll_sensors_per_dev	 = (int*) calloc(slots, sizeof(int));
+	trig_sensors_per_dev	 = (int*) calloc(slots, sizeof(int));
+	device_fd		 = (int*) calloc(slots, sizeof(int));
+	events_fd		 = (int*) calloc(slots, sizeof(int));
+	has_iio_ts		 = (int*) calloc(slots, sizeof(int));
+	expected_dev_report_size = (int*) calloc(slots, sizeof(int));
+	device_watermark	 = (int*) calloc(slots, sizeof(int));
+	device_backlog		 = (int*) calloc(slots, sizeof(int));
+	dev_sensor		 = (int**) calloc(slots, sizeof(int*));
+	dev_sensor_count	 = (int*) calloc(slots, sizeof(int));
+	ts_estimator		 = (ts_estimator_t*) calloc(slots, sizeof(ts_estimator_t));
+	buffer_state		 = (int*) calloc(slots, sizeof(int));
+	buffer_target		 = (int*) calloc(slots, sizeof(int));
+	device_rate		 = (float*) calloc(slots, sizeof(float));
+	device_idle		 = (int*) calloc(slots, sizeof(int));
+	device_idle_rate	 = (float*) calloc(slots, sizeof(float));
+
+	if (!poll_sensors_per_dev || !trig_sensors_per_dev || !device_fd || !events_fd || !has_iio_ts || !expected_dev_report_size ||
+	    !device_watermark || !device_backlog || !dev_sensor || !dev_sensor_count || !ts_estimator || !buffer_state || !buffer_target ||
+	    !device_rate || !device_idle || !device_idle_rate) {
+		ALOGE("Can't allocate control data for %d iio devices!\n", device_count);
+		device_count = 0;
+		return -ENOMEM;
+	}
+
+	for (i=0; i<device_count; i++) {
 		device_fd[i] = -1;
 		events_fd[i] = -1;
+		buffer_state[i] = -1;
+		buffer_target[i] = -1;
+		device_rate[i] = -1;
 	}
 
-	poll_fd = epoll_create(MAX_DEVICES);
+	poll_fd = epoll_create(slots);
 
 	if (poll_fd == -1) {
 		ALOGE("Can't create epoll instance for iio sensors!\n");
-		return -1;
+		return -errno;
 	}
 
 	ret = pipe(flush_event_fd);
 	if (ret) {
 		ALOGE("Cannot create flush_event_fd");
-		return -1;
+		flush_event_fd[0] = flush_event_fd[1] = -1;
+		return -errno;
 	}
 
 	ev.events = EPOLLIN;
 	ev.data.u32 = FLUSH_REPORT_TAG;
 	ret = epoll_ctl(poll_fd, EPOLL_CTL_ADD, flush_event_fd[0] , &ev);
 	if (ret == -1) {
+		ret = -errno;
 		ALOGE("Failed adding %d to poll set (%s)\n",
-			flush_event_fd[0], strerror(errno));
-		return -1;
+			flush_event_fd[0], strerror(-ret));
+		return ret;
 	}
 
 	return poll_fd;
 }
 
 
+int allocate_sensor_control_data (void)
+{
+	/* Allocate the tables that have one entry per sensor, once enumeration has told us how many sensors we have */
+
+	int slots = sensor_count ? sensor_count : 1;
+	int dev_num;
+	int s;
+
+	pending_words		= PENDING_WORDS(slots);
+	pending_sensors		= (uint32_t*) calloc(pending_words, sizeof(uint32_t));
+	thread_cond_attr	= (pthread_condattr_t*) calloc(slots, sizeof(pthread_condattr_t));
+	thread_release_cond	= (pthread_cond_t*) calloc(slots, sizeof(pthread_cond_t));
+	thread_release_mutex	= (pthread_mutex_t*) calloc(slots, sizeof(pthread_mutex_t));
+	scheduled_sensor	= (int*) calloc(slots, sizeof(int));
+	due_sensor		= (int*) calloc(slots, sizeof(int));
+	rate_attr		= (int*) calloc(slots, sizeof(int));
+	sensor_rate		= (float*) calloc(slots, sizeof(float));
+	hrtimer_rate		= (float*) calloc(slots, sizeof(float));
+	idle_policy		= (int*) calloc(slots, sizeof(int));
+	idle_rate		= (float*) calloc(slots, sizeof(float));
+	still_tolerance		= (float*) calloc(slots, sizeof(float));
+	still_window		= (still_window_t*) calloc(slots, sizeof(still_window_t));
+	acq_sched		= (thread_sched_t*) calloc(slots, sizeof(thread_sched_t));
+	sensor_queue		= (sensor_queue_t*) calloc(slots, sizeof(sensor_queue_t));
+
+	if (!pending_sensors || !thread_cond_attr || !thread_release_cond || !thread_release_mutex || !scheduled_sensor || !due_sensor ||
+	    !rate_attr || !sensor_rate || !hrtimer_rate || !idle_policy || !idle_rate || !still_tolerance || !still_window || !acq_sched ||
+	    !sensor_queue || allocate_sensor_stats(sensor_count) || allocate_filter_arenas(sensor_count))
+		goto oom;
+
+	for (dev_num=0; dev_num<device_count; dev_num++) {
+		dev_sensor[dev_num] = (int*) calloc(slots, sizeof(int));
+
+		if (!dev_sensor[dev_num])
+			goto oom;
+	}
+
+	for (s=0; s<sensor_count; s++)
+		setup_idle_policy(s);
+
+	if (hal_get_prop("still_samples", &still_samples) || still_samples < 1)
+		still_samples = STILL_SAMPLES;
+
+	setup_thread_sched();
+	lock_hot_data();
+
+	capture_start();
+	return 0;
+
+oom:
+	ALOGE("Can't allocate control data for %d sensors!\n", sensor_count);
+	pending_words = 0;
+	return -ENOMEM;
+}
+
+
 void delete_control_data (void)
 {
+	int dev_num;
+
+	capture_stop();
+	unlock_hot_data();
+
+	for (dev_num=0; dev_num<device_count; dev_num++)
+		free(dev_sensor[dev_num]);
+
+	free(poll_sensors_per_dev);
+	free(trig_sensors_per_dev);
+	free(device_fd);
+	free(events_fd);
+	free(has_iio_ts);
+	free(expected_dev_report_size);
+	free(device_watermark);
+	free(device_backlog);
+	free(dev_sensor);
+	free(dev_sensor_count);
+	free(ts_estimator);
+	free(buffer_state);
+	free(buffer_target);
+	free(device_rate);
+	free(device_idle);
+	free(device_idle_rate);
+
+	free(pending_sensors);
+	free(thread_cond_attr);
+	free(thread_release_cond);
+	free(thread_release_mutex);
+	free(scheduled_sensor);
+	free(due_sensor);
+	free(rate_attr);
+	free(sensor_rate);
+	free(hrtimer_rate);
+	free(idle_policy);
+	free(idle_rate);
+	free(still_tolerance);
+	free(still_window);
+	free(acq_sched);
+	free(sensor_queue);
+	release_sensor_stats();
+	release_filter_arenas();
+	release_sample_histories();
+
+	if (flush_event_fd[0] != -1) {
+		close(flush_event_fd[0]);
+		close(flush_event_fd[1]);
+		flush_event_fd[0] = flush_event_fd[1] = -1;
+	}
+
+	if (poll_fd != -1) {
+		close(poll_fd);
+		poll_fd = -1;
+	}
+
+	poll_sensors_per_dev = trig_sensors_per_dev = device_fd = events_fd = has_iio_ts = NULL;
+	expected_dev_report_size = device_watermark = device_backlog = dev_sensor_count = NULL;
+	dev_sensor		= NULL;
+	ts_estimator		= NULL;
+	buffer_state		= buffer_target = NULL;
+	device_rate		= NULL;
+	rate_attr		= NULL;
+	sensor_rate		= hrtimer_rate = NULL;
+	device_idle		= NULL;
+	device_idle_rate	= idle_rate = still_tolerance = NULL;
+	idle_policy		= NULL;
+	still_window		= NULL;
+	acq_sched		= NULL;
+	sensor_queue		= NULL;
+	config_depth		= 0;
+	pending_sensors		= NULL;
+	thread_cond_attr	= NULL;
+	thread_release_cond	= NULL;
+	thread_release_mutex	= NULL;
+	scheduled_sensor	= NULL;
+	due_sensor		= NULL;
+	pending_words		= 0;
+	device_count		= 0;
 }
@@ -19,10 +19,16 @@
 
 int	sensor_activate		(int handle, int enabled, int from_virtual);
 int	sensor_set_delay	(int handle, int64_t ns);
+int	sensor_set_batch	(int handle, int64_t max_report_latency_ns);
 int	sensor_poll 		(sensors_event_t* data, int count);
 int	sensor_flush		(int handle);
+int	sensor_set_direct	(int handle, float rate);
+
+void	sensor_config_begin	(void);
+void	sensor_config_commit	(void);
 
 int	allocate_control_data	(void);
+int	allocate_sensor_control_data(void);
 void	delete_control_data	(void);
 
 void	build_sensor_report_maps(int dev_num);
@@ -15,6 +15,7 @@
 */
 
 #include <stdlib.h>
+#include <errno.h>
 #include <ctype.h>
 #include <log/log.h>
 #include <cutils/properties.h>
@@ -95,8 +96,131 @@
  * e.g. ro.iio.temp.bmg160.name = BMG160 Thermometer will be used in priority
  * over ro.iio.temp.name = BMC150 Thermometer if the sensor for which we query
  * properties values happen to have its iio device name set to bmg160.
+ *
+ * As ro properties cannot change once set, all ro.iio ones are read once, when the HAL gets initialized, and kept in a small hash table from
+ * which the getters below are served, rather than going through property_get every time a value is needed.
  */
 
+#define IIO_PROP_PREFIX		"ro.iio."
+#define PROP_CACHE_BUCKETS	64	/* Power of two */
+
+typedef struct prop_entry
+{
+	struct prop_entry* next;	/* Next entry in the same bucket */
+	uint32_t hash;
+	char* name;
+	char value[PROP_VALUE_MAX];
+}
+prop_entry_t;
+
+static prop_entry_t* prop_cache[PROP_CACHE_BUCKETS];
+static int prop_cache_loaded;	/* Set once the ro.iio properties have been snapshotted */
+static int prop_cache_failed;	/* Set if a property could not be stored in the cache  */
+
+
+static uint32_t hash_prop_name (const char* name)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+
+	while (*name)
+		hash = (hash ^ (unsigned char) *name++) * 16777619U;
+
+	return hash;
+}
+
+
+static void cache_property (const char* name, const char* value, __attribute__((unused)) void* cookie)
+{
+	prop_entry_t* entry;
+	uint32_t hash;
+
+	if (strncmp(name, IIO_PROP_PREFIX, sizeof(IIO_PROP_PREFIX) - 1))
+		return;
+
+	entry = (prop_entry_t*) calloc(1, sizeof(prop_entry_t));
+
+	if (!entry) {
+		prop_cache_failed = 1;
+		return;
+	}
+
+	entry->name = strdup(name);
+
+	if (!entry->name) {
+		free(entry);
+		prop_cache_failed = 1;
+		return;
+	}
+
+	strncpy(entry->value, value, PROP_VALUE_MAX - 1);
+
+	hash = hash_prop_name(name);
+	entry->hash = hash;
+	entry->next = prop_cache[hash & (PROP_CACHE_BUCKETS - 1)];
+	prop_cache[hash & (PROP_CACHE_BUCKETS - 1)] = entry;
+}
+
+
+int load_iio_properties (void)
+{
+	if (prop_cache_loaded)
+		return 0;
+
+	prop_cache_failed = 0;
+	property_list(cache_property, NULL);
+
+	if (prop_cache_failed) {
+		ALOGE("Can't cache iio properties!\n");
+		release_iio_properties();
+		return -ENOMEM;
+	}
+
+	prop_cache_loaded = 1;
+	return 0;
+}
+
+
+void release_iio_properties (void)
+{
+	prop_entry_t* entry;
+	int i;
+
+	for (i=0; i<PROP_CACHE_BUCKETS; i++)
+		while (prop_cache[i]) {
+			entry = prop_cache[i];
+			prop_cache[i] = entry->next;
+			free(entry->name);
+			free(entry);
+		}
+
+	prop_cache_loaded = 0;
+}
+
+
+int iio_property_get (const char* name, char* val)
+{
+	/* property_get equivalent for ro.iio properties, served from the snapshot once it has been taken ; returns the value length */
+
+	prop_entry_t* entry;
+	uint32_t hash;
+
+	if (!prop_cache_loaded)
+		return property_get(name, val, "");
+
+	hash = hash_prop_name(name);
+
+	for (entry = prop_cache[hash & (PROP_CACHE_BUCKETS - 1)]; entry; entry = entry->next)
+		if (entry->hash == hash && !strcmp(entry->name, name)) {
+			strcpy(val, entry->value);
+			return strlen(val);
+		}
+
+	val[0] = '\0';
+	return 0;
+}
+
+
 int sensor_get_st_prop (int s, const char* sel, char val[MAX_NAME_SIZE])
 {
 	char prop_name[PROP_NAME_MAX];
@@ -114,7 +238,7 @@ int sensor_get_st_prop (int s, const char* sel, char val[MAX_NAME_SIZE])
 
 	snprintf(prop_name, PROP_NAME_MAX, PROP_BASE, prefix, extended_sel);
 
-	if (property_get(prop_name, prop_val, "")) {
+	if (iio_property_get(prop_name, prop_val)) {
 		strncpy(val, prop_val, MAX_NAME_SIZE-1);
 		val[MAX_NAME_SIZE-1] = '\0';
 		return 0;
@@ -124,7 +248,7 @@ int sensor_get_st_prop (int s, const char* sel, char val[MAX_NAME_SIZE])
 		/* Try with shorthand instead of prefix */
 		snprintf(prop_name, PROP_NAME_MAX, PROP_BASE, shorthand, extended_sel);
 
-		if (property_get(prop_name, prop_val, "")) {
+		if (iio_property_get(prop_name, prop_val)) {
 			strncpy(val, prop_val, MAX_NAME_SIZE-1);
 			val[MAX_NAME_SIZE-1] = '\0';
 			return 0;
@@ -134,7 +258,7 @@ int sensor_get_st_prop (int s, const char* sel, char val[MAX_NAME_SIZE])
 
 	snprintf(prop_name, PROP_NAME_MAX, PROP_BASE, prefix, sel);
 
-	if (property_get(prop_name, prop_val, "")) {
+	if (iio_property_get(prop_name, prop_val)) {
 		strncpy(val, prop_val, MAX_NAME_SIZE-1);
 		val[MAX_NAME_SIZE-1] = '\0';
 		return 0;
@@ -168,6 +292,37 @@ int sensor_get_fl_prop (int s, const char* sel, float* val)
 }
 
 
+int hal_get_st_prop (const char* sel, char val[MAX_NAME_SIZE])
+{
+	/* Read a HAL wide property, like ro.iio.hal.poll_scheduler */
+
+	char prop_name[PROP_NAME_MAX];
+	char prop_val[PROP_VALUE_MAX];
+
+	snprintf(prop_name, PROP_NAME_MAX, HAL_PROP_BASE, sel);
+
+	if (iio_property_get(prop_name, prop_val)) {
+		strncpy(val, prop_val, MAX_NAME_SIZE-1);
+		val[MAX_NAME_SIZE-1] = '\0';
+		return 0;
+	}
+
+	return -1;
+}
+
+
+int hal_get_prop (const char* sel, int* val)
+{
+	char buf[MAX_NAME_SIZE];
+
+	if (hal_get_st_prop(sel, buf))
+		return -1;
+
+	*val = atoi(buf);
+	return 0;
+}
+
+
 char* sensor_get_name (int s)
 {
 	char buf[MAX_NAME_SIZE];
@@ -334,6 +489,34 @@ float sensor_get_max_freq (int s)
 	return ANDROID_MAX_FREQ;
 }
 
+uint32_t sensor_get_fifo_max_event_count (int s)
+{
+	/*
+	 * Batching is done by letting scans accumulate in the iio buffer of the device until a watermark is reached. This needs a watermark
+	 * control, and driver timestamps so that the buffered samples can be dated. Keep half of the buffer as headroom for our wakeup latency.
+	 */
+	char sysfs_path[PATH_MAX];
+	int buffer_length;
+
+	if (sensor[s].is_virtual || sensor[s].mode != MODE_TRIGGER)
+		return 0;
+
+	sprintf(sysfs_path, BUFFER_WATERMARK_PATH, sensor[s].dev_num);
+
+	if (sysfs_attr_exists(sysfs_path) != 1)
+		return 0;
+
+	sprintf(sysfs_path, CHANNEL_PATH "%s", sensor[s].dev_num, "in_timestamp_en");
+
+	if (sysfs_attr_exists(sysfs_path) != 1)
+		return 0;
+
+	if (sensor_get_prop(s, "buffer_length", &buffer_length) || buffer_length <= 0)
+		buffer_length = BUFFER_LENGTH;
+
+	return buffer_length / 2;
+}
+
 int sensor_get_cal_steps (int s)
 {
 	int cal_steps;
@@ -62,5 +62,12 @@ int		sensor_get_available_frequencies(int s);
 int		sensor_get_cal_steps	(int s);
 char*		sensor_get_string_type	(int s);
 int 		sensor_get_st_prop	(int s, const char* sel, char val[MAX_NAME_SIZE]);
+uint32_t	sensor_get_fifo_max_event_count (int s);
+int		hal_get_st_prop		(const char* sel, char val[MAX_NAME_SIZE]);
+int		hal_get_prop		(const char* sel, int* val);
+
+int		load_iio_properties	(void);
+void		release_iio_properties	(void);
+int		iio_property_get	(const char* name, char* val);	/* val has to hold PROP_VALUE_MAX bytes */
 
 #endif
@@ -0,0 +1,404 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <log/log.h>
+#include <hardware/sensors.h>
+#include "common.h"
+#include "control.h"
+#include "description.h"
+#include "direct-report.h"
+
+#ifdef SENSORS_DEVICE_API_VERSION_1_4
+
+#define MAX_DIRECT_CHANNELS	8	/* We can handle as many registered channels at once */
+
+/*
+ * Each registered channel is a shared memory ring of sensors_event_t structures, that we fill in sequence and wrap around. Android tells
+ * fresh events apart using the atomic counter stored in their reserved0 field, which we write last.
+ */
+typedef struct
+{
+	int handle;		/* Handle returned to Android ; 0 if this slot is unused			*/
+	int fd;			/* Our own reference on the shared memory					*/
+	sensors_event_t* ring;	/* Shared memory mapping							*/
+	size_t size;		/* Mapping size, in bytes							*/
+	int capacity;		/* How many events fit in the ring						*/
+	int write_index;	/* Next ring slot to fill							*/
+	int32_t counter;	/* Atomic counter value of the last written event				*/
+	int* rate_level;	/* SENSOR_DIRECT_RATE_ level requested for each sensor, STOP if not subscribed	*/
+	int64_t* last_ts;	/* Timestamp of the last event written for each sensor			*/
+}
+direct_channel_t;
+
+static direct_channel_t	channel[MAX_DIRECT_CHANNELS];
+static int		next_channel_handle = 1;
+static pthread_mutex_t	direct_mutex = PTHREAD_MUTEX_INITIALIZER;	/* Channels are configured and filled from different threads */
+
+
+static float get_nominal_rate (int rate_level)
+{
+	switch (rate_level) {
+		case SENSOR_DIRECT_RATE_NORMAL:		return 50;
+		case SENSOR_DIRECT_RATE_FAST:		return 200;
+		case SENSOR_DIRECT_RATE_VERY_FAST:	return 800;
+		default:				return 0;
+	}
+}
+
+
+static direct_channel_t* find_channel (int channel_handle)
+{
+	int i;
+
+	if (channel_handle <= 0)
+		return NULL;
+
+	for (i = 0; i < MAX_DIRECT_CHANNELS; i++)
+		if (channel[i].handle == channel_handle)
+			return &channel[i];
+
+	return NULL;
+}
+
+
+static float get_direct_rate (int s)
+{
+	/* Return the sampling rate needed to serve all the channels sensor s is subscribed to ; called with the channel lock held */
+
+	int i;
+	float rate = 0;
+	float r;
+
+	for (i = 0; i < MAX_DIRECT_CHANNELS; i++)
+		if (channel[i].handle) {
+			r = get_nominal_rate(channel[i].rate_level[s]);
+
+			if (r > rate)
+				rate = r;
+		}
+
+	if (sensor[s].max_supported_rate && rate > sensor[s].max_supported_rate)
+		rate = sensor[s].max_supported_rate;
+
+	return rate;
+}
+
+
+static void release_channel (direct_channel_t* ch)
+{
+	munmap(ch->ring, ch->size);
+	close(ch->fd);
+	free(ch->rate_level);
+	free(ch->last_ts);
+	memset(ch, 0, sizeof(direct_channel_t));
+}
+
+
+int direct_report_register (const struct sensors_direct_mem_t* mem, int channel_handle)
+{
+	/* Register a shared memory area as a new channel and return its handle, or unregister the specified channel if mem is NULL */
+
+	direct_channel_t* ch;
+	void* ring;
+	int fd;
+	int s, i;
+	float rate[sensor_count ? sensor_count : 1];
+
+	if (!mem) {
+		pthread_mutex_lock(&direct_mutex);
+
+		ch = find_channel(channel_handle);
+
+		if (!ch) {
+			pthread_mutex_unlock(&direct_mutex);
+			return -EINVAL;
+		}
+
+		/* Unsubscribe all sensors, then tell control code about the rates still needed by other channels */
+		for (s = 0; s < sensor_count; s++)
+			ch->rate_level[s] = SENSOR_DIRECT_RATE_STOP;
+
+		for (s = 0; s < sensor_count; s++)
+			rate[s] = get_direct_rate(s);
+
+		release_channel(ch);
+		pthread_mutex_unlock(&direct_mutex);
+
+		for (s = 0; s < sensor_count; s++)
+			if (sensor_state[s].direct_enabled)
+				sensor_set_direct(s, rate[s]);
+
+		ALOGI("Direct report channel %d unregistered\n", channel_handle);
+		return 0;
+	}
+
+	if (mem->type != SENSOR_DIRECT_MEM_TYPE_ASHMEM || mem->format != SENSOR_DIRECT_FMT_SENSORS_EVENT ||
+	    !mem->handle || mem->handle->numFds < 1 || mem->size < sizeof(sensors_event_t)) {
+		ALOGE("Unsupported direct report channel (type %d, format %d, size %zu)\n", mem->type, mem->format, mem->size);
+		return -EINVAL;
+	}
+
+	fd = dup(mem->handle->data[0]);
+
+	if (fd == -1)
+		return -errno;
+
+	ring = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (ring == MAP_FAILED) {
+		ALOGE("Could not map direct report channel memory (%s)\n", strerror(errno));
+		close(fd);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&direct_mutex);
+
+	for (i = 0; i < MAX_DIRECT_CHANNELS && channel[i].handle; i++)
+		;
+
+	if (i == MAX_DIRECT_CHANNELS) {
+		pthread_mutex_unlock(&direct_mutex);
+		ALOGE("Too many direct report channels!\n");
+		munmap(ring, mem->size);
+		close(fd);
+		return -ENOMEM;
+	}
+
+	ch = &channel[i];
+
+	ch->rate_level	= (int*) calloc(sensor_count ? sensor_count : 1, sizeof(int));
+	ch->last_ts	= (int64_t*) calloc(sensor_count ? sensor_count : 1, sizeof(int64_t));
+
+	if (!ch->rate_level || !ch->last_ts) {
+		free(ch->rate_level);
+		free(ch->last_ts);
+		ch->rate_level = NULL;
+		ch->last_ts = NULL;
+		pthread_mutex_unlock(&direct_mutex);
+		munmap(ring, mem->size);
+		close(fd);
+		return -ENOMEM;
+	}
+
+	ch->fd		= fd;
+	ch->ring	= (sensors_event_t*) ring;
+	ch->size	= mem->size;
+	ch->capacity	= mem->size / sizeof(sensors_event_t);
+	ch->write_index	= 0;
+	ch->counter	= 0;
+	ch->handle	= next_channel_handle++;
+
+	pthread_mutex_unlock(&direct_mutex);
+
+	ALOGI("Direct report channel %d registered (%d events)\n", ch->handle, ch->capacity);
+	return ch->handle;
+}
+
+
+int direct_report_config (int s, int channel_handle, int rate_level)
+{
+	/*
+	 * Subscribe sensor s to a channel at the specified rate level, or unsubscribe it if the level is SENSOR_DIRECT_RATE_STOP. s may be -1
+	 * along with SENSOR_DIRECT_RATE_STOP to stop all sensors on the channel. Returns the report token we place in the sensor field of events
+	 * written on behalf of this sensor, 0 when stopping, or a negative error code.
+	 */
+
+	direct_channel_t* ch;
+	int first, last, i;
+	int max_level;
+	float rate[sensor_count ? sensor_count : 1];
+
+	if (rate_level < SENSOR_DIRECT_RATE_STOP || rate_level > SENSOR_DIRECT_RATE_VERY_FAST)
+		return -EINVAL;
+
+	if (s == -1) {
+		if (rate_level != SENSOR_DIRECT_RATE_STOP)
+			return -EINVAL;
+
+		first = 0;
+		last = sensor_count - 1;
+	} else {
+		if (s < 0 || s >= sensor_count)
+			return -EINVAL;
+
+		max_level = (sensor_desc[s].flags & SENSOR_FLAG_MASK_DIRECT_REPORT) >> SENSOR_FLAG_SHIFT_DIRECT_REPORT;
+
+		if (rate_level > max_level)
+			return -EINVAL;
+
+		first = last = s;
+	}
+
+	pthread_mutex_lock(&direct_mutex);
+
+	ch = find_channel(channel_handle);
+
+	if (!ch) {
+		pthread_mutex_unlock(&direct_mutex);
+		return -EINVAL;
+	}
+
+	for (i = first; i <= last; i++) {
+		ch->rate_level[i] = rate_level;
+		ch->last_ts[i] = 0;
+		rate[i] = get_direct_rate(i);
+	}
+
+	pthread_mutex_unlock(&direct_mutex);
+
+	/* Sensor activation and rate changes involve sysfs accesses ; don't hold the channel lock while these happen */
+	for (i = first; i <= last; i++)
+		if ((rate[i] || sensor_state[i].direct_enabled) && sensor_set_direct(i, rate[i]) && rate_level != SENSOR_DIRECT_RATE_STOP) {
+			/* Could not bring the sensor up ; forget about this subscription */
+			pthread_mutex_lock(&direct_mutex);
+
+			ch = find_channel(channel_handle);
+
+			if (ch)
+				ch->rate_level[i] = SENSOR_DIRECT_RATE_STOP;
+
+			pthread_mutex_unlock(&direct_mutex);
+			return -EIO;
+		}
+
+	return rate_level == SENSOR_DIRECT_RATE_STOP ? 0 : s + 1;
+}
+
+
+void direct_report_write (int s, const sensors_event_t* data)
+{
+	/* Append a sample to the channels sensor s is subscribed to, skipping channels which don't need that many samples */
+
+	direct_channel_t* ch;
+	sensors_event_t* slot;
+	sensors_event_t event;
+	int64_t min_interval;
+	int i;
+
+	pthread_mutex_lock(&direct_mutex);
+
+	for (i = 0; i < MAX_DIRECT_CHANNELS; i++) {
+		ch = &channel[i];
+
+		if (!ch->handle || ch->rate_level[s] == SENSOR_DIRECT_RATE_STOP)
+			continue;
+
+		/* Tolerate some jitter in sample timestamps, but don't go way over the requested rate if the sensor runs faster for others */
+		min_interval = (int64_t) (1000000000.0 / get_nominal_rate(ch->rate_level[s]) * 3 / 4);
+
+		if (ch->last_ts[s] && data->timestamp - ch->last_ts[s] < min_interval)
+			continue;
+
+		ch->last_ts[s] = data->timestamp;
+
+		/* The counter starts at 1 and skips 0 when wrapping, so Android can tell never written slots apart */
+		ch->counter = ch->counter == INT32_MAX ? 1 : ch->counter + 1;
+
+		slot = &ch->ring[ch->write_index];
+		ch->write_index = (ch->write_index + 1) % ch->capacity;
+
+		memcpy(&event, data, sizeof(event));
+		event.sensor = s + 1;
+		event.reserved0 = slot->reserved0;
+
+		/* Fill the slot, and only then publish it by updating its counter */
+		memcpy(slot, &event, sizeof(event));
+		__atomic_store_n(&slot->reserved0, ch->counter, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&direct_mutex);
+}
+
+
+int direct_report_enabled (void)
+{
+	/* Direct report channels are off unless ro.iio.hal.direct_report is set */
+
+	int enabled = 0;
+
+	return !hal_get_prop("direct_report", &enabled) && enabled;
+}
+
+
+uint32_t direct_report_get_flags (int s)
+{
+	/* Return the direct report flags to advertise for sensor s: fast continuous sensors can opt in, through ro.iio.hal.direct_report */
+
+	int level;
+
+	if (!direct_report_enabled())
+		return 0;
+
+	if (sensor[s].is_virtual || sensor[s].mode == MODE_EVENT ||
+	    REPORTING_MODE(sensor_desc[s].flags) != SENSOR_FLAG_CONTINUOUS_MODE)
+		return 0;
+
+	/* Advertise the highest rate level we can roughly sustain ; Android accepts rates within 55% to 220% of the nominal one */
+	for (level = SENSOR_DIRECT_RATE_VERY_FAST; level > SENSOR_DIRECT_RATE_STOP; level--)
+		if (sensor[s].max_supported_rate >= get_nominal_rate(level) * 0.55)
+			break;
+
+	if (level == SENSOR_DIRECT_RATE_STOP)
+		return 0;
+
+	return (level << SENSOR_FLAG_SHIFT_DIRECT_REPORT) | SENSOR_FLAG_DIRECT_CHANNEL_ASHMEM;
+}
+
+
+void direct_report_release (void)
+{
+	/* Drop all channels ; used when the HAL gets closed, after sensors have been disabled */
+
+	int i;
+
+	pthread_mutex_lock(&direct_mutex);
+
+	for (i = 0; i < MAX_DIRECT_CHANNELS; i++)
+		if (channel[i].handle)
+			release_channel(&channel[i]);
+
+	pthread_mutex_unlock(&direct_mutex);
+}
+
+#else
+
+int direct_report_enabled (void)
+{
+	return 0;
+}
+
+
+uint32_t direct_report_get_flags (__attribute__((unused)) int s)
+{
+	return 0;
+}
+
+
+void direct_report_write (__attribute__((unused)) int s, __attribute__((unused)) const sensors_event_t* data)
+{
+}
+
+
+void direct_report_release (void)
+{
+}
+
+#endif
@@ -0,0 +1,37 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#ifndef __DIRECT_REPORT_H__
+#define __DIRECT_REPORT_H__
+
+#include <stdint.h>
+
+/*
+ * Direct report channels let Android map a shared memory ring that we fill with samples of subscribed sensors, bypassing the poll event
+ * array. These are only available with HAL 1.4 capable headers, and when enabled through the ro.iio.hal.direct_report property.
+ */
+
+#ifdef SENSORS_DEVICE_API_VERSION_1_4
+int		direct_report_register	(const struct sensors_direct_mem_t* mem, int channel_handle);
+int		direct_report_config	(int s, int channel_handle, int rate_level);
+#endif
+
+int		direct_report_enabled	(void);
+uint32_t	direct_report_get_flags	(int s);
+void		direct_report_write	(int s, const sensors_event_t* data);
+void		direct_report_release	(void);
+
+#endif
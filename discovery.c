@@ -22,6 +22,7 @@
 #include <hardware/sensors.h>
 
 #include "common.h"
+#include "utils.h"
 
 void discover_sensors(int dev_num, char *sysfs_base_path, char map[catalog_size],
 		      void (*discover_sensor)(int, char*, char*))
@@ -35,6 +36,10 @@ void discover_sensors(int dev_num, char *sysfs_base_path, char map[catalog_size]
 
 	snprintf(sysfs_dir, sizeof(sysfs_dir), sysfs_base_path, dev_num);
 
+	/* Don't bother probing folders we know are missing */
+	if (!sysfs_attr_exists(sysfs_dir))
+		return;
+
 	dir = opendir(sysfs_dir);
 	if (!dir) {
 		return;
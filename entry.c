@@ -20,6 +20,7 @@
 #include "control.h"
 #include "description.h"
 #include "utils.h"
+#include "direct-report.h"
 
 #include <errno.h>
 
@@ -49,17 +50,30 @@ static int activate (__attribute__((unused)) struct sensors_poll_device_t* dev,
 	 * 10 events per second when the sensor is enabled for the first time.
 	 */
 
-	if (enabled && sensor_get_quirks(handle) & QUIRK_INITIAL_RATE) {
+	if (enabled && sensor[handle].quirks & QUIRK_INITIAL_RATE) {
 		ALOGI("Forcing initial sampling rate\n");
+
+		/* Each step has to reach the device before the next one, so they go in separate transactions */
+		sensor_config_begin();
 		sensor_activate(handle, 1, 0);
+		sensor_config_commit();
+
+		sensor_config_begin();
 		sensor_set_delay(handle, 100000000);	/* Start with 100 ms */
+		sensor_config_commit();
+
+		sensor_config_begin();
 		sensor_activate(handle, 0, 0);
 
 		/* Clear flag for this sensor as do this only once */
 		sensor[handle].quirks ^= QUIRK_INITIAL_RATE;
+		sensor_config_commit();
 	}
 
+	/* Apply all the resulting device changes at once, with a single buffer restart per iio device */
+	sensor_config_begin();
 	ret = sensor_activate(handle, enabled, 0);
+	sensor_config_commit();
 
 	elapsed_ms = (int) ((get_timestamp_thread() - entry_ts) / 1000000);
 
@@ -78,10 +92,13 @@ static int set_delay (__attribute__((unused)) struct sensors_poll_device_t* dev,
 		      int handle, int64_t ns)
 {
 	int i;
+	int ret;
 
 	if (init_count == 0 || handle < 0 || handle >= sensor_count)
 		return -EINVAL;
 
+	sensor_config_begin();
+
 	/*
 	 * If this sensor relies on other sensors, try to propagate the
 	 * requested sampling rate to the base sensors.
@@ -90,7 +107,10 @@ static int set_delay (__attribute__((unused)) struct sensors_poll_device_t* dev,
 	for (i=0; i<sensor[handle].base_count; i++)
 		sensor_set_delay(sensor[handle].base[i], ns);
 
-	return sensor_set_delay(handle, ns);
+	ret = sensor_set_delay(handle, ns);
+
+	sensor_config_commit();
+	return ret;
 }
 
 
@@ -107,10 +127,21 @@ static int poll (__attribute__((unused)) struct sensors_poll_device_t* dev,
 static int batch (__attribute__((unused)) struct sensors_poll_device_1* dev,
 		  int sensor_handle, __attribute__((unused)) int flags,
 		  int64_t sampling_period_ns,
-		  __attribute__((unused)) int64_t max_report_latency_ns)
+		  int64_t max_report_latency_ns)
 {
-	return set_delay ((struct sensors_poll_device_t*)dev,
+	int ret;
+
+	sensor_config_begin();
+
+	/* Set the rate first, as the batch size we program depends on it */
+	ret = set_delay ((struct sensors_poll_device_t*)dev,
 		sensor_handle, sampling_period_ns);
+
+	if (!ret)
+		ret = sensor_set_batch(sensor_handle, max_report_latency_ns);
+
+	sensor_config_commit();
+	return ret;
 }
 
 static int flush (__attribute__((unused)) struct sensors_poll_device_1* dev,
@@ -120,6 +151,37 @@ static int flush (__attribute__((unused)) struct sensors_poll_device_1* dev,
 }
 
 
+#ifdef SENSORS_DEVICE_API_VERSION_1_4
+static int inject_sensor_data (__attribute__((unused)) struct sensors_poll_device_1* dev,
+			       __attribute__((unused)) const sensors_event_t* data)
+{
+	/* We don't support data injection */
+	return -EINVAL;
+}
+
+
+static int register_direct_channel (__attribute__((unused)) struct sensors_poll_device_1* dev,
+				    const struct sensors_direct_mem_t* mem, int channel_handle)
+{
+	if (init_count == 0)
+		return -EINVAL;
+
+	return direct_report_register(mem, channel_handle);
+}
+
+
+static int config_direct_report (__attribute__((unused)) struct sensors_poll_device_1* dev,
+				 int sensor_handle, int channel_handle,
+				 const struct sensors_direct_cfg_t* config)
+{
+	if (init_count == 0 || !config || sensor_handle < -1 || sensor_handle >= sensor_count)
+		return -EINVAL;
+
+	return direct_report_config(sensor_handle, channel_handle, config->rate_level);
+}
+#endif
+
+
 static int close_module (__attribute__((unused)) hw_device_t *device)
 {
 	if (init_count == 0)
@@ -129,8 +191,11 @@ static int close_module (__attribute__((unused)) hw_device_t *device)
 
 	if (init_count == 0) {
 		ALOGI("Closing IIO sensors HAL module\n");
-		delete_enumeration_data();
+		direct_report_release();
+		/* Control data goes first, as it unlocks the enumeration tables it may have locked in memory */
 		delete_control_data();
+		delete_enumeration_data();
+		release_iio_properties();
 	}
 
 	return 0;
@@ -141,6 +206,7 @@ static int initialize_module(const struct hw_module_t *module, const char *id,
 				struct hw_device_t** device)
 {
 	static struct sensors_poll_device_1 poll_device;
+	int ret;
 
 	if (strcmp(id, SENSORS_HARDWARE_POLL))
                 return -EINVAL;
@@ -156,16 +222,47 @@ static int initialize_module(const struct hw_module_t *module, const char *id,
 	poll_device.batch		= batch;
 	poll_device.flush		= flush;
 
-	*device = &poll_device.common;
-
         if (init_count == 0) {
 		ALOGI("Initializing IIO sensors HAL module\n");
-		allocate_control_data();
-		enumerate_sensors();
+
+		ret = load_iio_properties();
+		if (ret)
+			return ret;
+
+		ret = allocate_control_data();
+		if (ret < 0)
+			goto init_failed;
+
+		ret = enumerate_sensors();
+		if (ret)
+			goto init_failed;
+
+		ret = allocate_sensor_control_data();
+		if (ret)
+			goto init_failed;
 	}
 
+#ifdef SENSORS_DEVICE_API_VERSION_1_4
+	/* Only claim HAL 1.4 when direct report channels can actually be registered */
+	if (direct_report_enabled()) {
+		poll_device.common.version	= SENSORS_DEVICE_API_VERSION_1_4;
+		poll_device.inject_sensor_data	= inject_sensor_data;
+		poll_device.register_direct_channel = register_direct_channel;
+		poll_device.config_direct_report = config_direct_report;
+	}
+#endif
+
+	*device = &poll_device.common;
 	init_count++;
 	return 0;
+
+init_failed:
+	/* Undo the steps we went through in the order close_module uses ; each of these copes with partially set up data */
+	ALOGE("Failed to initialize IIO sensors HAL module (%s)\n", strerror(-ret));
+	delete_control_data();
+	delete_enumeration_data();
+	release_iio_properties();
+	return ret;
 }
 
 
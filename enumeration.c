@@ -20,6 +20,9 @@
 #include <fcntl.h>
 #include <log/log.h>
 #include <sys/stat.h>
+#include <sys/utsname.h>
+#include <stdio.h>
+#include <cutils/properties.h>
 #include <hardware/sensors.h>
 #include "enumeration.h"
 #include "description.h"
@@ -28,6 +31,7 @@
 #include "description.h"
 #include "control.h"
 #include "calibration.h"
+#include "direct-report.h"
 
 #include <errno.h>
 
@@ -234,19 +238,95 @@ sensor_catalog_entry_t sensor_catalog[] = {
 
 unsigned int catalog_size = ARRAY_SIZE(sensor_catalog);
 
+#define ENUMERATION_SNAPSHOT_PATH	"/data/iio-sensors.snapshot"	/* Location of saved enumeration results */
+#define ENUMERATION_SNAPSHOT_VERSION	1
+#define MAX_SNAPSHOT_FREQS		1024	/* Sanity limit on the count of available frequencies we reload for a sensor */
+
+typedef struct
+{
+	uint32_t version;
+	uint32_t info_size;		/* sizeof(sensor_info_t), as the tables are saved verbatim */
+	uint32_t desc_size;		/* sizeof(struct sensor_t) */
+	uint32_t catalog_size;
+	uint64_t fingerprint;		/* Hash of the kernel version, build and iio device names we enumerated */
+	int32_t sensor_count;
+}
+snapshot_header_t;
+
 /* ACPI PLD (physical location of device) definitions, as used with sensors */
 
 #define PANEL_FRONT	4
 #define PANEL_BACK	5
 
-/* Buffer default length */
-#define BUFFER_LENGTH	16
-
 /* We equate sensor handles to indices in these tables */
 
-struct sensor_t	sensor_desc[MAX_SENSORS];	/* Android-level descriptors */
-sensor_info_t	sensor[MAX_SENSORS];		/* Internal descriptors      */
-int		sensor_count;			/* Detected sensors 	     */
+struct sensor_t*	sensor_desc;		/* Android-level descriptors */
+sensor_info_t*		sensor;			/* Internal descriptors      */
+sensor_state_t*		sensor_state;		/* Poll loop state           */
+int			sensor_count;		/* Detected sensors 	     */
+static int		sensor_capacity;	/* Allocated table entries   */
+static int		sensor_alloc_failed;	/* Set if tables could not grow */
+
+
+static int reserve_sensor_entries (int count)
+{
+	/*
+	 * Make sure the sensor tables have room for at least count entries. These grow geometrically as sensors get discovered, and new entries
+	 * are zeroed. As the tables may move, pointers into them (such as the strings referenced by sensor_desc) have to be refreshed once
+	 * enumeration is over.
+	 */
+	int capacity = sensor_capacity ? sensor_capacity : 8;
+	struct sensor_t* new_desc;
+	sensor_info_t* new_info;
+	sensor_state_t* new_state;
+
+	if (count <= sensor_capacity)
+		return 0;
+
+	while (capacity < count)
+		capacity *= 2;
+
+	new_desc = (struct sensor_t*) realloc(sensor_desc, capacity * sizeof(struct sensor_t));
+	if (!new_desc)
+		goto oom;
+	sensor_desc = new_desc;
+
+	new_info = (sensor_info_t*) realloc(sensor, capacity * sizeof(sensor_info_t));
+	if (!new_info)
+		goto oom;
+	sensor = new_info;
+
+	new_state = (sensor_state_t*) realloc(sensor_state, capacity * sizeof(sensor_state_t));
+	if (!new_state)
+		goto oom;
+	sensor_state = new_state;
+
+	memset(sensor_desc  + sensor_capacity, 0, (capacity - sensor_capacity) * sizeof(struct sensor_t));
+	memset(sensor	    + sensor_capacity, 0, (capacity - sensor_capacity) * sizeof(sensor_info_t));
+	memset(sensor_state + sensor_capacity, 0, (capacity - sensor_capacity) * sizeof(sensor_state_t));
+
+	sensor_capacity = capacity;
+	return 0;
+
+oom:
+	/* Tables that were successfully grown keep their original contents, but we only report the common capacity */
+	ALOGE("Could not allocate room for %d sensors!\n", count);
+	sensor_alloc_failed = 1;
+	return -1;
+}
+
+
+static void refresh_descriptor_strings (void)
+{
+	/* Point Android-level descriptors back to the names stored in our internal descriptors, which may have moved or been swapped */
+	int s;
+
+	for (s=0; s<sensor_count; s++) {
+		sensor_desc[s].name		= sensor_get_name(s);
+		sensor_desc[s].vendor		= sensor_get_vendor(s);
+		sensor_desc[s].stringType	= sensor_get_string_type(s);
+	}
+}
 
 
 /* if the sensor has an _en attribute, we need to enable it */
@@ -451,9 +531,12 @@ static void populate_descriptors (int s, int sensor_type)
 		sensor_desc[s].minDelay, sensor_desc[s].maxDelay,
 		sensor_desc[s].flags);
 
-	/* We currently do not implement batching */
-	sensor_desc[s].fifoReservedEventCount = 0;
-	sensor_desc[s].fifoMaxEventCount = 0;
+	/*
+	 * Every scan we read from a iio device carries samples for all of its sensors, so the whole batching capacity of the device is reserved
+	 * for each of them.
+	 */
+	sensor_desc[s].fifoMaxEventCount = sensor_get_fifo_max_event_count(s);
+	sensor_desc[s].fifoReservedEventCount = sensor_desc[s].fifoMaxEventCount;
 
 	min_delay_us = sensor_desc[s].minDelay;
 	max_delay_us = sensor_desc[s].maxDelay;
@@ -463,91 +546,92 @@ static void populate_descriptors (int s, int sensor_type)
 }
 
 
-static void add_virtual_sensor (int catalog_index)
+static void add_virtual_sensor (int catalog_index, int base_sensor)
 {
-	int s;
+	int s, i, base;
 	int sensor_type;
 
-	if (sensor_count == MAX_SENSORS) {
-		ALOGE("Too many sensors!\n");
+	if (reserve_sensor_entries(sensor_count + 1))
 		return;
-	}
 
 	sensor_type = sensor_catalog[catalog_index].type;
 
 	s = sensor_count;
 
+	sensor[s].base_count = 1;
+	sensor[s].base[0] = base_sensor;
+
+	/* Register the sensor with its base sensors, so their samples get propagated to it */
+	for (i = 0; i < sensor[s].base_count; i++) {
+		base = sensor[s].base[i];
+
+		if (sensor[base].dependent_count == MAX_SENSOR_DEPENDENTS) {
+			ALOGE("Too many virtual sensors depending on sensor %d!\n", base);
+			return;
+		}
+	}
+
+	for (i = 0; i < sensor[s].base_count; i++) {
+		base = sensor[s].base[i];
+		sensor[base].dependent[sensor[base].dependent_count++] = s;
+	}
+
 	sensor[s].is_virtual = 1;
 	sensor[s].catalog_index	= catalog_index;
 	sensor[s].type		= sensor_type;
 
 	populate_descriptors(s, sensor_type);
 
+	select_transform(s);
+
 	/* Initialize fields related to sysfs reads offloading */
-	sensor[s].thread_data_fd[0]  = -1;
-	sensor[s].thread_data_fd[1]  = -1;
+	sensor[s].thread_data_fd     = -1;
 	sensor[s].acquisition_thread = -1;
 
 	sensor_count++;
 }
 
 
-static int add_sensor (int dev_num, int catalog_index, int mode)
+static void allocate_calibration_data (int s)
 {
-	int s;
-	int sensor_type;
-	int retval;
-	char sysfs_path[PATH_MAX];
-	const char* prefix;
-        float scale;
-	int c;
-	float opt_scale;
-	const char* ch_name;
-	int num_channels;
-	char suffix[MAX_NAME_SIZE + 8];
-	int calib_bias;
-	int buffer_length;
+	switch (sensor[s].type) {
+		case SENSOR_TYPE_ACCELEROMETER:
+			/* Only engage accelerometer bias compensation if really needed */
+			if (sensor[s].quirks & QUIRK_BIASED)
+				sensor[s].cal_data = calloc(1, sizeof(accel_cal_t));
+			break;
 
-	if (sensor_count == MAX_SENSORS) {
-		ALOGE("Too many sensors!\n");
-		return -1;
+			case SENSOR_TYPE_GYROSCOPE:
+			sensor[s].cal_data = malloc(sizeof(gyro_cal_t));
+			break;
+
+		case SENSOR_TYPE_MAGNETIC_FIELD:
+			sensor[s].cal_data = malloc(sizeof(compass_cal_t));
+			break;
 	}
+}
 
-	sensor_type = sensor_catalog[catalog_index].type;
 
+static void write_sensor_settings (int s)
+{
 	/*
-	 * At this point we could check that the expected sysfs attributes are
-	 * present ; that would enable having multiple catalog entries with the
-	 * same sensor type, accomodating different sets of sysfs attributes.
+	 * Store the sysfs settings that we derive from properties: these get applied at enumeration time, and again when restoring an enumeration
+	 * snapshot, as they do not survive a reboot.
 	 */
-
-	s = sensor_count;
-
-	sensor[s].dev_num	= dev_num;
-	sensor[s].catalog_index	= catalog_index;
-	sensor[s].type		= sensor_type;
-	sensor[s].mode		= mode;
-	sensor[s].trigger_nr = -1;	/* -1 means no trigger - we'll populate these at a later time */
-
-        num_channels = sensor_catalog[catalog_index].num_channels;
-
-        if (mode == MODE_POLL)
-                sensor[s].num_channels = 0;
-        else
-                sensor[s].num_channels = num_channels;
-
-	/* Populate the quirks array */
-	sensor_get_quirks(s);
-
-	/* Reject interfaces that may have been disabled through a quirk for this driver */
-	if ((mode == MODE_EVENT   && (sensor[s].quirks & QUIRK_NO_EVENT_MODE)) ||
-	    (mode == MODE_TRIGGER && (sensor[s].quirks & QUIRK_NO_TRIG_MODE )) ||
-            (mode == MODE_POLL    && (sensor[s].quirks & QUIRK_NO_POLL_MODE ))) {
-		memset(&sensor[s], 0, sizeof(sensor[0]));
-		return -1;
-	}
-
-	prefix = sensor_catalog[catalog_index].tag;
+	int dev_num = sensor[s].dev_num;
+	int catalog_index = sensor[s].catalog_index;
+	int sensor_type = sensor[s].type;
+	int mode = sensor[s].mode;
+	int num_channels = sensor_catalog[catalog_index].num_channels;
+	const char* prefix = sensor_catalog[catalog_index].tag;
+	const char* ch_name;
+	char sysfs_path[PATH_MAX];
+	char suffix[MAX_NAME_SIZE + 8];
+	int retval;
+	int calib_bias;
+	int buffer_length;
+	float scale;
+	int c;
 
 	/*
 	 * receiving the illumination sensor calibration inputs from
@@ -596,15 +680,6 @@ static int add_sensor (int dev_num, int catalog_index, int mode)
                 }
         }
 
-	/* Read name attribute, if available */
-	sprintf(sysfs_path, NAME_PATH, dev_num);
-	sysfs_read_str(sysfs_path, sensor[s].internal_name, MAX_NAME_SIZE);
-
-	/* See if we have general offsets and scale values for this sensor */
-
-	sprintf(sysfs_path, SENSOR_OFFSET_PATH, dev_num, prefix);
-	sysfs_read_float(sysfs_path, &sensor[s].offset);
-
 	sprintf(sysfs_path, SENSOR_SCALE_PATH, dev_num, prefix);
 	if (!sensor_get_fl_prop(s, "scale", &scale)) {
 		/*
@@ -623,6 +698,72 @@ static int add_sensor (int dev_num, int catalog_index, int mode)
                         }
                 }
 	}
+}
+
+
+static int add_sensor (int dev_num, int catalog_index, int mode)
+{
+	int s;
+	int sensor_type;
+	char sysfs_path[PATH_MAX];
+	const char* prefix;
+        float scale;
+	int c;
+	float opt_scale;
+	const char* ch_name;
+	int num_channels;
+	char suffix[MAX_NAME_SIZE + 8];
+
+	if (reserve_sensor_entries(sensor_count + 1))
+		return -1;
+
+	sensor_type = sensor_catalog[catalog_index].type;
+
+	/*
+	 * At this point we could check that the expected sysfs attributes are
+	 * present ; that would enable having multiple catalog entries with the
+	 * same sensor type, accomodating different sets of sysfs attributes.
+	 */
+
+	s = sensor_count;
+
+	sensor[s].dev_num	= dev_num;
+	sensor[s].catalog_index	= catalog_index;
+	sensor[s].type		= sensor_type;
+	sensor[s].mode		= mode;
+	sensor[s].trigger_nr = -1;	/* -1 means no trigger - we'll populate these at a later time */
+
+        num_channels = sensor_catalog[catalog_index].num_channels;
+
+        if (mode == MODE_POLL)
+                sensor[s].num_channels = 0;
+        else
+                sensor[s].num_channels = num_channels;
+
+	/* Decode the quirks property into the quirks bit mask, once and for all */
+	sensor_get_quirks(s);
+
+	/* Reject interfaces that may have been disabled through a quirk for this driver */
+	if ((mode == MODE_EVENT   && (sensor[s].quirks & QUIRK_NO_EVENT_MODE)) ||
+	    (mode == MODE_TRIGGER && (sensor[s].quirks & QUIRK_NO_TRIG_MODE )) ||
+            (mode == MODE_POLL    && (sensor[s].quirks & QUIRK_NO_POLL_MODE ))) {
+		memset(&sensor[s], 0, sizeof(sensor[0]));
+		return -1;
+	}
+
+	prefix = sensor_catalog[catalog_index].tag;
+
+	/* Push property provided settings down to the driver */
+	write_sensor_settings(s);
+
+	/* Read name attribute, if available */
+	sprintf(sysfs_path, NAME_PATH, dev_num);
+	sysfs_read_str(sysfs_path, sensor[s].internal_name, MAX_NAME_SIZE);
+
+	/* See if we have general offsets and scale values for this sensor */
+
+	sprintf(sysfs_path, SENSOR_OFFSET_PATH, dev_num, prefix);
+	sysfs_read_float(sysfs_path, &sensor[s].offset);
 
 	sprintf(sysfs_path, SENSOR_SCALE_PATH, dev_num, prefix);
 	if (!sysfs_read_float(sysfs_path, &scale)) {
@@ -660,11 +801,11 @@ static int add_sensor (int dev_num, int catalog_index, int mode)
 		/* Check the presence of the channel's input_path */
 		sprintf(sysfs_path, BASE_PATH "%s", dev_num,
 			sensor_catalog[catalog_index].channel[c].input_path);
-		sensor[s].channel[c].input_path_present = (access(sysfs_path, R_OK) != -1);
+		sensor[s].channel[c].input_path_present = sysfs_attr_exists(sysfs_path) && access(sysfs_path, R_OK) != -1;
 		/* Check the presence of the channel's raw_path */
 		sprintf(sysfs_path, BASE_PATH "%s", dev_num,
 			sensor_catalog[catalog_index].channel[c].raw_path);
-		sensor[s].channel[c].raw_path_present = (access(sysfs_path, R_OK) != -1);
+		sensor[s].channel[c].raw_path_present = sysfs_attr_exists(sysfs_path) && access(sysfs_path, R_OK) != -1;
 	}
 
 	sensor_get_available_frequencies(s);
@@ -708,35 +849,25 @@ static int add_sensor (int dev_num, int catalog_index, int mode)
 		strcpy(sensor[s].internal_name, "(null)");
 	}
 
-	switch (sensor_type) {
-		case SENSOR_TYPE_ACCELEROMETER:
-			/* Only engage accelerometer bias compensation if really needed */
-			if (sensor_get_quirks(s) & QUIRK_BIASED)
-				sensor[s].cal_data = calloc(1, sizeof(accel_cal_t));
-			break;
-
-			case SENSOR_TYPE_GYROSCOPE:
-			sensor[s].cal_data = malloc(sizeof(gyro_cal_t));
-			break;
-
-		case SENSOR_TYPE_MAGNETIC_FIELD:
-			sensor[s].cal_data = malloc(sizeof(compass_cal_t));
-			break;
-	}
+	allocate_calibration_data(s);
 
 	sensor[s].max_cal_level = sensor_get_cal_steps(s);
 
+	/* Check if we have a special ordering property on this sensor */
+	if (sensor_get_order(s, sensor[s].order))
+		sensor[s].quirks |= QUIRK_FIELD_ORDERING;
+
 	/* Select one of the available sensor sample processing styles */
 	select_transform(s);
 
 	/* Initialize fields related to sysfs reads offloading */
-	sensor[s].thread_data_fd[0]  = -1;
-	sensor[s].thread_data_fd[1]  = -1;
+	sensor[s].thread_data_fd     = -1;
 	sensor[s].acquisition_thread = -1;
 
-	/* Check if we have a special ordering property on this sensor */
-	if (sensor_get_order(s, sensor[s].order))
-		sensor[s].quirks |= QUIRK_FIELD_ORDERING;
+	for (c = 0; c < MAX_CHANNELS; c++) {
+		sensor[s].channel[c].raw_fd = -1;
+		sensor[s].channel[c].input_fd = -1;
+	}
 
 	sensor[s].needs_enable = get_needs_enable(dev_num, sensor_catalog[catalog_index].tag);
 
@@ -756,6 +887,9 @@ static void virtual_sensors_check (void)
 	int magn_cal_idx = 0;
 	unsigned int j;
 
+	for (i=0; i<sensor_count; i++)
+		sensor[i].dependent_count = 0;
+
 	for (i=0; i<sensor_count; i++)
 		switch (sensor[i].type) {
 			case SENSOR_TYPE_ACCELEROMETER:
@@ -794,18 +928,12 @@ static void virtual_sensors_check (void)
 					add_sensor(0, j, MODE_POLL);
 				break;
 			case SENSOR_TYPE_GYROSCOPE_UNCALIBRATED:
-				if (has_gyr) {
-					sensor[sensor_count].base_count = 1;
-					sensor[sensor_count].base[0] = gyro_cal_idx;
-					add_virtual_sensor(j);
-				}
+				if (has_gyr)
+					add_virtual_sensor(j, gyro_cal_idx);
 				break;
 			case SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED:
-				if (has_mag) {
-					sensor[sensor_count].base_count = 1;
-					sensor[sensor_count].base[0] = magn_cal_idx;
-					add_virtual_sensor(j);
-				}
+				if (has_mag)
+					add_virtual_sensor(j, magn_cal_idx);
 				break;
 			default:
 				break;
@@ -899,16 +1027,13 @@ static void update_sensor_matching_trigger_name (char name[MAX_NAME_SIZE], int*
 extern float sensor_get_max_static_freq(int s);
 extern float sensor_get_min_freq (int s);
 
-static int create_hrtimer_trigger(int s, int trigger)
+static int create_hrtimer_dir (int s)
 {
 	struct stat dir_status;
 	char buf[MAX_NAME_SIZE];
 	char hrtimer_path[PATH_MAX];
-	char hrtimer_name[MAX_NAME_SIZE];
-	float min_supported_rate = 1, min_rate_cap, max_supported_rate;
 
 	snprintf(buf, MAX_NAME_SIZE, "hrtimer-%s-hr-dev%d", sensor[s].internal_name, sensor[s].dev_num);
-	snprintf(hrtimer_name, MAX_NAME_SIZE, "%s-hr-dev%d", sensor[s].internal_name, sensor[s].dev_num);
 	snprintf(hrtimer_path, PATH_MAX, "%s%s", CONFIGFS_TRIGGER_PATH, buf);
 
 	/* Get parent dir status */
@@ -920,6 +1045,19 @@ static int create_hrtimer_trigger(int s, int trigger)
 		if (errno != EEXIST)
 			return -1;
 
+	return 0;
+}
+
+static int create_hrtimer_trigger(int s, int trigger)
+{
+	char hrtimer_name[MAX_NAME_SIZE];
+	float min_supported_rate = 1, min_rate_cap, max_supported_rate;
+
+	snprintf(hrtimer_name, MAX_NAME_SIZE, "%s-hr-dev%d", sensor[s].internal_name, sensor[s].dev_num);
+
+	if (create_hrtimer_dir(s))
+		return -1;
+
 	strncpy (sensor[s].hrtimer_trigger_name, hrtimer_name, MAX_NAME_SIZE);
 	sensor[s].trigger_nr = trigger;
 
@@ -953,36 +1091,52 @@ static void setup_trigger_names (void)
 	int s;
 	int trigger;
 	int ret;
-	int updated[MAX_SENSORS] = {0};
+	int trigger_count = get_iio_trigger_count();
+	int free_trigger = -1;
+	int* updated = (int*) calloc(sensor_count ? sensor_count : 1, sizeof(int));
+
+	if (!updated)
+		return;
 
 	/* By default, use the name-dev convention that most drivers use */
 	for (s=0; s<sensor_count; s++)
 		snprintf(sensor[s].init_trigger_name, MAX_NAME_SIZE, "%s-dev%d", sensor[s].internal_name, sensor[s].dev_num);
 
-	/* Now have a look to /sys/bus/iio/devices/triggerX entries */
+	/* Now have a look to /sys/bus/iio/devices/triggerX entries ; numbering may have gaps if triggers were removed */
 
-	for (trigger=0; trigger<MAX_TRIGGERS; trigger++) {
+	for (trigger=0; trigger<trigger_count; trigger++) {
 
 		snprintf(filename, sizeof(filename), TRIGGER_FILE_PATH, trigger);
 
 		ret = sysfs_read_str(filename, buf, sizeof(buf));
 
-		if (ret < 0)
-			break;
+		if (ret < 0) {
+			if (free_trigger == -1)
+				free_trigger = trigger;
+			continue;
+		}
 
 		/* Record initial and any-motion triggers names */
 		update_sensor_matching_trigger_name(buf, updated, trigger);
 	}
 
+	/* New triggers are given the lowest available numbers */
+	trigger = free_trigger == -1 ? trigger_count : free_trigger;
 
 	/* If we don't have any other trigger exposed and quirk hrtimer is set setup the hrtimer name here  - and create it also */
-	for (s=0; s<sensor_count && trigger<MAX_TRIGGERS; s++) {
+	for (s=0; s<sensor_count; s++) {
 		if ((sensor[s].quirks & QUIRK_HRTIMER) && !updated[s]) {
 			create_hrtimer_trigger(s, trigger);
-			trigger++;
+
+			do {
+				trigger++;
+				snprintf(filename, sizeof(filename), TRIGGER_FILE_PATH, trigger);
+			} while (trigger < trigger_count && access(filename, F_OK) == 0);
 		}
 	}
 
+	free(updated);
+
 	/*
 	 * Certain drivers expose only motion triggers even though they should be continous. For these, use the default trigger name as the motion
 	 * trigger. The code generating intermediate events is dependent on motion_trigger_name being set to a non empty string.
@@ -1037,18 +1191,22 @@ static void swap_sensors (int s1, int s2)
 {
 	struct sensor_t	temp_sensor_desc;
 	sensor_info_t	temp_sensor;
+	sensor_state_t	temp_state;
 
 	/* S1 -> temp */
 	memcpy(&temp_sensor, &sensor[s1], sizeof(sensor_info_t));
 	memcpy(&temp_sensor_desc, &sensor_desc[s1], sizeof(struct sensor_t));
+	memcpy(&temp_state, &sensor_state[s1], sizeof(sensor_state_t));
 
 	/* S2 -> S1 */
 	memcpy(&sensor[s1], &sensor[s2], sizeof(sensor_info_t));
 	memcpy(&sensor_desc[s1], &sensor_desc[s2], sizeof(struct sensor_t));
+	memcpy(&sensor_state[s1], &sensor_state[s2], sizeof(sensor_state_t));
 
 	/* temp -> S2 */
 	memcpy(&sensor[s2], &temp_sensor, sizeof(sensor_info_t));
 	memcpy(&sensor_desc[s2], &temp_sensor_desc,  sizeof(struct sensor_t));
+	memcpy(&sensor_state[s2], &temp_state, sizeof(sensor_state_t));
 
 	/* Fix-up sensor id mapping, which is stale */
 	sensor_desc[s1].handle	= s1;
@@ -1080,7 +1238,284 @@ static void reorder_sensors (void)
 }
 
 
-void enumerate_sensors (void)
+static uint64_t hash_string (uint64_t hash, const char* str)
+{
+	/* FNV-1a, including the terminating zero so that "ab" + "c" and "a" + "bc" differ */
+	do {
+		hash ^= (unsigned char) *str;
+		hash *= 0x100000001b3ULL;
+	} while (*str++);
+
+	return hash;
+}
+
+
+static uint64_t get_enumeration_fingerprint (void)
+{
+	/*
+	 * Characterize the environment our enumeration results depend on: kernel, system build (which determines the ro.iio properties we
+	 * honor), and the names of the iio devices and triggers that are present.
+	 */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	struct utsname uts;
+	char prop_val[PROP_VALUE_MAX];
+	char sysfs_path[PATH_MAX];
+	char buf[MAX_NAME_SIZE];
+	int dev_num;
+	int trigger;
+	int trigger_count;
+
+	if (!uname(&uts)) {
+		hash = hash_string(hash, uts.release);
+		hash = hash_string(hash, uts.version);
+	}
+
+	property_get("ro.build.fingerprint", prop_val, "");
+	hash = hash_string(hash, prop_val);
+
+	for (dev_num=0; dev_num<device_count; dev_num++) {
+		sprintf(sysfs_path, NAME_PATH, dev_num);
+
+		if (sysfs_read_str(sysfs_path, buf, sizeof(buf)) < 0)
+			buf[0] = '\0';
+
+		hash = hash_string(hash, buf);
+	}
+
+	trigger_count = get_iio_trigger_count();
+
+	for (trigger=0; trigger<trigger_count; trigger++) {
+		sprintf(sysfs_path, TRIGGER_FILE_PATH, trigger);
+
+		if (sysfs_read_str(sysfs_path, buf, sizeof(buf)) < 0)
+			buf[0] = '\0';
+
+		hash = hash_string(hash, buf);
+	}
+
+	return hash;
+}
+
+
+static void save_enumeration_snapshot (uint64_t fingerprint)
+{
+	snapshot_header_t header;
+	sensor_info_t info;
+	struct sensor_t desc;
+	FILE* snapshot_file;
+	int ok;
+	int s;
+	int c;
+
+	snapshot_file = fopen(ENUMERATION_SNAPSHOT_PATH ".tmp", "w");
+
+	if (snapshot_file == NULL) {
+		ALOGW("Could not create enumeration snapshot: %s\n", strerror(errno));
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.version		= ENUMERATION_SNAPSHOT_VERSION;
+	header.info_size	= sizeof(sensor_info_t);
+	header.desc_size	= sizeof(struct sensor_t);
+	header.catalog_size	= catalog_size;
+	header.fingerprint	= fingerprint;
+	header.sensor_count	= sensor_count;
+
+	ok = fwrite(&header, sizeof(header), 1, snapshot_file) == 1;
+
+	/* Pointers are meaningless across process instances ; they are cleared here and rebuilt on load */
+	for (s=0; s<sensor_count && ok; s++) {
+		info = sensor[s];
+		info.cal_data		= NULL;
+		info.filter		= NULL;
+		info.avail_freqs	= NULL;
+		memset(&info.ops, 0, sizeof(info.ops));
+
+		for (c=0; c<MAX_CHANNELS; c++)
+			info.channel[c].decode = NULL;
+
+		ok = fwrite(&info, sizeof(info), 1, snapshot_file) == 1;
+	}
+
+	for (s=0; s<sensor_count && ok; s++) {
+		desc = sensor_desc[s];
+		desc.name		= NULL;
+		desc.vendor		= NULL;
+		desc.stringType		= NULL;
+		desc.requiredPermission	= NULL;
+
+		ok = fwrite(&desc, sizeof(desc), 1, snapshot_file) == 1;
+	}
+
+	for (s=0; s<sensor_count && ok; s++)
+		if (sensor[s].avail_freqs_count)
+			ok = fwrite(sensor[s].avail_freqs, sizeof(float), sensor[s].avail_freqs_count, snapshot_file) ==
+				(size_t) sensor[s].avail_freqs_count;
+
+	if (fclose(snapshot_file))
+		ok = 0;
+
+	if (!ok || rename(ENUMERATION_SNAPSHOT_PATH ".tmp", ENUMERATION_SNAPSHOT_PATH)) {
+		ALOGW("Could not store enumeration snapshot\n");
+		unlink(ENUMERATION_SNAPSHOT_PATH ".tmp");
+	}
+}
+
+
+static void restore_sensor (int s)
+{
+	/* Rebuild the pointers we did not save, and repeat the side effects of add_sensor that do not persist across reboots */
+
+	sensor_desc[s].name		= sensor_get_name(s);
+	sensor_desc[s].vendor		= sensor_get_vendor(s);
+	sensor_desc[s].stringType	= sensor_get_string_type(s);
+	sensor_desc[s].requiredPermission = "";
+
+	if (sensor[s].is_virtual) {
+		select_transform(s);
+		return;
+	}
+
+	write_sensor_settings(s);
+	allocate_calibration_data(s);
+	select_transform(s);
+
+	if (sensor[s].hrtimer_trigger_name[0] && create_hrtimer_dir(s))
+		ALOGW("Could not recreate hrtimer trigger for sensor %d\n", s);
+}
+
+
+static int snapshot_sensor_valid (int s, int count)
+{
+	/* Check that the indices and counts restored for a sensor can safely be used to address our tables */
+
+	int i;
+
+	if (sensor[s].catalog_index < 0 || (unsigned int) sensor[s].catalog_index >= catalog_size	||
+	    (!sensor[s].is_virtual && (sensor[s].dev_num < 0 || sensor[s].dev_num >= device_count))	||
+	    sensor[s].num_channels < 0 || sensor[s].num_channels > MAX_CHANNELS				||
+	    sensor[s].report_copy_count < 0 || sensor[s].report_copy_count > MAX_CHANNELS		||
+	    sensor[s].base_count < 0 || sensor[s].base_count > MAX_SENSOR_BASES				||
+	    sensor[s].dependent_count < 0 || sensor[s].dependent_count > MAX_SENSOR_DEPENDENTS)
+		return 0;
+
+	for (i=0; i<sensor[s].base_count; i++)
+		if (sensor[s].base[i] < 0 || sensor[s].base[i] >= count)
+			return 0;
+
+	for (i=0; i<sensor[s].dependent_count; i++)
+		if (sensor[s].dependent[i] < 0 || sensor[s].dependent[i] >= count)
+			return 0;
+
+	if (sensor[s].quirks & QUIRK_FIELD_ORDERING)
+		for (i=0; i<MAX_CHANNELS; i++)
+			if (sensor[s].order[i] >= MAX_CHANNELS)
+				return 0;
+
+	return 1;
+}
+
+
+static int load_enumeration_snapshot (uint64_t fingerprint)
+{
+	snapshot_header_t header;
+	FILE* snapshot_file;
+	int dev_num;
+	int count;
+	int s;
+
+	snapshot_file = fopen(ENUMERATION_SNAPSHOT_PATH, "r");
+
+	if (snapshot_file == NULL)
+		return -1;
+
+	if (fread(&header, sizeof(header), 1, snapshot_file) != 1		||
+	    header.version	!= ENUMERATION_SNAPSHOT_VERSION			||
+	    header.info_size	!= sizeof(sensor_info_t)			||
+	    header.desc_size	!= sizeof(struct sensor_t)			||
+	    header.catalog_size	!= catalog_size					||
+	    header.fingerprint	!= fingerprint					||
+	    header.sensor_count	< 0 || reserve_sensor_entries(header.sensor_count)) {
+		ALOGI("Enumeration snapshot is stale, enumerating\n");
+		fclose(snapshot_file);
+		return -1;
+	}
+
+	count = header.sensor_count;
+
+	if (fread(sensor, sizeof(sensor_info_t), count, snapshot_file) != (size_t) count ||
+	    fread(sensor_desc, sizeof(struct sensor_t), count, snapshot_file) != (size_t) count)
+		goto invalid;
+
+	for (s=0; s<count; s++)
+		sensor[s].avail_freqs = NULL;
+
+	/* The fingerprint does not protect against a truncated or damaged file: range check whatever we are going to use as an index */
+	for (s=0; s<count; s++)
+		if (!snapshot_sensor_valid(s, count))
+			goto invalid;
+
+	for (s=0; s<count; s++)
+		if (sensor[s].avail_freqs_count) {
+			if (sensor[s].avail_freqs_count < 0 || sensor[s].avail_freqs_count > MAX_SNAPSHOT_FREQS)
+				goto invalid;
+
+			sensor[s].avail_freqs = (float*) calloc(sensor[s].avail_freqs_count, sizeof(float));
+
+			if (!sensor[s].avail_freqs ||
+			    fread(sensor[s].avail_freqs, sizeof(float), sensor[s].avail_freqs_count, snapshot_file) !=
+					(size_t) sensor[s].avail_freqs_count)
+				goto invalid;
+		}
+
+	fclose(snapshot_file);
+
+	sensor_count = count;
+
+	for (s=0; s<sensor_count; s++)
+		restore_sensor(s);
+
+	/* Enable channels and program scan layouts again on devices used through triggers */
+	for (dev_num=0; dev_num<device_count; dev_num++)
+		for (s=0; s<sensor_count; s++)
+			if (!sensor[s].is_virtual && sensor[s].dev_num == dev_num && sensor[s].mode == MODE_TRIGGER) {
+				build_sensor_report_maps(dev_num);
+				break;
+			}
+
+	return 0;
+
+invalid:
+	ALOGW("Enumeration snapshot is corrupted, enumerating\n");
+
+	for (s=0; s<count; s++)
+		if (sensor[s].avail_freqs)
+			free(sensor[s].avail_freqs);
+
+	memset(sensor, 0, sensor_capacity * sizeof(sensor_info_t));
+	memset(sensor_desc, 0, sensor_capacity * sizeof(struct sensor_t));
+
+	fclose(snapshot_file);
+	return -1;
+}
+
+
+static void advertise_direct_report (void)
+{
+	/*
+	 * Direct report capabilities depend on ro.iio.hal.direct_report, which is not part of the enumeration fingerprint, so they are applied
+	 * to the sensor list after it's been built or restored, and are not saved in snapshots.
+	 */
+
+	int s;
+
+	for (s=0; s<sensor_count; s++)
+		sensor_desc[s].flags |= direct_report_get_flags(s);
+}
+
+
+int enumerate_sensors (void)
 {
 	/*
 	 * Discover supported sensors and allocate control structures for them. Multiple sensors can potentially rely on a single iio device (each
@@ -1094,8 +1529,31 @@ void enumerate_sensors (void)
 	unsigned int i;
 	int trig_found;
 	int s;
+	int use_snapshot = 0;
+	uint64_t fingerprint = 0;
+
+	/*
+	 * Optionally skip the discovery process altogether, by reloading the results of a previous enumeration performed with the same kernel,
+	 * build and set of iio devices.
+	 */
+	if (!hal_get_prop("enum_snapshot", &use_snapshot) && use_snapshot) {
+		fingerprint = get_enumeration_fingerprint();
+
+		if (!load_enumeration_snapshot(fingerprint)) {
+			ALOGI("Restored %d sensors from enumeration snapshot\n", sensor_count);
 
-	for (dev_num=0; dev_num<MAX_DEVICES; dev_num++) {
+			for (s=0; s<sensor_count; s++)
+				ALOGI("S%d: %s\n", s, sensor[s].friendly_name);
+
+			advertise_direct_report();
+			return 0;
+		}
+	}
+
+	/* A snapshot too large to restore does not prevent a regular enumeration */
+	sensor_alloc_failed = 0;
+
+	for (dev_num=0; dev_num<device_count; dev_num++) {
 		trig_found = 0;
 
 		discover_sensors(dev_num, BASE_PATH, poll_sensors, check_poll_sensors);
@@ -1137,15 +1595,35 @@ void enumerate_sensors (void)
 
 	virtual_sensors_check();
 
+	refresh_descriptor_strings();
+
 	for (s=0; s<sensor_count; s++) {
 		ALOGI("S%d: %s\n", s, sensor[s].friendly_name);
 	}
+
+	if (use_snapshot)
+		save_enumeration_snapshot(fingerprint);
+
+	/* Rate limits are settled at this point, including those of hrtimer driven sensors */
+	advertise_direct_report();
+
+	/* Sensors we had no room for were skipped ; report that rather than silently exposing a partial list */
+	if (sensor_alloc_failed) {
+		sensor_alloc_failed = 0;
+		return -ENOMEM;
+	}
+
+	return 0;
 }
 
 
 void delete_enumeration_data (void)
 {
 	int i;
+
+	/* Make sure no background calibration work is still referencing calibration data */
+	compass_cal_shutdown();
+
 	for (i = 0; i < sensor_count; i++)
 		if (sensor[i].cal_data) {
 			free(sensor[i].cal_data);
@@ -1153,8 +1631,20 @@ void delete_enumeration_data (void)
 			sensor[i].cal_level = 0;
 		}
 
-	/* Reset sensor count */
+	/* Reset sensor count, and release the tables as the next enumeration may find a different set of sensors */
 	sensor_count = 0;
+
+	free(sensor_desc);
+	free(sensor);
+	free(sensor_state);
+
+	sensor_desc	= NULL;
+	sensor		= NULL;
+	sensor_state	= NULL;
+	sensor_capacity	= 0;
+
+	/* Devices may come and go until we enumerate again */
+	sysfs_attr_cache_invalidate(-1);
 }
 
 
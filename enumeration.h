@@ -22,7 +22,7 @@
 int	get_sensors_list	(struct sensors_module_t* module,
 				 struct sensor_t const** list);
 
-void	enumerate_sensors	(void);
+int	enumerate_sensors	(void);
 void	delete_enumeration_data (void);
 
 /*
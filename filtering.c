@@ -21,13 +21,17 @@
 #include "common.h"
 #include "filtering.h"
 #include "description.h"
+#include "median-window.h"
+
+#define MAX_FILTER_WINDOW	1024	/* Largest filter window, in samples	*/
+#define ARENA_ALIGN(size)	(((size) + 7) & ~((size_t) 7))
 
 typedef struct
 {
-	float* buff;
-	unsigned int idx;
-	unsigned int count;
-	unsigned int sample_size;
+	float* buff;				/* Storage backing the windows below	*/
+	unsigned int sample_size;		/* Window size, in samples		*/
+	unsigned int num_fields;
+	median_window_t window[MAX_CHANNELS];	/* One sliding window per field		*/
 }
 filter_median_t;
 
@@ -37,7 +41,7 @@ typedef struct
 	int max_samples;	/* Maximum averaging window size	      */
 	int num_fields;		/* Number of fields per sample (usually 3)    */
 	float *history;		/* Working buffer containing recorded samples */
-	float *history_sum;	/* The current sum of the history elements    */
+	float history_sum[MAX_CHANNELS]; /* The current sum of the history elements */
 	int history_size;	/* Number of recorded samples		      */
 	int history_entries;	/* How many of these are initialized	      */
 	int history_index;	/* Index of sample to evict next time	      */
@@ -45,87 +49,229 @@ typedef struct
 filter_average_t;
 
 
-static unsigned int partition (float* list, unsigned int left, unsigned int right, unsigned int pivot_index)
+typedef struct
+{
+	int max_samples;	/* Maximum equivalent window size		*/
+	int num_fields;		/* Number of fields per sample (usually 3)	*/
+	int window;		/* Equivalent window alpha was computed for	*/
+	float alpha;		/* Weight of the incoming sample		*/
+	int initialized;	/* Set once state holds a sample		*/
+	float state[MAX_CHANNELS]; /* Current filter output, per field		*/
+}
+filter_exponential_t;
+
+
+/*
+ * Filter state lives in a per sensor arena slot, sized for the filter configured for that sensor and allocated once along with the other per
+ * sensor control tables, so that enabling a filtered sensor or changing its rate never touches the heap. A sensor has at most one filter at a
+ * time, so its slot is simply carved again from the start whenever the filter gets set up.
+ */
+static char*	filter_arena;
+static size_t*	slot_offset;	/* Start of each sensor slot in the arena	*/
+static size_t*	slot_size;	/* Bytes available in each sensor slot		*/
+static int	arena_count;	/* Sensor slots in the arena			*/
+
+
+static void setup_sample_history (int s);
+static void release_sample_history (int s);
+
+
+static int get_filter_config (int s, unsigned int* num_fields, unsigned int* window_size, int verbose)
 {
-	unsigned int i;
-	unsigned int store_index = left;
-	float aux;
-	float pivot_value = list[pivot_index];
-
-	/* Swap list[pivotIndex] and list[right] */
-	aux = list[pivot_index];
-	list[pivot_index] = list[right];
-	list[right] = aux;
-
-	for (i = left; i < right; i++)
-	{
-		if (list[i] < pivot_value)
-		{
-			/* Swap list[store_index] and list[i] */
-			aux = list[store_index];
-			list[store_index] = list[i];
-			list[i] = aux;
-			store_index++;
+	/* Determine which filter applies to sensor s, for how many fields, and its window size ; returns a FILTER_TYPE_ value */
+
+	char filter_buf[MAX_NAME_SIZE];
+	char* cursor;
+	int filter_type = FILTER_TYPE_NONE;
+	int window = 0;
+
+	/* Restrict filtering to a few sensor types for now */
+	switch (sensor[s].type) {
+			case SENSOR_TYPE_ACCELEROMETER:
+			case SENSOR_TYPE_GYROSCOPE:
+			case SENSOR_TYPE_MAGNETIC_FIELD:
+				*num_fields = 3 /* x,y,z */;
+				break;
+
+			default:
+				return FILTER_TYPE_NONE;	/* No filtering */
+	}
+
+	/* If noisy, start with default filter for sensor type */
+	if (sensor[s].quirks & QUIRK_NOISY)
+		switch (sensor[s].type) {
+			case SENSOR_TYPE_GYROSCOPE:
+				filter_type = FILTER_TYPE_MEDIAN;
+				break;
+
+			case SENSOR_TYPE_MAGNETIC_FIELD:
+				filter_type = FILTER_TYPE_MOVING_AVERAGE;
+				break;
+		}
+
+	/* Use whatever was specified if there's an explicit configuration choice for this sensor */
+
+	filter_buf[0] = '\0';
+	sensor_get_st_prop(s, "filter", filter_buf);
+
+	cursor = strstr(filter_buf, "median");
+	if (cursor)
+		filter_type = FILTER_TYPE_MEDIAN;
+	else {
+		cursor = strstr(filter_buf, "average");
+		if (cursor)
+			filter_type = FILTER_TYPE_MOVING_AVERAGE;
+		else {
+			cursor = strstr(filter_buf, "exponential");
+			if (cursor)
+				filter_type = FILTER_TYPE_EXPONENTIAL;
 		}
 	}
 
-	/* Swap list[right] and list[store_index] */
-	aux = list[right];
-	list[right] = list[store_index];
-	list[store_index] = aux;
-	return store_index;
+	/* Check if an integer is part of the string, and use it as window size */
+	if (cursor) {
+		while (*cursor && !isdigit(*cursor))
+			cursor++;
+
+		if (*cursor)
+			window = atoi(cursor);
+	}
+
+	if (!window)
+		window = filter_type == FILTER_TYPE_MEDIAN ? 5 : 20;
+
+	if (window > MAX_FILTER_WINDOW) {
+		if (verbose)
+			ALOGW("Restricting %s filter window to %d samples\n", sensor[s].friendly_name, MAX_FILTER_WINDOW);
+		window = MAX_FILTER_WINDOW;
+	}
+
+	*window_size = window;
+	return filter_type;
 }
 
 
-static float median (float* queue, unsigned int size)
+static size_t get_filter_state_size (int filter_type, unsigned int num_fields, unsigned int window_size)
 {
-	/* http://en.wikipedia.org/wiki/Quickselect */
+	/* Bytes of arena needed for a filter: its descriptor, followed by its sample storage */
 
-	unsigned int left = 0;
-	unsigned int right = size - 1;
-	unsigned int pivot_index;
-	unsigned int median_index = (right / 2);
-	float temp[size];
+	switch (filter_type) {
+		case FILTER_TYPE_MEDIAN:
+			return ARENA_ALIGN(sizeof(filter_median_t)) + 2 * sizeof(float) * num_fields * window_size;
 
-	memcpy(temp, queue, size * sizeof(float));
+		case FILTER_TYPE_MOVING_AVERAGE:
+			return ARENA_ALIGN(sizeof(filter_average_t)) + sizeof(float) * num_fields * window_size;
 
-	/* If the list has only one element return it */
-	if (left == right)
-		return temp[left];
+		case FILTER_TYPE_EXPONENTIAL:
+			return sizeof(filter_exponential_t);
+	}
 
-	while (left < right) {
-		pivot_index = (left + right) / 2;
-		pivot_index = partition(temp, left, right, pivot_index);
-		if (pivot_index == median_index)
-			return temp[median_index];
-		else if (pivot_index > median_index)
-			right = pivot_index - 1;
-		else
-			left = pivot_index + 1;
+	return 0;
+}
+
+
+int allocate_filter_arenas (int count)
+{
+	/* Size each sensor slot for its configured filter, and allocate them all at once ; call after enumeration */
+
+	unsigned int num_fields;
+	unsigned int window_size;
+	size_t total = 0;
+	int filter_type;
+	int s;
+
+	release_filter_arenas();
+
+	slot_offset = (size_t*) calloc(count ? count : 1, sizeof(size_t));
+	slot_size = (size_t*) calloc(count ? count : 1, sizeof(size_t));
+
+	if (!slot_offset || !slot_size)
+		goto oom;
+
+	for (s=0; s<count; s++) {
+		filter_type = get_filter_config(s, &num_fields, &window_size, 1);
+
+		slot_offset[s] = total;
+		slot_size[s] = get_filter_state_size(filter_type, num_fields, window_size);
+		total += ARENA_ALIGN(slot_size[s]);
 	}
 
-	return temp[left];
+	filter_arena = (char*) calloc(1, total ? total : 1);
+
+	if (!filter_arena)
+		goto oom;
+
+	arena_count = count;
+	ALOGV("Allocated %zu bytes of filter state for %d sensors\n", total, count);
+	return 0;
+
+oom:
+	release_filter_arenas();
+	return -1;
+}
+
+
+void release_filter_arenas (void)
+{
+	free(filter_arena);
+	free(slot_offset);
+	free(slot_size);
+	filter_arena = NULL;
+	slot_offset = slot_size = NULL;
+	arena_count = 0;
+}
+
+
+static void* get_filter_state (int s, size_t size)
+{
+	/* Return the cleared arena slot of sensor s, or NULL if it can't hold size bytes */
+
+	if (s >= arena_count || size > slot_size[s])
+		return NULL;
+
+	memset(filter_arena + slot_offset[s], 0, size);
+	return filter_arena + slot_offset[s];
 }
 
 
 static void denoise_median_init (int s, unsigned int num_fields, unsigned int max_samples)
 {
-	filter_median_t* f_data = (filter_median_t*) malloc(sizeof(filter_median_t));
+	filter_median_t* f_data = (filter_median_t*) get_filter_state(s, get_filter_state_size(FILTER_TYPE_MEDIAN, num_fields, max_samples));
+	unsigned int field;
+
+	if (f_data) {
+		f_data->buff = (float*) ((char*) f_data + ARENA_ALIGN(sizeof(filter_median_t)));
+		f_data->sample_size = max_samples;
+		f_data->num_fields = num_fields;
+
+		for (field = 0; field < num_fields; field++)
+			median_window_init(&f_data->window[field], f_data->buff + 2 * max_samples * field, max_samples);
+	}
 
-	f_data->buff = (float*) calloc(max_samples, sizeof(float) * num_fields);
-	f_data->sample_size = max_samples;
-	f_data->count = 0;
-	f_data->idx = 0;
 	sensor[s].filter = f_data;
 }
 
 
 static void denoise_average_init (int s, unsigned int num_fields, unsigned int max_samples)
 {
-	filter_average_t* filter = (filter_average_t*) malloc(sizeof(filter_average_t));
+	filter_average_t* filter = (filter_average_t*) get_filter_state(s, get_filter_state_size(FILTER_TYPE_MOVING_AVERAGE, num_fields, max_samples));
+
+	if (filter) {
+		/* Size the history for the largest window we may use, so that rate changes only have to reset it */
+		filter->history = (float*) ((char*) filter + ARENA_ALIGN(sizeof(filter_average_t)));
+		filter->max_samples = max_samples;
+		filter->num_fields = num_fields;
+	}
+
+	sensor[s].filter = filter;
+}
+
+
+static void denoise_exponential_init (int s, unsigned int num_fields, unsigned int max_samples)
+{
+	filter_exponential_t* filter = (filter_exponential_t*) get_filter_state(s, sizeof(filter_exponential_t));
 
 	if (filter) {
-		memset(filter, 0, sizeof(filter_average_t));
 		filter->max_samples = max_samples;
 		filter->num_fields = num_fields;
 	}
@@ -137,18 +283,19 @@ static void denoise_average_init (int s, unsigned int num_fields, unsigned int m
 static void denoise_median_reset (sensor_info_t* info)
 {
 	filter_median_t* f_data = (filter_median_t*) info->filter;
+	unsigned int field;
 
 	if (!f_data)
 		return;
 
-	f_data->count = 0;
-	f_data->idx = 0;
+	for (field = 0; field < f_data->num_fields; field++)
+		median_window_reset(&f_data->window[field]);
 }
 
 
 static void denoise_median (sensor_info_t* info, sensors_event_t* data, unsigned int num_fields)
 {
-	unsigned int field, offset;
+	unsigned int field;
 
 	filter_median_t* f_data = (filter_median_t*) info->filter;
 	if (!f_data)
@@ -158,17 +305,8 @@ static void denoise_median (sensor_info_t* info, sensors_event_t* data, unsigned
 	if (info->event_count == 1)
 		denoise_median_reset(info);
 
-	if (f_data->count < f_data->sample_size)
-		f_data->count++;
-
-	for (field = 0; field < num_fields; field++) {
-		offset = f_data->sample_size * field;
-		f_data->buff[offset + f_data->idx] = data->data[field];
-
-		data->data[field] = median(f_data->buff + offset, f_data->count);
-	}
-
-	f_data->idx = (f_data->idx + 1) % f_data->sample_size;
+	for (field = 0; field < num_fields && field < f_data->num_fields; field++)
+		data->data[field] = median_window_update(&f_data->window[field], data->data[field]);
 }
 
 
@@ -201,22 +339,14 @@ static void denoise_average (sensor_info_t* si, sensors_event_t* data)
 	else
 		history_size = sampling_rate;
 
-	/* Reset history if we're operating on an incorrect window size */
+	/* Reset history if we're operating on an incorrect window size ; its storage is sized for max_samples already */
 	if (filter->history_size != history_size) {
 		filter->history_size = history_size;
 		filter->history_entries = 0;
 		filter->history_index = 0;
-		filter->history = (float*) realloc(filter->history, filter->history_size * filter->num_fields * sizeof(float));
-		if (filter->history) {
-			filter->history_sum = (float*) realloc(filter->history_sum, filter->num_fields * sizeof(float));
-			if (filter->history_sum)
-				memset(filter->history_sum, 0, filter->num_fields * sizeof(float));
-		}
+		memset(filter->history_sum, 0, sizeof(filter->history_sum));
 	}
 
-	if (!filter->history || !filter->history_sum)
-		return;	/* Unlikely, but still... */
-
 	/* Update initialized samples count */
 	if (filter->history_entries < filter->history_size)
 		filter->history_entries++;
@@ -241,73 +371,76 @@ static void denoise_average (sensor_info_t* si, sensors_event_t* data)
 }
 
 
-void setup_noise_filtering (int s)
+static void denoise_exponential (sensor_info_t* si, sensors_event_t* data)
 {
-	char filter_buf[MAX_NAME_SIZE];
-	int num_fields;
-	char* cursor;
-	int window_size = 0;
+	/*
+	 * Single pole low pass filter: each output moves towards the incoming sample by a fixed fraction of their difference. The fraction is
+	 * chosen so that the filter lags about as much as a moving average over one second worth of samples, or max_samples, whichever is lower,
+	 * while only keeping the previous output around.
+	 */
 
-	/* By default, don't apply filtering */
-	sensor[s].filter_type = FILTER_TYPE_NONE;
+	int f;
+	int sampling_rate = (int) si->sampling_rate;
+	int window;
+	filter_exponential_t* filter = (filter_exponential_t*) si->filter;
 
-	/* Restrict filtering to a few sensor types for now */
-	switch (sensor[s].type) {
-			case SENSOR_TYPE_ACCELEROMETER:
-			case SENSOR_TYPE_GYROSCOPE:
-			case SENSOR_TYPE_MAGNETIC_FIELD:
-				num_fields = 3 /* x,y,z */;
-				break;
+	/* Don't denoise anything if we have less than two samples per second */
+	if (sampling_rate < 2 || !filter)
+		return;
 
-			default:
-				return;	/* No filtering */
+	window = sampling_rate > filter->max_samples ? filter->max_samples : sampling_rate;
+
+	if (filter->window != window) {
+		filter->window = window;
+		filter->alpha = 2.0 / (window + 1);
 	}
 
-	/* If noisy, start with default filter for sensor type */
-	if (sensor[s].quirks & QUIRK_NOISY)
-		switch (sensor[s].type) {
-			case SENSOR_TYPE_GYROSCOPE:
-				sensor[s].filter_type = FILTER_TYPE_MEDIAN;
-				break;
+	/* Start over from the first sample after the sensor got enabled */
+	if (si->event_count == 1 || !filter->initialized) {
+		for (f = 0; f < filter->num_fields; f++)
+			filter->state[f] = data->data[f];
 
-			case SENSOR_TYPE_MAGNETIC_FIELD:
-				sensor[s].filter_type = FILTER_TYPE_MOVING_AVERAGE;
-				break;
-		}
+		filter->initialized = 1;
+		return;
+	}
 
-	/* Use whatever was specified if there's an explicit configuration choice for this sensor */
+	for (f = 0; f < filter->num_fields; f++) {
+		filter->state[f] += filter->alpha * (data->data[f] - filter->state[f]);
+		data->data[f] = filter->state[f];
+	}
+}
 
-	filter_buf[0] = '\0';
-	sensor_get_st_prop(s, "filter", filter_buf);
 
-	cursor = strstr(filter_buf, "median");
-	if (cursor)
-		sensor[s].filter_type = FILTER_TYPE_MEDIAN;
-	else {
-		cursor = strstr(filter_buf, "average");
-		if (cursor)
-			sensor[s].filter_type = FILTER_TYPE_MOVING_AVERAGE;
-	}
+void setup_noise_filtering (int s)
+{
+	unsigned int num_fields;
+	unsigned int window_size;
 
-	/* Check if an integer is part of the string, and use it as window size */
-	if (cursor) {
-		while (*cursor && !isdigit(*cursor))
-			cursor++;
+	setup_sample_history(s);
 
-		if (*cursor)
-			window_size = atoi(cursor);
-	}
+	sensor[s].filter = NULL;
+	sensor[s].filter_type = get_filter_config(s, &num_fields, &window_size, 0);
 
 	switch (sensor[s].filter_type) {
 
 		case FILTER_TYPE_MEDIAN:
-			denoise_median_init(s, num_fields, window_size ? window_size : 5);
+			denoise_median_init(s, num_fields, window_size);
 			break;
 
 		case FILTER_TYPE_MOVING_AVERAGE:
-			denoise_average_init(s, num_fields, window_size ? window_size: 20);
+			denoise_average_init(s, num_fields, window_size);
+			break;
+
+		case FILTER_TYPE_EXPONENTIAL:
+			denoise_exponential_init(s, num_fields, window_size);
 			break;
 	}
+
+	/* The arena slot was sized for the configuration we found after enumeration ; don't filter if it changed since */
+	if (sensor[s].filter_type != FILTER_TYPE_NONE && !sensor[s].filter) {
+		ALOGE("No room for %s filter state, disabling filtering\n", sensor[s].friendly_name);
+		sensor[s].filter_type = FILTER_TYPE_NONE;
+	}
 }
 
 
@@ -322,86 +455,232 @@ void denoise (int s, sensors_event_t* data)
 		case FILTER_TYPE_MOVING_AVERAGE:
 			denoise_average(&sensor[s], data);
 			break;
+
+		case FILTER_TYPE_EXPONENTIAL:
+			denoise_exponential(&sensor[s], data);
+			break;
 	}
 }
 
 
 void release_noise_filtering_data (int s)
 {
-	void *buf;
-
-	if (!sensor[s].filter)
-		return;
-
-	switch (sensor[s].filter_type) {
-
-		case FILTER_TYPE_MEDIAN:
-			buf = ((filter_median_t*) sensor[s].filter)->buff;
-			if (buf)
-				free(buf);
-			break;
-
-		case FILTER_TYPE_MOVING_AVERAGE:
-			buf = ((filter_average_t*) sensor[s].filter)->history;
-			if (buf)
-				free(buf);
-
-			buf = ((filter_average_t*) sensor[s].filter)->history_sum;
-			if (buf)
-				free(buf);
-			break;
-	}
+	release_sample_history(s);
 
-	free(sensor[s].filter);
+	/* Filter state belongs to the sensor's arena slot, and gets carved again on next setup */
 	sensor[s].filter = NULL;
 }
 
 
-#define GLOBAL_HISTORY_SIZE 100
+#define HISTORY_SPAN_MS		1000	/* Time covered by the history of a sensor running at its maximum rate	*/
+#define HISTORY_MIN_SIZE	16
+#define HISTORY_MAX_SIZE	1024
 
 typedef struct
 {
-	int sensor;
-	int motion_trigger;
-	sensors_event_t data;
+	history_sample_t* cell;	/* Ring of recorded samples, by increasing timestamp	*/
+	int size;		/* Ring capacity					*/
+	int head;		/* Index of oldest sample				*/
+	int count;		/* How many cells are initialized			*/
+	int wanted;		/* Set if the sensor opted in for sample recording	*/
 }
-recorded_sample_t;
+sample_history_t;
 
 /*
- * This is a circular buffer holding the last GLOBAL_HISTORY_SIZE events, covering the entire sensor collection. It is intended as a way to correlate
- * data coming from active sensors, no matter the sensor type, over a recent window of time. The array is not sorted ; we simply evict the oldest cell
- * (by insertion time) and replace its contents. Timestamps don't necessarily grow monotonically as they tell the data acquisition type, and that there
- * can be a delay between acquisition and insertion into this table.
+ * Sensors can opt in for a history of their recent samples through their history property, e.g. ro.iio.accel.history = 1. Each of them has
+ * its own history, so that data from sensors of different types can be correlated over a recent window of
+ * time without fast sensors evicting the samples of slower ones. Samples are kept in timestamp order: timestamps don't necessarily grow
+ * monotonically as they tell the data acquisition time, and there can be a delay between acquisition and insertion, so late samples get
+ * moved back into place when recorded.
  */
+static sample_history_t* sample_history;
+static int history_count;	/* Allocated sample_history entries ; grown as sensors record samples */
+
+
+#define HISTORY_CELL(h, i)	(&(h)->cell[((h)->head + (i)) % (h)->size])
+
+
+static sample_history_t* get_history (int s)
+{
+	/* Return the sample history of sensor s, extending the table if needed ; NULL if we ran out of memory */
+
+	sample_history_t* grown;
+
+	if (s >= history_count) {
+		grown = (sample_history_t*) realloc(sample_history, sensor_count * sizeof(sample_history_t));
+
+		if (!grown)
+			return NULL;
+
+		memset(grown + history_count, 0, (sensor_count - history_count) * sizeof(sample_history_t));
+		sample_history = grown;
+		history_count = sensor_count;
+	}
+
+	return &sample_history[s];
+}
+
+
+static int get_history_size (int s)
+{
+	float rate = sensor[s].max_supported_rate ? sensor[s].max_supported_rate : sensor[s].sampling_rate;
+	int size = (int) (rate * HISTORY_SPAN_MS / 1000);
+
+	if (size < HISTORY_MIN_SIZE)
+		return HISTORY_MIN_SIZE;
 
-static recorded_sample_t global_history[GLOBAL_HISTORY_SIZE];
+	if (size > HISTORY_MAX_SIZE)
+		return HISTORY_MAX_SIZE;
 
-static int initialized_entries;	/* How many of these are initialized	      */
-static int insertion_index;	/* Index of sample to evict next time	      */
+	return size;
+}
 
 
 void record_sample (int s, const sensors_event_t* event)
 {
-	recorded_sample_t *cell;
+	sample_history_t* h;
+	history_sample_t* cell;
 	int i;
 
-	/* Don't record duplicate samples, as they are not useful for filters */
-	if (sensor[s].report_pending == DATA_DUPLICATE)
+	/* Only record samples for sensors that asked for it ; don't record duplicate samples, as they are not useful for filters */
+	if (s >= history_count || !sample_history[s].wanted || sensor_state[s].report_pending == DATA_DUPLICATE)
 		return;
 
-	if (initialized_entries == GLOBAL_HISTORY_SIZE) {
-		i = insertion_index;
-		insertion_index = (insertion_index+1) % GLOBAL_HISTORY_SIZE;
-	} else {
-		i = initialized_entries;
-		initialized_entries++;
+	h = &sample_history[s];
+
+	if (!h->cell) {
+		h->size = get_history_size(s);
+		h->cell = (history_sample_t*) malloc(h->size * sizeof(history_sample_t));
+		h->head = 0;
+		h->count = 0;
+
+		if (!h->cell)
+			return;
+	}
+
+	/* Evict the oldest sample if we're full */
+	if (h->count == h->size) {
+		h->head = (h->head + 1) % h->size;
+		h->count--;
 	}
 
-	cell = &global_history[i];
+	/* Shift later samples up, if any, so that we remain sorted */
+	for (i = h->count; i > 0 && HISTORY_CELL(h, i - 1)->ts > event->timestamp; i--)
+		*HISTORY_CELL(h, i) = *HISTORY_CELL(h, i - 1);
+
+	cell = HISTORY_CELL(h, i);
 
-	cell->sensor = s;
+	cell->ts = event->timestamp;
+	cell->data[0] = event->data[0];
+	cell->data[1] = event->data[1];
+	cell->data[2] = event->data[2];
+	cell->motion_trigger = (sensor_state[s].selected_trigger == sensor[s].motion_trigger_name);
+
+	h->count++;
+}
+
+
+static int find_first_sample (sample_history_t* h, int64_t ts)
+{
+	/* Return the index of the first recorded sample with a timestamp not lower than ts, or count if there is none */
+
+	int left = 0;
+	int right = h->count;
+	int mid;
+
+	while (left < right) {
+		mid = left + (right - left) / 2;
+
+		if (HISTORY_CELL(h, mid)->ts < ts)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+
+	return left;
+}
+
+
+int get_samples_in_range (int s, int64_t t0, int64_t t1, history_sample_t* samples, int max_samples)
+{
+	/* Copy up to max_samples recorded samples whose timestamps are within [t0, t1], oldest first ; returns how many were copied */
+
+	sample_history_t* h;
+	int i;
+	int n = 0;
+
+	if (s >= history_count)
+		return 0;
+
+	h = &sample_history[s];
+
+	for (i = find_first_sample(h, t0); i < h->count && n < max_samples && HISTORY_CELL(h, i)->ts <= t1; i++)
+		samples[n++] = *HISTORY_CELL(h, i);
+
+	return n;
+}
+
+
+int get_nearest_sample (int s, int64_t ts, history_sample_t* sample)
+{
+	/* Retrieve the recorded sample which is the closest in time to ts ; returns -1 if we don't have any */
+
+	sample_history_t* h;
+	int i;
+
+	if (s >= history_count || !sample_history[s].count)
+		return -1;
+
+	h = &sample_history[s];
+
+	i = find_first_sample(h, ts);
+
+	if (i == h->count || (i > 0 && ts - HISTORY_CELL(h, i - 1)->ts <= HISTORY_CELL(h, i)->ts - ts))
+		i--;
+
+	*sample = *HISTORY_CELL(h, i);
+	return 0;
+}
+
+
+static void setup_sample_history (int s)
+{
+	/* Check whether samples from that sensor should be recorded while it's enabled */
+
+	sample_history_t* h;
+	int wanted = 0;
+
+	if (sensor_get_prop(s, "history", &wanted) || !wanted) {
+		if (s < history_count)
+			sample_history[s].wanted = 0;
+		return;
+	}
+
+	h = get_history(s);
+
+	if (h)
+		h->wanted = 1;
+}
+
+
+static void release_sample_history (int s)
+{
+	if (s >= history_count)
+		return;
+
+	free(sample_history[s].cell);
+	memset(&sample_history[s], 0, sizeof(sample_history_t));
+}
+
+
+void release_sample_histories (void)
+{
+	int s;
 
-	cell->motion_trigger = (sensor[s].selected_trigger == sensor[s].motion_trigger_name);
+	for (s=0; s<history_count; s++)
+		free(sample_history[s].cell);
 
-	memcpy(&cell->data, event, sizeof(sensors_event_t));
+	free(sample_history);
+	sample_history = NULL;
+	history_count = 0;
 }
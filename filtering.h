@@ -17,9 +17,23 @@
 #ifndef FILTERING_H
 #define FILTERING_H
 
+/* Compact record of a past sample, as kept in per sensor histories */
+typedef struct
+{
+	int64_t ts;		/* Sample timestamp						*/
+	float data[3];		/* First fields of the sample, e.g. x, y, z			*/
+	int motion_trigger;	/* Set if the sample was delivered while using a motion trigger	*/
+}
+history_sample_t;
+
+int  allocate_filter_arenas		(int count);
+void release_filter_arenas		(void);
 void setup_noise_filtering		(int s);
 void release_noise_filtering_data	(int s);
 void denoise				(int s, sensors_event_t* event);
 void record_sample			(int s, const sensors_event_t* data);
+int  get_samples_in_range		(int s, int64_t t0, int64_t t1, history_sample_t* samples, int max_samples);
+int  get_nearest_sample			(int s, int64_t ts, history_sample_t* sample);
+void release_sample_histories		(void);
 
 #endif
@@ -21,6 +21,7 @@
 #include <hardware/sensors.h>
 #include "common.h"
 #include "calibration.h"
+#include "filtering.h"
 
 
 /* Gyro defines */
@@ -28,11 +29,14 @@
 #define GYRO_DS_SIZE 100
 #define GYRO_CALIBRATION_PATH "/data/gyro.conf"
 #define GYRO_CAL_VERSION 1.0
+#define GYRO_ACCEL_MAX_ERR 0.5	/* Maximum accelerometer variation while the device is deemed still, in m/s² */
+#define GYRO_ACCEL_SAMPLES 64	/* Accelerometer samples we fetch at a time when cross checking stillness */
 
 
 static void reset (gyro_cal_t* cal_data)
 {
 	cal_data->count = 0;
+	cal_data->start_ts = 0;
 
 	cal_data->bias_x = cal_data->bias_y = cal_data->bias_z = 0;
 
@@ -95,7 +99,63 @@ void gyro_store_data (int s)
 }
 
 
-static int gyro_collect (float x, float y, float z, gyro_cal_t* cal_data)
+static int accel_confirms_stillness (int64_t t0, int64_t t1)
+{
+	/*
+	 * A slow steady rotation can look like a stable gyroscope bias. If the accelerometer records its samples (ro.iio.accel.history = 1),
+	 * check that the gravity vector did not move while we were collecting gyroscope samples. The whole window is covered, a batch of
+	 * samples at a time. If the accelerometer is too slow to have several samples in there, compare the samples closest to both ends.
+	 */
+
+	history_sample_t samples[GYRO_ACCEL_SAMPLES];
+	history_sample_t first, last;
+	float min[3], max[3];
+	int64_t from = t0;
+	int s, i, j, n;
+	int seen = 0;
+
+	for (s=0; s<sensor_count; s++)
+		if (sensor[s].type == SENSOR_TYPE_ACCELEROMETER && !sensor[s].is_virtual)
+			break;
+
+	if (s == sensor_count)
+		return 1;
+
+	do {
+		n = get_samples_in_range(s, from, t1, samples, GYRO_ACCEL_SAMPLES);
+
+		for (i=0; i<n; i++, seen++)
+			for (j=0; j<3; j++) {
+				if (!seen || samples[i].data[j] < min[j])
+					min[j] = samples[i].data[j];
+
+				if (!seen || samples[i].data[j] > max[j])
+					max[j] = samples[i].data[j];
+			}
+
+		if (n)
+			from = samples[n-1].ts + 1;
+	} while (n == GYRO_ACCEL_SAMPLES);
+
+	if (seen < 2) {
+		if (get_nearest_sample(s, t0, &first) || get_nearest_sample(s, t1, &last) || first.ts == last.ts)
+			return 1; /* Nothing to cross check against */
+
+		for (j=0; j<3; j++) {
+			min[j] = fmin(first.data[j], last.data[j]);
+			max[j] = fmax(first.data[j], last.data[j]);
+		}
+	}
+
+	for (j=0; j<3; j++)
+		if (max[j] - min[j] > GYRO_ACCEL_MAX_ERR)
+			return 0;
+
+	return 1;
+}
+
+
+static int gyro_collect (float x, float y, float z, int64_t ts, gyro_cal_t* cal_data)
 {
 	/* Analyze gyroscope data */
 
@@ -129,15 +189,23 @@ static int gyro_collect (float x, float y, float z, gyro_cal_t* cal_data)
 
 		if (fabs(cal_data->max_x - cal_data->min_x) <= GYRO_MAX_ERR &&
 		    fabs(cal_data->max_y - cal_data->min_y) <= GYRO_MAX_ERR &&
-		    fabs(cal_data->max_z - cal_data->min_z) <= GYRO_MAX_ERR)
+		    fabs(cal_data->max_z - cal_data->min_z) <= GYRO_MAX_ERR) {
+			if (!cal_data->count)
+				cal_data->start_ts = ts;
 			cal_data->count++; /* One more conformant sample */
-		else
+		} else
 			reset(cal_data); /* Out of spec sample ; start over */
 
 		return 0; /* Still uncalibrated */
 	}
 
-	/* We got enough stable samples to estimate gyroscope bias */
+	/* We got enough stable samples ; make sure the device was really standing still meanwhile */
+	if (!accel_confirms_stillness(cal_data->start_ts, ts)) {
+		reset(cal_data);
+		return 0;
+	}
+
+	/* Estimate gyroscope bias */
 	cal_data->bias_x = (cal_data->max_x + cal_data->min_x) / 2;
 	cal_data->bias_y = (cal_data->max_y + cal_data->min_y) / 2;
 	cal_data->bias_z = (cal_data->max_z + cal_data->min_z) / 2;
@@ -156,7 +224,7 @@ void calibrate_gyro (int s, sensors_event_t* event)
 	/* Attempt gyroscope calibration if we have not reached this state */
 	if (sensor[s].cal_level == 0)
 		sensor[s].cal_level = gyro_collect(event->data[0], event->data[1],
-					       event->data[2], cal_data);
+					       event->data[2], event->timestamp, cal_data);
 
 
 	event->data[0] = event->data[0] - cal_data->bias_x;
@@ -14,3 +14,17 @@
 // limitations under the License.
 */
 
+
+#ifndef _LINUX_NATIVE_HANDLE_H
+#define _LINUX_NATIVE_HANDLE_H
+
+typedef struct native_handle
+{
+	int version;	/* sizeof(native_handle_t) */
+	int numFds;	/* number of file descriptors at &data[0] */
+	int numInts;	/* number of ints at &data[numFds] */
+	int data[0];
+}
+native_handle_t;
+
+#endif
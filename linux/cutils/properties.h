@@ -25,4 +25,9 @@ static inline int property_get(const char *name, const char *val, const char *x)
 	return 0;
 }
 
+static inline int property_list(void (*propfn)(const char *key, const char *value, void *cookie), void *cookie)
+{
+	return 0;
+}
+
 #endif
@@ -42,9 +42,18 @@
 #define ALOGW(...) ((void)ALOG(LOG_WARN, LOG_TAG, __VA_ARGS__))
 #endif
 
+/* As with the Android logging macros, verbose messages are compiled out unless LOG_NDEBUG is defined to 0 */
+#ifndef LOG_NDEBUG
+#define LOG_NDEBUG 1
+#endif
+
 #ifndef ALOGV
+#if LOG_NDEBUG
+#define ALOGV(...) do { if (0) { ALOG(LOG_VERBOSE, LOG_TAG, __VA_ARGS__); } } while (0)
+#else
 #define ALOGV(...) ((void)ALOG(LOG_VERBOSE, LOG_TAG, __VA_ARGS__))
 #endif
+#endif
 
 #ifndef ALOG
 #define ALOG(priority, tag, ...) \
@@ -17,6 +17,10 @@
 #ifndef __MATRIX_OPS__
 #define __MATRIX_OPS__
 
+#include <math.h>
+
+#define EPSILON 0.000000001	/* Tolerance under which values are considered null */
+
 void transpose (int rows, int cols, double m[rows][cols], double m_trans[cols][rows]);
 void multiply (int m, int n, int p, double m1[m][n], double m2[n][p], double result[m][p]);
 void invert (int s, double m[s][s],  double m_inv[s][s]);
@@ -24,4 +28,168 @@ void multiply_scalar_inplace(int rows, int cols, double m[rows][cols], double sc
 void assign (int rows, int cols, double m[rows][cols], double m1[rows][cols]);
 void substract (int rows, int cols, double m1[rows][cols], double m2[rows][cols], double res[rows][cols]);
 
+/*
+ * Fixed size kernels for the 3 dimensional cases, used on the per sample paths and by the ellipsoid parameter extraction code. They are
+ * unrolled, and tolerate outputs aliasing their inputs. The float variants work on row major arrays, as the sensor correction matrices.
+ */
+
+static inline void substract_3x1 (double m1[3][1], double m2[3][1], double res[3][1])
+{
+    res[0][0] = m1[0][0] - m2[0][0];
+    res[1][0] = m1[1][0] - m2[1][0];
+    res[2][0] = m1[2][0] - m2[2][0];
+}
+
+
+static inline void multiply_3x3_3x1 (double m[3][3], double v[3][1], double res[3][1])
+{
+    double x = v[0][0], y = v[1][0], z = v[2][0];
+
+    res[0][0] = m[0][0] * x + m[0][1] * y + m[0][2] * z;
+    res[1][0] = m[1][0] * x + m[1][1] * y + m[1][2] * z;
+    res[2][0] = m[2][0] * x + m[2][1] * y + m[2][2] * z;
+}
+
+
+static inline void multiply_3x3 (double m1[3][3], double m2[3][3], double res[3][3])
+{
+    double tmp[3][3];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        tmp[i][0] = m1[i][0] * m2[0][0] + m1[i][1] * m2[1][0] + m1[i][2] * m2[2][0];
+        tmp[i][1] = m1[i][0] * m2[0][1] + m1[i][1] * m2[1][1] + m1[i][2] * m2[2][1];
+        tmp[i][2] = m1[i][0] * m2[0][2] + m1[i][1] * m2[1][2] + m1[i][2] * m2[2][2];
+    }
+
+    for (i = 0; i < 3; i++) {
+        res[i][0] = tmp[i][0];
+        res[i][1] = tmp[i][1];
+        res[i][2] = tmp[i][2];
+    }
+}
+
+
+static inline void transpose_3x3 (double m[3][3], double m_trans[3][3])
+{
+    double t;
+
+    m_trans[0][0] = m[0][0];
+    m_trans[1][1] = m[1][1];
+    m_trans[2][2] = m[2][2];
+
+    t = m[0][1]; m_trans[0][1] = m[1][0]; m_trans[1][0] = t;
+    t = m[0][2]; m_trans[0][2] = m[2][0]; m_trans[2][0] = t;
+    t = m[1][2]; m_trans[1][2] = m[2][1]; m_trans[2][1] = t;
+}
+
+
+static inline int invert_3x3 (double m[3][3], double m_inv[3][3])
+{
+    /* Adjugate over determinant ; returns 0, leaving m_inv untouched, if the matrix is singular */
+
+    double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    double det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    double r00, r01, r02, r11, r12, r22, r10, r20, r21;
+
+    if (det == 0)
+        return 0;
+
+    det = 1 / det;
+
+    r01 = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * det;
+    r02 = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * det;
+    r11 = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * det;
+    r12 = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * det;
+    r21 = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * det;
+    r22 = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * det;
+    r00 = c00 * det;
+    r10 = c01 * det;
+    r20 = c02 * det;
+
+    m_inv[0][0] = r00; m_inv[0][1] = r01; m_inv[0][2] = r02;
+    m_inv[1][0] = r10; m_inv[1][1] = r11; m_inv[1][2] = r12;
+    m_inv[2][0] = r20; m_inv[2][1] = r21; m_inv[2][2] = r22;
+    return 1;
+}
+
+
+static inline void eigen_3x3_sym (double m[3][3], double eval[3], double evec[3][3])
+{
+    /*
+     * Eigenvalues of a real symmetric matrix through the trigonometric solution of its characteristic equation, by increasing order except
+     * for eval[1], and the matching unit eigenvectors, stored as the columns of evec. The eigenvectors are obtained by solving the last two
+     * rows of (m - eval I) v = 0 with v[0] = 1, which assumes their first component is not zero.
+     */
+
+    double p = m[0][1] * m[0][1] + m[0][2] * m[0][2] + m[1][2] * m[1][2];
+    double q, r, phi, t0, t1, t2;
+    double h11, h12, h21, h22, det, v1, v2, norm;
+    int i;
+
+    if (p < EPSILON) {
+        eval[0] = m[0][0];
+        eval[1] = m[1][1];
+        eval[2] = m[2][2];
+    } else {
+        q = (m[0][0] + m[1][1] + m[2][2]) / 3;
+        t0 = m[0][0] - q;
+        t1 = m[1][1] - q;
+        t2 = m[2][2] - q;
+
+        p = sqrt((t0 * t0 + t1 * t1 + t2 * t2 + 2 * p) / 6);
+
+        /* Half the determinant of (m - q I) / p */
+        r = (t0 * t1 * t2 + 2 * m[0][1] * m[1][2] * m[0][2] - m[0][2] * m[0][2] * t1 - m[1][2] * m[1][2] * t0 - m[0][1] * m[0][1] * t2) /
+            (2 * p * p * p);
+
+        if (r <= -1.0)
+            phi = M_PI / 3;
+        else if (r >= 1.0)
+            phi = 0;
+        else
+            phi = acos(r) / 3;
+
+        eval[2] = q + 2 * p * cos(phi);
+        eval[0] = q + 2 * p * cos(phi + 2 * M_PI / 3);
+        eval[1] = 3 * q - eval[0] - eval[2];
+    }
+
+    for (i = 0; i < 3; i++) {
+        h11 = m[1][1] - eval[i];
+        h12 = m[1][2];
+        h21 = m[2][1];
+        h22 = m[2][2] - eval[i];
+        det = 1 / (h11 * h22 - h12 * h21);
+
+        v1 = (h22 * -m[1][0] - h12 * -m[2][0]) * det;
+        v2 = (h11 * -m[2][0] - h21 * -m[1][0]) * det;
+        norm = sqrt(1 + v1 * v1 + v2 * v2);
+
+        evec[0][i] = 1.0 / norm;
+        evec[1][i] = v1 / norm;
+        evec[2][i] = v2 / norm;
+    }
+}
+
+
+static inline void substract_3x1_f (const float v1[3], const float v2[3], float res[3])
+{
+    res[0] = v1[0] - v2[0];
+    res[1] = v1[1] - v2[1];
+    res[2] = v1[2] - v2[2];
+}
+
+
+static inline void multiply_3x3_3x1_f (const float m[9], const float v[3], float res[3])
+{
+    float x = v[0], y = v[1], z = v[2];
+
+    res[0] = m[0] * x + m[1] * y + m[2] * z;
+    res[1] = m[3] * x + m[4] * y + m[5] * z;
+    res[2] = m[6] * x + m[7] * y + m[8] * z;
+}
+
 #endif
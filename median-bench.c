@@ -0,0 +1,160 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+/*
+ * Host side microbenchmark for the median filter: compares the sliding window used by filtering.c against the quickselect based
+ * implementation it replaced, checking that both produce the same output. Build with make median-bench.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "median-window.h"
+
+#define BENCH_SAMPLES	200000
+
+
+static unsigned int partition (float* list, unsigned int left, unsigned int right, unsigned int pivot_index)
+{
+	unsigned int i;
+	unsigned int store_index = left;
+	float aux;
+	float pivot_value = list[pivot_index];
+
+	aux = list[pivot_index];
+	list[pivot_index] = list[right];
+	list[right] = aux;
+
+	for (i = left; i < right; i++)
+		if (list[i] < pivot_value) {
+			aux = list[store_index];
+			list[store_index] = list[i];
+			list[i] = aux;
+			store_index++;
+		}
+
+	aux = list[right];
+	list[right] = list[store_index];
+	list[store_index] = aux;
+	return store_index;
+}
+
+
+static float quickselect_median (float* queue, unsigned int size)
+{
+	unsigned int left = 0;
+	unsigned int right = size - 1;
+	unsigned int pivot_index;
+	unsigned int median_index = (right / 2);
+	float temp[size];
+
+	memcpy(temp, queue, size * sizeof(float));
+
+	if (left == right)
+		return temp[left];
+
+	while (left < right) {
+		pivot_index = (left + right) / 2;
+		pivot_index = partition(temp, left, right, pivot_index);
+		if (pivot_index == median_index)
+			return temp[median_index];
+		else if (pivot_index > median_index)
+			right = pivot_index - 1;
+		else
+			left = pivot_index + 1;
+	}
+
+	return temp[left];
+}
+
+
+static double elapsed_ns (struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+
+static int run (unsigned int window_size, const float* input, float* out_ref, float* out_new)
+{
+	float buff[window_size];
+	float storage[2 * window_size];
+	unsigned int idx = 0, count = 0;
+	median_window_t w;
+	struct timespec t0, t1, t2;
+	int i, mismatches = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	/* Same bookkeeping as the former denoise_median */
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		if (count < window_size)
+			count++;
+
+		buff[idx] = input[i];
+		out_ref[i] = quickselect_median(buff, count);
+		idx = (idx + 1) % window_size;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	median_window_init(&w, storage, window_size);
+
+	for (i = 0; i < BENCH_SAMPLES; i++)
+		out_new[i] = median_window_update(&w, input[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	for (i = 0; i < BENCH_SAMPLES; i++)
+		if (out_ref[i] != out_new[i])
+			mismatches++;
+
+	printf("%6u %14.1f %14.1f %8.2fx %10d\n", window_size,
+		elapsed_ns(&t0, &t1) / BENCH_SAMPLES, elapsed_ns(&t1, &t2) / BENCH_SAMPLES,
+		elapsed_ns(&t0, &t1) / elapsed_ns(&t1, &t2), mismatches);
+
+	return mismatches;
+}
+
+
+int main (void)
+{
+	static const unsigned int sizes[] = { 5, 8, 16, 24, 32, 48, 64 };
+	float* input = malloc(BENCH_SAMPLES * sizeof(float));
+	float* out_ref = malloc(BENCH_SAMPLES * sizeof(float));
+	float* out_new = malloc(BENCH_SAMPLES * sizeof(float));
+	unsigned int i;
+	int mismatches = 0;
+
+	if (!input || !out_ref || !out_new)
+		return 1;
+
+	/* Noisy readings around a slowly moving value, quantized so that duplicates occur, as with real sensors */
+	srand(1);
+	for (i = 0; i < BENCH_SAMPLES; i++)
+		input[i] = (float) ((int) (i / 1000) + rand() % 64 - 32) * 0.0625f;
+
+	printf("window  quickselect ns  sliding ns    speedup mismatches\n");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		mismatches += run(sizes[i], input, out_ref, out_new);
+
+	free(input);
+	free(out_ref);
+	free(out_new);
+
+	return mismatches ? 1 : 0;
+}
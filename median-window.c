@@ -0,0 +1,123 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#include <string.h>
+#include "median-window.h"
+
+
+static unsigned int upper_bound (const float* list, unsigned int left, unsigned int right, float value)
+{
+	/* Return the index of the first element of list[left..right-1] greater than value, or right if there is none */
+
+	unsigned int mid;
+
+	while (left < right) {
+		mid = left + (right - left) / 2;
+
+		if (list[mid] <= value)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+
+	return left;
+}
+
+
+static unsigned int find_sample (const float* list, unsigned int count, float value)
+{
+	unsigned int left = 0;
+	unsigned int right = count;
+	unsigned int mid;
+
+	/* Lower bound ; any cell holding an equal value is as good as another */
+	while (left < right) {
+		mid = left + (right - left) / 2;
+
+		if (list[mid] < value)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+
+	if (left < count && !memcmp(&list[left], &value, sizeof(float)))
+		return left;
+
+	/* Values that don't compare well (NaN) break the ordering ; fall back to an exhaustive search */
+	for (left = 0; left < count; left++)
+		if (!memcmp(&list[left], &value, sizeof(float)))
+			return left;
+
+	return count - 1;
+}
+
+
+void median_window_init (median_window_t* w, float* storage, unsigned int size)
+{
+	/* storage must be able to hold 2 * size floats */
+
+	w->ring = storage;
+	w->sorted = storage + size;
+	w->size = size;
+	w->count = 0;
+	w->idx = 0;
+}
+
+
+void median_window_reset (median_window_t* w)
+{
+	w->count = 0;
+	w->idx = 0;
+}
+
+
+float median_window_update (median_window_t* w, float value)
+{
+	/*
+	 * Record a sample, evicting the oldest one if the window is full, and return the median of the window contents. For even sample counts
+	 * the lower of the two middle values is returned, which matches what selecting the (count-1)/2 ranked element would give.
+	 */
+
+	float* sorted = w->sorted;
+	float evicted;
+	unsigned int p, q;
+
+	if (w->count < w->size) {
+		q = upper_bound(sorted, 0, w->count, value);
+		memmove(&sorted[q + 1], &sorted[q], (w->count - q) * sizeof(float));
+		sorted[q] = value;
+		w->count++;
+	} else {
+		evicted = w->ring[w->idx];
+		p = find_sample(sorted, w->count, evicted);
+
+		/* Slide the cells between the evicted and inserted positions by one, in the direction of the evicted one */
+		if (value > evicted) {
+			q = upper_bound(sorted, p + 1, w->count, value);
+			memmove(&sorted[p], &sorted[p + 1], (q - p - 1) * sizeof(float));
+			sorted[q - 1] = value;
+		} else {
+			q = upper_bound(sorted, 0, p, value);
+			memmove(&sorted[q + 1], &sorted[q], (p - q) * sizeof(float));
+			sorted[q] = value;
+		}
+	}
+
+	w->ring[w->idx] = value;
+	w->idx = (w->idx + 1) % w->size;
+
+	return sorted[(w->count - 1) / 2];
+}
@@ -0,0 +1,39 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#ifndef __MEDIAN_WINDOW_H__
+#define __MEDIAN_WINDOW_H__
+
+/*
+ * Sliding window median: samples are kept both in arrival order and sorted, so that evicting the oldest sample and inserting a new one is a
+ * pair of binary searches plus a move of the cells lying between the two positions, and the median is then read directly.
+ */
+
+typedef struct
+{
+	float* ring;		/* Samples in arrival order		*/
+	float* sorted;		/* Same samples, in ascending order	*/
+	unsigned int size;	/* Window capacity			*/
+	unsigned int count;	/* Samples currently in the window	*/
+	unsigned int idx;	/* Ring index of sample to evict next	*/
+}
+median_window_t;
+
+void	median_window_init	(median_window_t* w, float* storage, unsigned int size);
+void	median_window_reset	(median_window_t* w);
+float	median_window_update	(median_window_t* w, float value);
+
+#endif
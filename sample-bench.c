@@ -0,0 +1,376 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+/*
+ * Host side throughput benchmark for the sample pipeline. Replays a scan capture recorded by the HAL (see capture.h) through the same
+ * decoding, calibration, filtering and finalization code as sensor_poll, as fast as possible, once per stage combination, and reports the
+ * cost of each stage per sample. Build with make bench ; make bench CAPTURE=<file> also runs it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <hardware/sensors.h>
+#include "common.h"
+#include "description.h"
+#include "transform.h"
+#include "calibration.h"
+#include "filtering.h"
+#include "capture.h"
+
+#define DEFAULT_LOOPS	10	/* Replay the capture this many times per pass */
+
+typedef enum
+{
+	STAGE_DECODE,		/* Scan splitting and conversion to floating point values		*/
+	STAGE_CALIBRATE,	/* Decoding, followed by the calibration routine for the sensor type	*/
+	STAGE_DENOISE,		/* Decoding, followed by noise filtering				*/
+	STAGE_FINALIZE,		/* Decoding, followed by the full finalization routine			*/
+	STAGE_COUNT
+}
+stage_t;
+
+static const char* stage_name[STAGE_COUNT] = { "decode", "calibrate", "denoise", "finalize" };
+
+static unsigned char*	scans;		/* Capture records, as read from file */
+static long		scans_size;
+static int*		replayed;	/* Flags sensors whose samples come from device scans */
+static float		checksum;	/* Keeps the compiler from discarding the work we're timing */
+
+
+static double elapsed_ns (struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+
+static int load_capture (const char* path)
+{
+	capture_header_t header;
+	FILE* f = fopen(path, "r");
+	long start;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION ||
+	    header.info_size != sizeof(sensor_info_t) || !header.sensor_count) {
+		fprintf(stderr, "%s: not a capture file, or recorded by an incompatible HAL build\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	sensor_count = header.sensor_count;
+	sensor = (sensor_info_t*) calloc(sensor_count, sizeof(sensor_info_t));
+	sensor_desc = (struct sensor_t*) calloc(sensor_count, sizeof(struct sensor_t));
+	sensor_state = (sensor_state_t*) calloc(sensor_count, sizeof(sensor_state_t));
+	replayed = (int*) calloc(sensor_count, sizeof(int));
+
+	if (!sensor || !sensor_desc || !sensor_state || !replayed ||
+	    fread(sensor, sizeof(sensor_info_t), sensor_count, f) != (size_t) sensor_count) {
+		fprintf(stderr, "%s: truncated sensor table\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	start = ftell(f);
+	fseek(f, 0, SEEK_END);
+	scans_size = ftell(f) - start;
+	fseek(f, start, SEEK_SET);
+
+	scans = (unsigned char*) malloc(scans_size ? scans_size : 1);
+
+	if (!scans || fread(scans, 1, scans_size, f) != (size_t) scans_size) {
+		fprintf(stderr, "%s: could not read scans\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+
+static void setup_sensor (int s, int noisy)
+{
+	/* Rebind what the capture could not record: processing callbacks and calibration data */
+
+	sensor_desc[s].type = sensor[s].type;
+
+	replayed[s] = !sensor[s].is_virtual && sensor[s].mode == MODE_TRIGGER && sensor[s].num_channels;
+
+	if (!replayed[s])
+		return;
+
+	if (noisy)
+		sensor[s].quirks |= QUIRK_NOISY;
+
+	select_transform(s);
+
+	switch (sensor[s].type) {
+		case SENSOR_TYPE_ACCELEROMETER:
+			if (sensor[s].quirks & QUIRK_BIASED)
+				sensor[s].cal_data = calloc(1, sizeof(accel_cal_t));
+			break;
+
+		case SENSOR_TYPE_GYROSCOPE:
+			sensor[s].cal_data = calloc(1, sizeof(gyro_cal_t));
+			break;
+
+		case SENSOR_TYPE_MAGNETIC_FIELD:
+			sensor[s].cal_data = calloc(1, sizeof(compass_cal_t));
+			break;
+	}
+}
+
+
+static void reset_sensor (int s)
+{
+	/* Start each pass from the state a freshly enabled sensor would have */
+
+	switch (sensor[s].type) {
+		case SENSOR_TYPE_ACCELEROMETER:
+			if (sensor[s].cal_data)
+				memset(sensor[s].cal_data, 0, sizeof(accel_cal_t));
+			accel_cal_init(s);
+			break;
+
+		case SENSOR_TYPE_MAGNETIC_FIELD:
+			compass_read_data(s);
+			break;
+
+		case SENSOR_TYPE_GYROSCOPE:
+			gyro_cal_init(s);
+			break;
+	}
+
+	release_noise_filtering_data(s);
+	setup_noise_filtering(s);
+
+	sensor[s].event_count = 0;
+	sensor[s].prev_val.data64 = 0;
+	memset(&sensor_state[s], 0, sizeof(sensor_state_t));
+}
+
+
+static void calibrate (int s, sensors_event_t* data)
+{
+	switch (sensor[s].type) {
+		case SENSOR_TYPE_ACCELEROMETER:
+			if (sensor[s].quirks & QUIRK_BIASED)
+				calibrate_accel(s, data);
+			break;
+
+		case SENSOR_TYPE_MAGNETIC_FIELD:
+			calibrate_compass(s, data);
+			break;
+
+		case SENSOR_TYPE_GYROSCOPE:
+			calibrate_gyro(s, data);
+			break;
+	}
+}
+
+
+static void process_scan (const capture_record_t* record, const unsigned char* scan, int64_t ts_shift, stage_t stage)
+{
+	/* Same steps as queue_device_scan, dequeue_report and propagate_sensor_report, minus the queueing */
+
+	sensors_event_t data;
+	unsigned char* report;
+	int s, c;
+
+	for (s=0; s<sensor_count; s++) {
+		if (!replayed[s] || sensor[s].dev_num != record->dev_num)
+			continue;
+
+		report = sensor[s].report_buffer;
+
+		for (c=0; c<sensor[s].report_copy_count; c++) {
+			if (sensor[s].report_copy[c].offset + sensor[s].report_copy[c].size > record->size)
+				break;
+
+			memcpy(report, scan + sensor[s].report_copy[c].offset, sensor[s].report_copy[c].size);
+			report += sensor[s].report_copy[c].size;
+		}
+
+		memset(&data, 0, sizeof(sensors_event_t));
+
+		data.version	= sizeof(sensors_event_t);
+		data.sensor	= s;
+		data.type	= sensor_desc[s].type;
+		data.timestamp	= record->ts + ts_shift;
+
+		if (record->age && sensor[s].sampling_rate)
+			data.timestamp -= (int64_t) (record->age * 1000000000.0 / sensor[s].sampling_rate);
+
+		if (sensor[s].ops.transform_sample)
+			sensor[s].ops.transform_sample(s, sensor[s].report_buffer, data.data);
+		else {
+			report = sensor[s].report_buffer;
+
+			for (c=0; c<sensor[s].num_channels; c++) {
+				data.data[c] = sensor[s].ops.transform(s, c, report);
+				report += sensor[s].channel[c].size;
+			}
+		}
+
+		switch (stage) {
+			case STAGE_CALIBRATE:
+				calibrate(s, &data);
+				break;
+
+			case STAGE_DENOISE:
+				denoise(s, &data);
+				break;
+
+			case STAGE_FINALIZE:
+				sensor[s].ops.finalize(s, &data);
+				break;
+
+			default:
+				break;
+		}
+
+		checksum += data.data[0] + data.data[1] + data.data[2];
+	}
+}
+
+
+static long run_pass (stage_t stage, int loops, double* ns)
+{
+	/* Replay the capture loops times through the given stage, returning the count of processed samples and the elapsed time */
+
+	struct timespec t0, t1;
+	const capture_record_t* record;
+	long offset;
+	long samples = 0;
+	int64_t first_ts = 0;
+	int64_t last_ts = 0;
+	int loop;
+	int s;
+
+	for (s=0; s<sensor_count; s++)
+		if (replayed[s])
+			reset_sensor(s);
+
+	/* Count samples and get the capture time span outside of the timed loop, so that it's the same for all stages */
+	for (offset=0; offset + (long) sizeof(capture_record_t) <= scans_size; offset += sizeof(capture_record_t) + record->size) {
+		record = (const capture_record_t*) (scans + offset);
+
+		if (!offset || record->ts < first_ts)
+			first_ts = record->ts;
+
+		if (record->ts > last_ts)
+			last_ts = record->ts;
+
+		for (s=0; s<sensor_count; s++)
+			if (replayed[s] && sensor[s].dev_num == record->dev_num)
+				samples++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	/* Each replay of the capture is dated after the previous one, as sample histories expect time to move forward */
+	for (loop=0; loop<loops; loop++)
+		for (offset=0; offset + (long) sizeof(capture_record_t) <= scans_size; offset += sizeof(capture_record_t) + record->size) {
+			record = (const capture_record_t*) (scans + offset);
+
+			if (offset + (long) sizeof(capture_record_t) + record->size > scans_size)
+				break;
+
+			process_scan(record, scans + offset + sizeof(capture_record_t), loop * (last_ts - first_ts + 1), stage);
+		}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	*ns = elapsed_ns(&t0, &t1);
+	return samples * loops;
+}
+
+
+int main (int argc, char** argv)
+{
+	int loops = DEFAULT_LOOPS;
+	int noisy = 0;
+	int opt;
+	int s;
+	stage_t stage;
+	long samples;
+	double ns;
+	double per_sample[STAGE_COUNT];
+
+	while ((opt = getopt(argc, argv, "n:N")) != -1)
+		switch (opt) {
+			case 'n':
+				loops = atoi(optarg);
+				break;
+
+			case 'N':
+				noisy = 1;	/* Engage the default noise filters on gyroscopes and magnetometers */
+				break;
+
+			default:
+				goto usage;
+		}
+
+	if (optind != argc - 1 || loops < 1)
+		goto usage;
+
+	if (load_capture(argv[optind]))
+		return 1;
+
+	for (s=0; s<sensor_count; s++) {
+		setup_sensor(s, noisy);
+
+		if (replayed[s])
+			printf("sensor%d: %s, %d channels, %s\n", s, sensor[s].friendly_name, sensor[s].num_channels,
+				sensor[s].channel[0].type_spec);
+	}
+
+	/* Filter state is sized from the quirks we just set up */
+	if (allocate_filter_arenas(sensor_count))
+		return 1;
+
+	printf("stage       samples      ns/sample   samples/s     ns/sample over decode\n");
+
+	for (stage=0; stage<STAGE_COUNT; stage++) {
+		samples = run_pass(stage, loops, &ns);
+
+		if (!samples) {
+			fprintf(stderr, "No replayable scans in capture\n");
+			return 1;
+		}
+
+		per_sample[stage] = ns / samples;
+
+		printf("%-10s %9ld %14.1f %11.0f %14.1f\n", stage_name[stage], samples, per_sample[stage], samples * 1e9 / ns,
+			per_sample[stage] - per_sample[STAGE_DECODE]);
+	}
+
+	compass_cal_shutdown();
+
+	printf("checksum %g\n", checksum);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-n loops] [-N] capture_file\n", argv[0]);
+	return 1;
+}
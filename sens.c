@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <hardware/sensors.h>
 #include <log/log.h>
@@ -34,8 +35,11 @@ int usage(void)
 	fprintf(stderr, "sens set_delay sensor_id delay\n");
 	fprintf(stderr, "sens poll\n");
 	fprintf(stderr, "sens poll [duration] [number_of_events] \n");
+	fprintf(stderr, "sens poll --binary [sensor_id[:decimation] ...]\n");
+	fprintf(stderr, "sens decode < binary_capture\n");
 	fprintf(stderr, "sens poll_stop\n");
 	fprintf(stderr, "sens check_sample_rate [rate] \n");
+	fprintf(stderr, "sens stats [reset]\n");
 	return 1;
 }
 
@@ -77,6 +81,8 @@ static const char *type_str(int type)
 
 static struct sensors_module_t *hmi;
 static struct hw_device_t *dev;
+static void (*stats_dump)(FILE *f);	/* Optional HAL instrumentation entry points */
+static void (*stats_reset)(void);
 static FILE *client;
 static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
@@ -90,6 +96,33 @@ static long long timestamp = 0;
 static long long event_init_poll_time = 0;
 static long long poll_duration = 0;
 
+/*
+ * Binary streaming mode: rather than formatting text for each event, poll batches are written as packed fixed size records, preceded by a
+ * stream header, so that capture can keep up with sensors running at full rate. "sens decode" turns such a stream back into text.
+ */
+#define BINARY_MAGIC		0x424e4553	/* "SENB" */
+#define BINARY_VERSION		1
+#define BINARY_VALUES		8		/* Leading sensors_event_t data fields saved per event ; wide enough for uncalibrated samples */
+#define MAX_FILTERED_HANDLES	64		/* Sensor handles that can be named in a subscription filter */
+
+struct binary_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+} __attribute__((packed));
+
+struct binary_record {
+	int32_t sensor;
+	int32_t type;
+	int64_t timestamp;
+	float data[BINARY_VALUES];	/* Copied verbatim ; holds the 64 bits step counter value for step counter events */
+} __attribute__((packed));
+
+static int binary_mode = 0;
+static int binary_filtered = 0;				/* Set if only some sensors are to be streamed */
+static int decimation[MAX_FILTERED_HANDLES];		/* Keep one event out of n for this sensor ; 0 if not subscribed */
+static int decimation_count[MAX_FILTERED_HANDLES];	/* Events seen since the last one we kept */
+
 static void print_event(struct sensors_event_t *e)
 {
 	FILE *f;
@@ -234,6 +267,89 @@ static void process_event(struct sensors_event_t *e)
 	}
 }
 
+static int keep_binary_event(struct sensors_event_t *e)
+{
+	int handle = e->sensor;
+
+	if (!binary_filtered)
+		return 1;
+
+	if (handle < 0 || handle >= MAX_FILTERED_HANDLES || !decimation[handle])
+		return 0;
+
+	if (++decimation_count[handle] < decimation[handle])
+		return 0;
+
+	decimation_count[handle] = 0;
+	return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	/* Write len bytes, resuming after short writes and signal interruptions ; return 0 on success, -1 on error */
+
+	const char *cursor = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, cursor, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		cursor += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int write_binary_events(struct sensors_event_t *events, int count)
+{
+	/* Pack a poll batch into records and hand them over to the client in a single write ; return 0 if we're not in binary mode */
+
+	struct binary_record records[count];
+	int i, n = 0;
+
+	pthread_mutex_lock(&client_mutex);
+
+	if (!binary_mode) {
+		pthread_mutex_unlock(&client_mutex);
+		return 0;
+	}
+
+	if (!client) {
+		pthread_mutex_unlock(&client_mutex);
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!keep_binary_event(&events[i]))
+			continue;
+
+		records[n].sensor = events[i].sensor;
+		records[n].type = events[i].type;
+		records[n].timestamp = events[i].timestamp;
+		memcpy(records[n].data, events[i].data, sizeof(records[n].data));
+		n++;
+	}
+
+	event_no += n;
+
+	/* The stream header got flushed when the client connected, so nothing is buffered in client and we can write to its fd directly */
+	if (n && write_all(fileno(client), records, n * sizeof(struct binary_record))) {
+		ALOGE("binary stream write failed: %s", strerror(errno));
+		fclose(client);
+		client = NULL;
+	}
+
+	pthread_mutex_unlock(&client_mutex);
+	return 1;
+}
+
 static void run_sensors_poll_v0(void)
 {
 	struct sensors_poll_device_t *poll_dev = (struct sensors_poll_device_t *)dev;
@@ -244,6 +360,9 @@ static void run_sensors_poll_v0(void)
 
 		count = poll_dev->poll(poll_dev, events, sizeof(events)/sizeof(sensors_event_t));
 
+		if (count > 0 && write_binary_events(events, count))
+			continue;
+
 		for(i = 0; i < count; i++)
 			process_event(&events[i]);
 	}
@@ -375,6 +494,50 @@ static int dispatch_cmd(char *cmd, FILE *f)
 
 		return sensor_set_delay(handle, delay);
 
+	} else if (!strcmp(argv[0], "poll") && argc > 1 && !strcmp(argv[1], "--binary")) {
+		struct binary_header header = {
+			.magic = BINARY_MAGIC,
+			.version = BINARY_VERSION,
+			.record_size = sizeof(struct binary_record),
+		};
+		int i, rate;
+		char *sep;
+
+		pthread_mutex_lock(&client_mutex);
+
+		/* Subscription filter: sensor handles, optionally followed by a decimation factor, ex: 0 3:4 */
+		memset(decimation, 0, sizeof(decimation));
+		memset(decimation_count, 0, sizeof(decimation_count));
+		binary_filtered = argc > 2;
+
+		for (i = 2; i < argc; i++) {
+			handle = atoi(argv[i]);
+			sep = strchr(argv[i], ':');
+			rate = sep ? atoi(sep + 1) : 1;
+
+			if (handle < 0 || handle >= MAX_FILTERED_HANDLES || rate < 1) {
+				pthread_mutex_unlock(&client_mutex);
+				CLIENT_ERR(f, "poll: invalid subscription %s", argv[i]);
+				return -1;
+			}
+
+			decimation[handle] = rate;
+		}
+
+		if (client)
+			fclose(client);
+		client = f;
+		non_param_poll = 1;
+		binary_mode = 1;
+
+		if (fwrite(&header, sizeof(header), 1, client) != 1 || fflush(client)) {
+			fclose(client);
+			client = NULL;
+		}
+
+		pthread_mutex_unlock(&client_mutex);
+
+		return 1;
 	} else if (!strcmp(argv[0], "poll")) {
 		if (argc == 1) {
 			non_param_poll = 1;
@@ -393,6 +556,7 @@ static int dispatch_cmd(char *cmd, FILE *f)
 		if (client)
 			fclose(client);
 		client = f;
+		binary_mode = 0;
 
 		if (!non_param_poll) {
 			pthread_cond_wait(&cond, &client_mutex);
@@ -421,6 +585,7 @@ static int dispatch_cmd(char *cmd, FILE *f)
 		if (client)
 			fclose(client);
 		client = f;
+		binary_mode = 0;
 		pthread_cond_wait(&cond, &client_mutex);
 		fclose(client);
 		client = NULL;
@@ -435,6 +600,21 @@ static int dispatch_cmd(char *cmd, FILE *f)
 		pthread_mutex_unlock(&client_mutex);
 
 		return 1;
+	} else if (!strcmp(argv[0], "stats")) {
+
+		if (!stats_dump || !stats_reset) {
+			CLIENT_ERR(f, "stats: not supported by this HAL");
+			return -1;
+		}
+
+		if (argc > 1 && !strcmp(argv[1], "reset")) {
+			stats_reset();
+			return 0;
+		}
+
+		stats_dump(f);
+		return 0;
+
 	} else if (!strcmp(argv[0], "stop")) {
 		exit(1);
 	} else {
@@ -544,6 +724,45 @@ static int start_server(void)
 	}
 }
 
+static int decode_binary(FILE *in, FILE *out)
+{
+	/* Turn a "sens poll --binary" stream back into one line of text per event */
+
+	struct binary_header header;
+	struct binary_record record;
+	unsigned long long count = 0;
+	uint64_t step_counter;
+	int i;
+
+	if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != BINARY_MAGIC) {
+		fprintf(stderr, "not a sens binary stream\n");
+		return 1;
+	}
+
+	if (header.version != BINARY_VERSION || header.record_size != sizeof(record)) {
+		fprintf(stderr, "unsupported sens binary stream version %d\n", header.version);
+		return 1;
+	}
+
+	while (fread(&record, sizeof(record), 1, in) == 1) {
+		fprintf(out, "sensor=%d type=%s timestamp=%lld", record.sensor, type_str(record.type), (long long) record.timestamp);
+
+		if (record.type == SENSOR_TYPE_STEP_COUNTER) {
+			memcpy(&step_counter, record.data, sizeof(step_counter));
+			fprintf(out, " step_counter=%llu\n", (unsigned long long) step_counter);
+		} else {
+			for (i = 0; i < BINARY_VALUES; i++)
+				fprintf(out, " %g", record.data[i]);
+			fprintf(out, "\n");
+		}
+
+		count++;
+	}
+
+	fprintf(stderr, "%llu events\n", count);
+	return 0;
+}
+
 static const char *hal_paths[] = {
 	"/system/lib/hw/sensors.gmin.so",
 	"sensors.gmin.so",
@@ -589,6 +808,9 @@ static int start_hal(int argc, char **argv)
 		return 3;
 	}
 
+	stats_dump = dlsym(hal, "iio_sensors_stats_dump");
+	stats_reset = dlsym(hal, "iio_sensors_stats_reset");
+
 	printf("HAL loaded: name %s vendor %s version %d.%d id %s\n",
 	       hmi->common.name, hmi->common.author,
 	       hmi->common.version_major, hmi->common.version_minor,
@@ -665,6 +887,9 @@ int main(int argc, char **argv)
 		return start_hal(argc, argv);
 	}
 
+	if (!strcmp(argv[1], "decode"))
+		return decode_binary(stdin, stdout);
+
 	if (strlen(argv[1]) >= sizeof(cmd))
 		return usage();
 	strncpy(cmd, argv[1], sizeof(cmd) - 1);
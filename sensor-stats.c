@@ -0,0 +1,156 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <log/log.h>
+#include <hardware/sensors.h>
+#include "common.h"
+#include "utils.h"
+#include "sensor-stats.h"
+
+#define LATENCY_BUCKETS		24	/* Bucket n counts latencies in [2^(n-1), 2^n[ us ; bucket 0 is for latencies below 1 us */
+
+typedef struct
+{
+	uint64_t counter[STAT_COUNTERS];
+	uint64_t reported;			/* Samples returned by sensor_poll				*/
+	uint64_t latency_sum;			/* Sum of sample timestamp to poll return delays, in us	*/
+	uint64_t latency_max;
+	uint64_t latency[LATENCY_BUCKETS];
+}
+sensor_stats_t;
+
+static sensor_stats_t*	stats;
+static int		stats_count_max;	/* Entries in the stats table				*/
+static int64_t		stats_reset_ts;		/* Boot time at which counters were last cleared	*/
+
+
+int allocate_sensor_stats (int count)
+{
+	free(stats);
+
+	stats = (sensor_stats_t*) calloc(count ? count : 1, sizeof(sensor_stats_t));
+
+	if (!stats) {
+		stats_count_max = 0;
+		return -1;
+	}
+
+	stats_count_max = count;
+	stats_reset_ts = get_timestamp_boot();
+	return 0;
+}
+
+
+void release_sensor_stats (void)
+{
+	free(stats);
+	stats = NULL;
+	stats_count_max = 0;
+}
+
+
+void stats_count (int s, sensor_stat_t stat)
+{
+	if (s < stats_count_max)
+		__atomic_fetch_add(&stats[s].counter[stat], 1, __ATOMIC_RELAXED);
+}
+
+
+void stats_record_latency (int s, int64_t latency)
+{
+	/* Account for a sample being returned to Android, latency ns after the date it carries */
+
+	uint64_t us;
+	uint64_t max;
+	int bucket;
+
+	if (s >= stats_count_max)
+		return;
+
+	us = latency > 0 ? latency / 1000 : 0;
+	bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+
+	__atomic_fetch_add(&stats[s].reported, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats[s].latency_sum, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats[s].latency[bucket], 1, __ATOMIC_RELAXED);
+
+	/* Only the poll loop records latencies, so there is no competing update of the maximum */
+	max = __atomic_load_n(&stats[s].latency_max, __ATOMIC_RELAXED);
+
+	if (us > max)
+		__atomic_store_n(&stats[s].latency_max, us, __ATOMIC_RELAXED);
+}
+
+
+static uint64_t read_stat (uint64_t* field)
+{
+	return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+
+void __attribute__ ((visibility ("default"))) iio_sensors_stats_dump (FILE* f)
+{
+	int s, b;
+	uint64_t reported;
+	float elapsed = (get_timestamp_boot() - stats_reset_ts) / 1000000000.0;
+
+	if (!f)
+		return;
+
+	fprintf(f, "stats over %.1f s\n", elapsed);
+
+	for (s = 0; s < stats_count_max && s < sensor_count; s++) {
+		reported = read_stat(&stats[s].reported);
+
+		fprintf(f, "sensor%d (%s): reported=%llu (%.1f/s) dropped=%llu duplicated=%llu missed_deadlines=%llu\n",
+			s, sensor[s].friendly_name, (unsigned long long) reported, elapsed > 0 ? reported / elapsed : 0,
+			(unsigned long long) read_stat(&stats[s].counter[STAT_DROPPED]),
+			(unsigned long long) read_stat(&stats[s].counter[STAT_DUPLICATED]),
+			(unsigned long long) read_stat(&stats[s].counter[STAT_MISSED_DEADLINE]));
+
+		if (!reported)
+			continue;
+
+		fprintf(f, "sensor%d: latency avg=%llu us max=%llu us\n", s,
+			(unsigned long long) (read_stat(&stats[s].latency_sum) / reported),
+			(unsigned long long) read_stat(&stats[s].latency_max));
+
+		/* Bucket upper bounds, in us */
+		for (b = 0; b < LATENCY_BUCKETS; b++)
+			if (read_stat(&stats[s].latency[b]))
+				fprintf(f, "sensor%d: latency <%llu us: %llu\n", s, 1ULL << b,
+					(unsigned long long) read_stat(&stats[s].latency[b]));
+	}
+}
+
+
+void __attribute__ ((visibility ("default"))) iio_sensors_stats_reset (void)
+{
+	int s;
+	unsigned int i;
+
+	for (s = 0; s < stats_count_max; s++) {
+		for (i = 0; i < sizeof(sensor_stats_t) / sizeof(uint64_t); i++)
+			__atomic_store_n(((uint64_t*) &stats[s]) + i, 0, __ATOMIC_RELAXED);
+	}
+
+	stats_reset_ts = get_timestamp_boot();
+}
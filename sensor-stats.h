@@ -0,0 +1,46 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#ifndef __SENSOR_STATS_H__
+#define __SENSOR_STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Per sensor counters and report latency histograms, cheap enough to be always on. Counters are updated from the poll loop and acquisition
+ * threads, and read or cleared from the sens tool through the exported entry points below, which it looks up by name.
+ */
+
+typedef enum
+{
+	STAT_DROPPED,		/* Samples lost before poll could return them	*/
+	STAT_DUPLICATED,	/* Synthetized duplicate samples		*/
+	STAT_MISSED_DEADLINE,	/* Poll mode acquisitions that started late	*/
+	STAT_COUNTERS
+}
+sensor_stat_t;
+
+int	allocate_sensor_stats	(int count);
+void	release_sensor_stats	(void);
+
+void	stats_count		(int s, sensor_stat_t stat);
+void	stats_record_latency	(int s, int64_t latency);
+
+void	iio_sensors_stats_dump	(FILE* f);
+void	iio_sensors_stats_reset	(void);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#include <math.h>
+#include <string.h>
+#include <log/log.h>
+#include "timestamp-estimator.h"
+
+#define ESTIMATOR_DECAY		0.99	/* Weight decay per scan ; sets the memory of the fit to about a hundred scans		*/
+#define ESTIMATOR_GAP_SLACK	0.5	/* Unexplained delay, in periods, above which we assume scans were lost			*/
+#define ESTIMATOR_READ_SLACK	2.0	/* Delay, in periods, above which a read date is ignored as being late			*/
+#define ESTIMATOR_MAX_REJECTS	4	/* Consecutive late read dates after which we start over				*/
+#define ESTIMATOR_MAX_GAP_NS	1000000000LL	/* Past this silence we start over rather than count lost scans		*/
+#define ESTIMATOR_MAX_ERROR	4.0	/* Prediction errors beyond this many periods mean the rate changed			*/
+
+
+void ts_estimator_reset (ts_estimator_t* e, float rate)
+{
+	/* Forget about past observations ; keep track of the last date we handed out though, so as to remain monotonic */
+
+	int64_t last_ts = e->last_ts;
+
+	memset(e, 0, sizeof(ts_estimator_t));
+	e->rate = rate;
+	e->last_ts = last_ts;
+}
+
+
+static double get_nominal_period (ts_estimator_t* e)
+{
+	return e->rate > 0 ? 1000000000.0 / e->rate : 0;
+}
+
+
+static double get_period (ts_estimator_t* e)
+{
+	/* Slope of the fit, if it is well conditioned and plausible ; otherwise the nominal sampling period */
+
+	double nominal = get_nominal_period(e);
+	double d = e->w * e->sxx - e->sx * e->sx;
+	double period;
+
+	if (e->count < 3 || d <= 0)
+		return nominal;
+
+	period = (e->w * e->sxy - e->sx * e->sy) / d;
+
+	if (period <= 0 || (nominal && (period < nominal / 2 || period > nominal * 2)))
+		return nominal;
+
+	return period;
+}
+
+
+static double get_phase (ts_estimator_t* e, double period)
+{
+	/* Fitted date of the latest observation, relative to its observed date */
+
+	if (e->count < 3 || !e->w)
+		return 0;
+
+	return (e->sy - period * e->sx) / e->w;
+}
+
+
+static void add_observation (ts_estimator_t* e, int64_t index, int64_t ts)
+{
+	/* Account for scan index observed at date ts, then move the origin of the sums there, so that they remain small */
+
+	double x = index - e->origin_index;
+	double y = ts - e->origin_ts;
+	double decay = pow(ESTIMATOR_DECAY, x);
+
+	if (!e->count) {
+		e->origin_index = index;
+		e->origin_ts = ts;
+		e->w = 1;
+		e->count = 1;
+		return;
+	}
+
+	e->w	*= decay;
+	e->sx	*= decay;
+	e->sy	*= decay;
+	e->sxx	*= decay;
+	e->sxy	*= decay;
+
+	e->w	+= 1;
+	e->sx	+= x;
+	e->sy	+= y;
+	e->sxx	+= x * x;
+	e->sxy	+= x * y;
+
+	/* Shift coordinates by (x, y) */
+	e->sxy	= e->sxy - x * e->sy - y * e->sx + e->w * x * y;
+	e->sxx	= e->sxx - 2 * x * e->sx + e->w * x * x;
+	e->sx	-= e->w * x;
+	e->sy	-= e->w * y;
+
+	e->origin_index = index;
+	e->origin_ts = ts;
+	e->count++;
+}
+
+
+static int check_observation (ts_estimator_t* e, int64_t index, int64_t ts, int is_read_date, int* lost)
+{
+	/*
+	 * Compare an upcoming observation with what the model predicts, and return 1 if it should be used. Driver timestamps that are later than
+	 * expected mean that scans were lost, typically through a FIFO overflow: report how many in lost, so the caller can skip their numbers
+	 * from this observation on and the fit remains consistent. Late read dates
+	 * are more likely due to scheduling latency, and get ignored. Large errors otherwise mean that the sampling rate changed, or that the
+	 * device was stopped for a while: start over.
+	 */
+
+	double period = get_period(e);
+	double error;
+
+	*lost = 0;
+
+	if (!e->count || !period)
+		return 1;
+
+	if (ts - e->origin_ts > ESTIMATOR_MAX_GAP_NS + (index - e->origin_index) * period) {
+		ts_estimator_reset(e, e->rate);
+		return 1;
+	}
+
+	if (e->count < 3)
+		return 1;
+
+	error = (ts - e->origin_ts - get_phase(e, period) - (index - e->origin_index) * period) / period;
+
+	if (is_read_date && error > ESTIMATOR_READ_SLACK) {
+		if (++e->rejected < ESTIMATOR_MAX_REJECTS)
+			return 0;
+
+		ts_estimator_reset(e, e->rate);
+		return 1;
+	}
+
+	e->rejected = 0;
+
+	if (!is_read_date && error > ESTIMATOR_GAP_SLACK) {
+		*lost = (int) (error + 0.5);
+
+		if (*lost > 0) {
+			ALOGW("Timestamp gap on iio device scans, assuming %d scans were lost\n", *lost);
+			error -= *lost;
+		} else
+			*lost = 0;
+	}
+
+	if (fabs(error) > ESTIMATOR_MAX_ERROR) {
+		ALOGI("Sampling period changed, resetting timestamp estimator\n");
+		ts_estimator_reset(e, e->rate);
+	}
+
+	return 1;
+}
+
+
+void ts_estimator_stamp (ts_estimator_t* e, int64_t* ts, int scans, int64_t read_ts, float rate)
+{
+	/*
+	 * Date a batch of scans that were read together at read_ts. On entry ts holds the driver timestamps of the scans, converted to boot
+	 * time, or zeros for scans without one. On return it holds the dates to use.
+	 */
+
+	int64_t gap = 0;	/* Scans found to be lost so far in this batch */
+	int64_t stamp;
+	double period;
+	double phase;
+	int last_has_ts = ts[scans - 1] != 0;
+	int lost;
+	int i;
+
+	if (rate != e->rate)
+		ts_estimator_reset(e, rate);
+
+	/*
+	 * Feed the model ; consecutive scans sharing a driver timestamp were probably stamped on the same interrupt. Lost scans only shift the
+	 * numbers of the scans that follow them, so once a scan has been looked at, its slot of ts records the gap that applies to it.
+	 */
+	for (i = 0; i < scans; i++) {
+		if (ts[i] && (i == scans - 1 || ts[i+1] != ts[i]) && check_observation(e, e->next_index + gap + i, ts[i], 0, &lost)) {
+			gap += lost;
+			add_observation(e, e->next_index + gap + i, ts[i]);
+		}
+
+		ts[i] = gap;
+	}
+
+	/* Without driver timestamps the read date tells when the last scan of the batch was available */
+	if (!last_has_ts) {
+		if (check_observation(e, e->next_index + gap + scans - 1, read_ts, 1, &lost))
+			add_observation(e, e->next_index + gap + scans - 1, read_ts);
+	}
+
+	/* The model may have been reset while being fed, restarting scan numbers ; number the batch from where it ended up */
+	period = get_period(e);
+	phase = get_phase(e, period);
+
+	for (i = 0; i < scans; i++) {
+		stamp = e->origin_ts + (int64_t) (phase + (e->next_index + ts[i] + i - e->origin_index) * period);
+
+		/* Don't go back in time, nor into the future */
+		if (stamp <= e->last_ts)
+			stamp = e->last_ts + 1;
+
+		if (stamp > read_ts)
+			stamp = read_ts;
+
+		ts[i] = stamp;
+		e->last_ts = stamp;
+	}
+
+	e->next_index += gap + scans;
+}
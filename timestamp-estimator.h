@@ -0,0 +1,45 @@
+/*
+// Copyright (c) 2015 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+
+#ifndef __TIMESTAMP_ESTIMATOR_H__
+#define __TIMESTAMP_ESTIMATOR_H__
+
+#include <stdint.h>
+
+/*
+ * Per iio device sample clock model. Scans are numbered as they come in, and a running least squares fit of their observed dates against
+ * their numbers, with older observations progressively forgotten, gives the actual sampling period and phase. Observed dates are driver
+ * timestamps if available, or read dates otherwise ; when several scans of a batch share a date, only the last one is used as observation.
+ * Each scan then gets the date predicted by the model, which is evenly spaced within and across batches, and monotonic.
+ */
+
+typedef struct
+{
+	float	rate;		/* Nominal sampling rate the model was set up for, in Hz		*/
+	int	count;		/* Observations so far ; 0 means the model is reset			*/
+	int	rejected;	/* Consecutive read dates discarded as late				*/
+	int64_t	next_index;	/* Number of the next scan						*/
+	int64_t	origin_index;	/* Number of the scan of the latest observation				*/
+	int64_t	origin_ts;	/* Date of the latest observation					*/
+	double	w, sx, sy, sxx, sxy; /* Weighted sums, relative to the latest observation		*/
+	int64_t	last_ts;	/* Last date handed out							*/
+}
+ts_estimator_t;
+
+void	ts_estimator_reset	(ts_estimator_t* e, float rate);
+void	ts_estimator_stamp	(ts_estimator_t* e, int64_t* ts, int scans, int64_t read_ts, float rate);
+
+#endif
@@ -15,6 +15,8 @@
 */
 
 #include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <math.h>
 #include <log/log.h>
 #include <cutils/properties.h>
@@ -26,6 +28,7 @@
 #include "utils.h"
 #include "filtering.h"
 #include "enumeration.h"
+#include "matrix-ops.h"
 
 #define	GYRO_MIN_SAMPLES 5 /* Drop first few gyro samples after enable */
 
@@ -133,7 +136,7 @@ inline float convert_from_vtf_format (int size, int exponent, unsigned int value
 #define CONVERT_M_MG_VTF16E14_Z(s,d,x) (convert_from_vtf_format(s,d,x) / 10)
 
 
-static int64_t sample_as_int64 (unsigned char* sample, datum_info_t* type)
+static int64_t sample_as_int64 (const unsigned char* sample, const datum_info_t* type)
 {
 	uint64_t u64;
 	int i;
@@ -185,6 +188,93 @@ static int64_t sample_as_int64 (unsigned char* sample, datum_info_t* type)
 }
 
 
+/*
+ * Specialized versions of sample_as_int64 for the data layouts we commonly get from drivers, e.g. le:s16/16>>0 or le:s12/16>>4. They rely on
+ * unaligned loads in host byte order, which is fine for little endian data on little endian hosts.
+ */
+
+static int64_t decode_le_s16 (const unsigned char* sample, __attribute__((unused)) const datum_info_t* type)
+{
+	int16_t v;
+
+	memcpy(&v, sample, sizeof(v));
+	return v;
+}
+
+
+static int64_t decode_le_u16 (const unsigned char* sample, __attribute__((unused)) const datum_info_t* type)
+{
+	uint16_t v;
+
+	memcpy(&v, sample, sizeof(v));
+	return v;
+}
+
+
+static int64_t decode_le_s32 (const unsigned char* sample, __attribute__((unused)) const datum_info_t* type)
+{
+	int32_t v;
+
+	memcpy(&v, sample, sizeof(v));
+	return v;
+}
+
+
+static int64_t decode_le_u32 (const unsigned char* sample, __attribute__((unused)) const datum_info_t* type)
+{
+	uint32_t v;
+
+	memcpy(&v, sample, sizeof(v));
+	return v;
+}
+
+
+static int64_t decode_le_s16_shifted (const unsigned char* sample, const datum_info_t* type)
+{
+	uint16_t v;
+
+	memcpy(&v, sample, sizeof(v));
+
+	/* Move the sign bit to bit 31, then sign extend through an arithmetic shift */
+	return (int32_t) ((uint32_t) v << (32 - type->shift - type->realbits)) >> (32 - type->realbits);
+}
+
+
+static int64_t decode_le_s32_shifted (const unsigned char* sample, const datum_info_t* type)
+{
+	uint32_t v;
+
+	memcpy(&v, sample, sizeof(v));
+
+	return (int64_t) ((uint64_t) v << (64 - type->shift - type->realbits)) >> (64 - type->realbits);
+}
+
+
+sample_decoder_t select_decoder (const datum_info_t* type)
+{
+	/* Pick the cheapest routine able to extract values described by this type */
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (type->endianness == 'l' && type->realbits > 1 && type->shift + type->realbits <= type->storagebits)
+		switch (type->storagebits) {
+			case 16:
+				if (type->sign == 'u')
+					return type->realbits == 16 ? decode_le_u16 : sample_as_int64;
+
+				return type->realbits == 16 ? decode_le_s16 : decode_le_s16_shifted;
+
+			case 32:
+				if (type->sign == 'u')
+					return type->realbits == 32 ? decode_le_u32 : sample_as_int64;
+
+				return type->realbits == 32 ? decode_le_s32 : decode_le_s32_shifted;
+		}
+#endif
+
+	return sample_as_int64;
+}
+
+
 static void reorder_fields (float* data, unsigned char map[MAX_CHANNELS])
 {
 	int i;
@@ -199,14 +289,7 @@ static void reorder_fields (float* data, unsigned char map[MAX_CHANNELS])
 
 static void mount_correction (float* data, float mm[9])
 {
-	int i;
-	float temp[3];
-
-	for (i=0; i<3; i++)
-		temp[i] = data[0] * mm[i * 3] + data[1] * mm[i * 3 + 1] + data[2] * mm[i * 3 + 2];
-
-	for (i=0; i<3; i++)
-		data[i] = temp[i];
+	multiply_3x3_3x1_f(mm, data, data);
 }
 
 static void clamp_gyro_readings_to_zero (int s, sensors_event_t* data)
@@ -239,85 +322,71 @@ static void clamp_gyro_readings_to_zero (int s, sensors_event_t* data)
 }
 
 
-static void process_event_gyro_uncal (int s, int i, sensors_event_t* data)
+static void derive_gyro_uncal (int base, int s, sensors_event_t* data)
 {
-	gyro_cal_t* gyro_data;
+	gyro_cal_t* gyro_data = (gyro_cal_t*) sensor[base].cal_data;
 
-	if (sensor[s].type == SENSOR_TYPE_GYROSCOPE) {
-		gyro_data = (gyro_cal_t*) sensor[s].cal_data;
+	memcpy(&sensor[s].sample, data, sizeof(sensors_event_t));
 
-		memcpy(&sensor[i].sample, data, sizeof(sensors_event_t));
+	sensor[s].sample.type = SENSOR_TYPE_GYROSCOPE_UNCALIBRATED;
+	sensor[s].sample.sensor = base;
 
-		sensor[i].sample.type = SENSOR_TYPE_GYROSCOPE_UNCALIBRATED;
-		sensor[i].sample.sensor = s;
+	sensor[s].sample.data[0] = data->data[0] + gyro_data->bias_x;
+	sensor[s].sample.data[1] = data->data[1] + gyro_data->bias_y;
+	sensor[s].sample.data[2] = data->data[2] + gyro_data->bias_z;
 
-		sensor[i].sample.data[0] = data->data[0] + gyro_data->bias_x;
-		sensor[i].sample.data[1] = data->data[1] + gyro_data->bias_y;
-		sensor[i].sample.data[2] = data->data[2] + gyro_data->bias_z;
+	sensor[s].sample.uncalibrated_gyro.bias[0] = gyro_data->bias_x;
+	sensor[s].sample.uncalibrated_gyro.bias[1] = gyro_data->bias_y;
+	sensor[s].sample.uncalibrated_gyro.bias[2] = gyro_data->bias_z;
 
-		sensor[i].sample.uncalibrated_gyro.bias[0] = gyro_data->bias_x;
-		sensor[i].sample.uncalibrated_gyro.bias[1] = gyro_data->bias_y;
-		sensor[i].sample.uncalibrated_gyro.bias[2] = gyro_data->bias_z;
-
-		sensor[i].report_pending = 1;
-	}
+	sensor_state[s].report_pending = 1;
 }
 
-static void process_event_magn_uncal (int s, int i, sensors_event_t* data)
+static void derive_magn_uncal (int base, int s, sensors_event_t* data)
 {
-	compass_cal_t* magn_data;
+	compass_cal_t* magn_data = (compass_cal_t*) sensor[base].cal_data;
 
-	if (sensor[s].type == SENSOR_TYPE_MAGNETIC_FIELD) {
-		magn_data = (compass_cal_t*) sensor[s].cal_data;
+	memcpy(&sensor[s].sample, data, sizeof(sensors_event_t));
 
-		memcpy(&sensor[i].sample, data, sizeof(sensors_event_t));
+	sensor[s].sample.type = SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED;
+	sensor[s].sample.sensor = base;
 
-		sensor[i].sample.type = SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED;
-		sensor[i].sample.sensor = s;
+	sensor[s].sample.data[0] = data->data[0] + magn_data->offset[0][0];
+	sensor[s].sample.data[1] = data->data[1] + magn_data->offset[1][0];
+	sensor[s].sample.data[2] = data->data[2] + magn_data->offset[2][0];
 
-		sensor[i].sample.data[0] = data->data[0] + magn_data->offset[0][0];
-		sensor[i].sample.data[1] = data->data[1] + magn_data->offset[1][0];
-		sensor[i].sample.data[2] = data->data[2] + magn_data->offset[2][0];
+	sensor[s].sample.uncalibrated_magnetic.bias[0] = magn_data->offset[0][0];
+	sensor[s].sample.uncalibrated_magnetic.bias[1] = magn_data->offset[1][0];
+	sensor[s].sample.uncalibrated_magnetic.bias[2] = magn_data->offset[2][0];
 
-		sensor[i].sample.uncalibrated_magnetic.bias[0] = magn_data->offset[0][0];
-		sensor[i].sample.uncalibrated_magnetic.bias[1] = magn_data->offset[1][0];
-		sensor[i].sample.uncalibrated_magnetic.bias[2] = magn_data->offset[2][0];
-
-		sensor[i].report_pending = 1;
-	}
+	sensor_state[s].report_pending = 1;
 }
 
 static void process_event (int s, sensors_event_t* data)
 {
 	/*
-	 * This gets the real event (post process - calibration, filtering & co.) and makes it into a virtual one.
-	 * The specific processing function for each sensor will populate the necessary fields and set up the report pending flag.
+	 * This gets the real event (post process - calibration, filtering & co.) and makes it into a virtual one, for each of the enabled
+	 * virtual sensors built on top of this sensor. Their derive function populates the necessary fields and sets up the report pending flag.
 	 */
 
-	 int i;
+	int i, v;
 
-	 /* Go through out virtual sensors and check if we can use this event */
-	 for (i = 0; i < sensor_count; i++)
-		switch (sensor[i].type) {
-			case SENSOR_TYPE_GYROSCOPE_UNCALIBRATED:
-				process_event_gyro_uncal(s, i, data);
-				break;
-			case SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED:
-				process_event_magn_uncal(s, i, data);
-				break;
- 			default:
-				break;
-		}
+	for (i = 0; i < (int) sensor_state[s].ref_count; i++) {
+		v = sensor[s].active_dependent[i];
+		sensor[v].ops.derive(s, v, data);
+	}
 }
 
 
 static int finalize_sample_default (int s, sensors_event_t* data)
 {
-	/* Swap fields if we have a custom channel ordering on this sensor */
-	if (sensor[s].quirks & QUIRK_FIELD_ORDERING)
-		reorder_fields(data->data, sensor[s].order);
-	if (sensor[s].quirks & QUIRK_MOUNTING_MATRIX)
-		mount_correction(data->data, sensor[s].mounting_matrix);
+	/* Swap fields and correct mounting, unless that was done through the correction matrix at conversion time */
+	if (!sensor[s].ops.transform_sample) {
+		if (sensor[s].quirks & QUIRK_FIELD_ORDERING)
+			reorder_fields(data->data, sensor[s].order);
+		if (sensor[s].quirks & QUIRK_MOUNTING_MATRIX)
+			mount_correction(data->data, sensor[s].mounting_matrix);
+	}
 
 	sensor[s].event_count++;
 
@@ -344,7 +413,7 @@ static int finalize_sample_default (int s, sensors_event_t* data)
 			 * We're only trying to calibrate data from continuously firing gyroscope drivers, as motion based ones use
 			 * movement thresholds that may lead us to incorrectly estimate bias.
 			 */
-			if (sensor[s].selected_trigger !=
+			if (sensor_state[s].selected_trigger !=
 				sensor[s].motion_trigger_name)
 					calibrate_gyro(s, data);
 
@@ -353,7 +422,7 @@ static int finalize_sample_default (int s, sensors_event_t* data)
 			 * filtering queue. This improves mean and std dev.
 			 */
 			if (sensor[s].filter_type) {
-				if (sensor[s].selected_trigger !=
+				if (sensor_state[s].selected_trigger !=
 				    sensor[s].motion_trigger_name &&
 				    sensor[s].event_count < GYRO_MIN_SAMPLES)
 						return 0;
@@ -398,8 +467,11 @@ static int finalize_sample_default (int s, sensors_event_t* data)
 
 	}
 
+	/* Keep track of this sample, so it can be correlated with data from other sensors */
+	record_sample(s, data);
+
 	/* If there are active virtual sensors depending on this one - process the event */
-	if (sensor[s].ref_count)
+	if (sensor_state[s].ref_count)
 		process_event(s, data);
 
 
@@ -410,7 +482,7 @@ static int finalize_sample_default (int s, sensors_event_t* data)
 static float transform_sample_default (int s, int c, unsigned char* sample_data)
 {
 	datum_info_t* sample_type = &sensor[s].channel[c].type_info;
-	int64_t s64 = sample_as_int64(sample_data, sample_type);
+	int64_t s64 = sensor[s].channel[c].decode(sample_data, sample_type);
 	float scale = sensor[s].scale ? sensor[s].scale : sensor[s].channel[c].scale;
 
 	/* In case correction has been requested using properties, apply it */
@@ -425,6 +497,63 @@ static float transform_sample_default (int s, int c, unsigned char* sample_data)
 }
 
 
+static void setup_correction_matrix (int s)
+{
+	/*
+	 * Compose the per channel scaling, the optional field reordering and the mounting matrix into a single affine transform, so the fused
+	 * conversion routine can turn raw values into ready to calibrate data with a single matrix product. Field i of the reordered sample comes
+	 * from channel order[i], and the mounting matrix then mixes reordered fields.
+	 */
+	float unit = sensor[s].type == SENSOR_TYPE_MAGNETIC_FIELD ? CONVERT_GAUSS_TO_MICROTESLA(1) : 1;
+	float k[3];
+	float* m = sensor[s].correction_matrix;
+	int i, j, c;
+
+	for (c=0; c<3; c++)
+		k[c] = (sensor[s].scale ? sensor[s].scale : sensor[s].channel[c].scale) * unit * sensor[s].channel[c].opt_scale;
+
+	memset(m, 0, sizeof(sensor[s].correction_matrix));
+
+	for (j=0; j<3; j++)
+		for (i=0; i<3; i++) {
+			c = (sensor[s].quirks & QUIRK_FIELD_ORDERING) ? sensor[s].order[i] : i;
+
+			if (c >= 3)
+				continue;	/* Field gets filled from a channel we don't decode ; it reads as zero */
+
+			if (sensor[s].quirks & QUIRK_MOUNTING_MATRIX)
+				m[j * 3 + c] += sensor[s].mounting_matrix[j * 3 + i] * k[c];
+			else if (i == j)
+				m[j * 3 + c] += k[c];
+		}
+
+	/* The offset gets added to raw values before scaling */
+	for (j=0; j<3; j++)
+		sensor[s].correction_offset[j] = (m[j * 3] + m[j * 3 + 1] + m[j * 3 + 2]) * sensor[s].offset;
+}
+
+
+static void transform_sample_3axis (int s, unsigned char* sample_data, float* data)
+{
+	/* Conversion of the three channels of an accelerometer, gyroscope or magnetometer at once, through the sensor's correction matrix */
+
+	channel_info_t* ch = sensor[s].channel;
+	float* m = sensor[s].correction_matrix;
+	float* b = sensor[s].correction_offset;
+	float raw[3];
+
+	raw[0] = ch[0].decode(sample_data, &ch[0].type_info);
+	raw[1] = ch[1].decode(sample_data + ch[0].size, &ch[1].type_info);
+	raw[2] = ch[2].decode(sample_data + ch[0].size + ch[1].size, &ch[2].type_info);
+
+	multiply_3x3_3x1_f(m, raw, data);
+
+	data[0] += b[0];
+	data[1] += b[1];
+	data[2] += b[2];
+}
+
+
 static int finalize_sample_ISH (int s, sensors_event_t* data)
 {
 	float pitch, roll, yaw;
@@ -454,7 +583,7 @@ static int finalize_sample_ISH (int s, sensors_event_t* data)
 static float transform_sample_ISH (int s, int c, unsigned char* sample_data)
 {
 	datum_info_t* sample_type = &sensor[s].channel[c].type_info;
-	int val		= (int) sample_as_int64(sample_data, sample_type);
+	int val		= (int) sensor[s].channel[c].decode(sample_data, sample_type);
 	float correction;
 	int data_bytes  = (sample_type->realbits)/8;
 	int exponent    = sensor[s].offset;
@@ -522,10 +651,30 @@ void select_transform (int s)
 	char prop_val[PROP_VALUE_MAX];
 	int i			= sensor[s].catalog_index;
 	const char *prefix	= sensor_catalog[i].tag;
+	int c;
+
+	/* Virtual sensors don't process raw data ; they derive their samples from those of their base sensors */
+	if (sensor[s].is_virtual) {
+		switch (sensor[s].type) {
+			case SENSOR_TYPE_GYROSCOPE_UNCALIBRATED:
+				sensor[s].ops.derive = derive_gyro_uncal;
+				break;
+			case SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED:
+				sensor[s].ops.derive = derive_magn_uncal;
+				break;
+		}
+		return;
+	}
+
+	/* Bind channel decoders ; they get refined once channel types are read, in build_sensor_report_maps */
+	for (c=0; c<MAX_CHANNELS; c++)
+		sensor[s].channel[c].decode = select_decoder(&sensor[s].channel[c].type_info);
+
+	sensor[s].ops.transform_sample = NULL;
 
 	sprintf(prop_name, PROP_BASE, prefix, "transform");
 
-	if (property_get(prop_name, prop_val, ""))
+	if (iio_property_get(prop_name, prop_val))
 		if (!strcmp(prop_val, "ISH")) {
 			ALOGI(	"Using Intel Sensor Hub semantics on %s\n", sensor[s].friendly_name);
 
@@ -536,12 +685,90 @@ void select_transform (int s)
 
 	sensor[s].ops.transform = transform_sample_default;
 	sensor[s].ops.finalize = finalize_sample_default;
+
+	switch (sensor[s].type) {
+		case SENSOR_TYPE_ACCELEROMETER:
+		case SENSOR_TYPE_GYROSCOPE:
+		case SENSOR_TYPE_MAGNETIC_FIELD:
+			if (sensor[s].num_channels == 3) {
+				setup_correction_matrix(s);
+				sensor[s].ops.transform_sample = transform_sample_3axis;
+			}
+			break;
+	}
 }
 
 
-float acquire_immediate_float_value (int s, int c)
+static int get_value_fd (int* fd, int dev_num, const char* attr)
 {
+	/* Return a fd on the specified sysfs attribute, opening it on first use ; it then stays open until the sensor is disabled */
+
 	char sysfs_path[PATH_MAX];
+
+	if (*fd == -1) {
+		sprintf(sysfs_path, BASE_PATH "%s", dev_num, attr);
+		*fd = open(sysfs_path, O_RDONLY);
+
+		if (*fd == -1)
+			ALOGV("Cannot open %s (%s)\n", sysfs_path, strerror(errno));
+	}
+
+	return *fd;
+}
+
+
+static void invalidate_value_fd (int* fd)
+{
+	/* Drop a fd we failed to read from ; we'll try reopening the attribute for the next sample */
+	close(*fd);
+	*fd = -1;
+}
+
+
+static int read_float_value (int* fd, int dev_num, const char* attr, float* val)
+{
+	if (get_value_fd(fd, dev_num, attr) == -1)
+		return -1;
+
+	if (!sysfs_pread_float(*fd, val))
+		return 0;
+
+	invalidate_value_fd(fd);
+	return -1;
+}
+
+
+static int read_uint64_value (int* fd, int dev_num, const char* attr, uint64_t* val)
+{
+	if (get_value_fd(fd, dev_num, attr) == -1)
+		return -1;
+
+	if (!sysfs_pread_uint64(*fd, val))
+		return 0;
+
+	invalidate_value_fd(fd);
+	return -1;
+}
+
+
+void release_immediate_value_fds (int s)
+{
+	/* Close the sysfs fds cached for poll mode acquisition on this sensor */
+
+	int c;
+
+	for (c=0; c<MAX_CHANNELS; c++) {
+		if (sensor[s].channel[c].raw_fd != -1)
+			invalidate_value_fd(&sensor[s].channel[c].raw_fd);
+
+		if (sensor[s].channel[c].input_fd != -1)
+			invalidate_value_fd(&sensor[s].channel[c].input_fd);
+	}
+}
+
+
+float acquire_immediate_float_value (int s, int c)
+{
 	float val;
 	int ret;
 	int dev_num = sensor[s].dev_num;
@@ -558,8 +785,7 @@ float acquire_immediate_float_value (int s, int c)
 	/* Acquire a sample value for sensor s / channel c through sysfs */
 
 	if (sensor[s].channel[c].input_path_present) {
-		sprintf(sysfs_path, BASE_PATH "%s", dev_num, input_path);
-		ret = sysfs_read_float(sysfs_path, &val);
+		ret = read_float_value(&sensor[s].channel[c].input_fd, dev_num, input_path, &val);
 
 		if (!ret) {
 			if (sensor[s].type == SENSOR_TYPE_MAGNETIC_FIELD)
@@ -571,8 +797,7 @@ float acquire_immediate_float_value (int s, int c)
 	if (!sensor[s].channel[c].raw_path_present)
 		return 0;
 
-	sprintf(sysfs_path, BASE_PATH "%s", dev_num, raw_path);
-	ret = sysfs_read_float(sysfs_path, &val);
+	ret = read_float_value(&sensor[s].channel[c].raw_fd, dev_num, raw_path, &val);
 
 	if (ret == -1)
 		return 0;
@@ -589,7 +814,6 @@ float acquire_immediate_float_value (int s, int c)
 
 uint64_t acquire_immediate_uint64_value (int s, int c)
 {
-	char sysfs_path[PATH_MAX];
 	uint64_t val;
 	int ret;
 	int dev_num = sensor[s].dev_num;
@@ -607,8 +831,7 @@ uint64_t acquire_immediate_uint64_value (int s, int c)
 	/* Acquire a sample value for sensor s / channel c through sysfs */
 
 	if (sensor[s].channel[c].input_path_present) {
-		sprintf(sysfs_path, BASE_PATH "%s", dev_num, input_path);
-		ret = sysfs_read_uint64(sysfs_path, &val);
+		ret = read_uint64_value(&sensor[s].channel[c].input_fd, dev_num, input_path, &val);
 
 		if (!ret)
 			return val * correction;
@@ -617,8 +840,7 @@ uint64_t acquire_immediate_uint64_value (int s, int c)
 	if (!sensor[s].channel[c].raw_path_present)
 		return 0;
 
-	sprintf(sysfs_path, BASE_PATH "%s", dev_num, raw_path);
-	ret = sysfs_read_uint64(sysfs_path, &val);
+	ret = read_uint64_value(&sensor[s].channel[c].raw_fd, dev_num, raw_path, &val);
 
 	if (ret == -1)
 		return 0;
@@ -22,9 +22,13 @@
 #define CONVERT_GAUSS_TO_MICROTESLA(x)	((x) * 100)
 #define CONVERT_MICROTESLA_TO_GAUSS(x)	((x) / 100)
 
+typedef int64_t (*sample_decoder_t) (const unsigned char* sample, const datum_info_t* type);
+
 void	select_transform	(int s);
+sample_decoder_t select_decoder	(const datum_info_t* type);
 float	acquire_immediate_float_value	(int s, int c);
 uint64_t acquire_immediate_uint64_value	(int s, int c);
+void	release_immediate_value_fds	(int s);
 
 #endif
 
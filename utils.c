@@ -15,7 +15,11 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <log/log.h>
 #include <hardware/sensors.h>
@@ -28,12 +32,270 @@
 
 #include <errno.h>
 
-/* Note:
- *
- * Some of these calls are going to fail, because not all sensors expose all
- * possible sysfs attributes. As an optimization we may want to cache which
- * ones are valid and immediately return in error for inexistent entries.
+/*
+ * Some of the sysfs calls are going to fail, because not all sensors expose
+ * all possible sysfs attributes. As an optimization we cache which entries
+ * exist for each iio device, from a single scan of the device directory and
+ * its subdirectories, and immediately return in error for inexistent entries.
+ * The attribute set of a iio device does not change during its lifetime.
  */
+
+typedef struct
+{
+	int	state;		/* ATTR_CACHE_ states */
+	int	count;		/* Number of known attributes */
+	char**	names;		/* Sorted attribute paths, relative to the device dir ; scanned subdirs are also listed with a trailing slash */
+}
+attr_cache_t;
+
+#define ATTR_CACHE_EMPTY	0	/* Device not scanned yet	*/
+#define ATTR_CACHE_READY	1	/* Device scanned		*/
+#define ATTR_CACHE_ABSENT	2	/* No such device		*/
+
+#define IIO_DEVICE_PREFIX	IIO_DEVICES "iio:device"
+
+static attr_cache_t*	attr_cache;		/* Indexed by device number, grown on demand	*/
+static int		attr_cache_size;
+static pthread_mutex_t	attr_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int compare_names (const void *a, const void *b)
+{
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+
+static void add_cached_name (attr_cache_t *cache, int *allocated, const char *name)
+{
+	char **names;
+
+	if (cache->count == *allocated) {
+		names = realloc(cache->names, (*allocated ? *allocated * 2 : 64) * sizeof(char*));
+
+		if (!names)
+			return;
+
+		cache->names = names;
+		*allocated = *allocated ? *allocated * 2 : 64;
+	}
+
+	cache->names[cache->count] = strdup(name);
+
+	if (cache->names[cache->count])
+		cache->count++;
+}
+
+
+static void scan_device_attributes (int dev_num)
+{
+	/* List entries of the device directory, descending one level into subdirectories such as scan_elements, buffer or events */
+
+	attr_cache_t *cache = &attr_cache[dev_num];
+	char dir_path[PATH_MAX];
+	char name[PATH_MAX + NAME_MAX + 1];
+	DIR *dir, *subdir;
+	struct dirent *entry, *subentry;
+	int allocated = 0;
+
+	sprintf(dir_path, BASE_PATH, dev_num);
+
+	dir = opendir(dir_path);
+
+	if (!dir) {
+		cache->state = ATTR_CACHE_ABSENT;
+		return;
+	}
+
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		add_cached_name(cache, &allocated, entry->d_name);
+
+		if (entry->d_type != DT_DIR)
+			continue;
+
+		snprintf(name, sizeof(name), "%s%s", dir_path, entry->d_name);
+		subdir = opendir(name);
+
+		if (!subdir)
+			continue;
+
+		/* Remember we know the full contents of this subdirectory */
+		snprintf(name, sizeof(name), "%s/", entry->d_name);
+		add_cached_name(cache, &allocated, name);
+
+		while ((subentry = readdir(subdir)))
+			if (subentry->d_name[0] != '.') {
+				snprintf(name, sizeof(name), "%s/%s", entry->d_name, subentry->d_name);
+				add_cached_name(cache, &allocated, name);
+			}
+
+		closedir(subdir);
+	}
+
+	closedir(dir);
+
+	qsort(cache->names, cache->count, sizeof(char*), compare_names);
+
+	cache->state = ATTR_CACHE_READY;
+	ALOGV("Cached %d sysfs entries for iio device %d\n", cache->count, dev_num);
+}
+
+
+static int grow_attr_cache (int size)
+{
+	/* Make room for the specified number of devices in the attribute cache ; called with the cache lock held */
+
+	attr_cache_t *cache = realloc(attr_cache, size * sizeof(attr_cache_t));
+
+	if (!cache)
+		return -1;
+
+	memset(cache + attr_cache_size, 0, (size - attr_cache_size) * sizeof(attr_cache_t));
+
+	attr_cache = cache;
+	attr_cache_size = size;
+	return 0;
+}
+
+
+int sysfs_attr_exists (const char path[PATH_MAX])
+{
+	/* Returns 1 if the specified sysfs entry exists, 0 if it doesn't, and -1 if we can't tell as it's not located in a iio device dir */
+
+	char rel_path[PATH_MAX];
+	char parent[PATH_MAX];
+	const char *key = rel_path;
+	const char *parent_key = parent;
+	char *end;
+	char *slash;
+	int dev_num;
+	int found;
+	int len;
+
+	if (strncmp(path, IIO_DEVICE_PREFIX, sizeof(IIO_DEVICE_PREFIX) - 1))
+		return -1;
+
+	dev_num = strtol(path + sizeof(IIO_DEVICE_PREFIX) - 1, &end, 10);
+
+	if (end == path + sizeof(IIO_DEVICE_PREFIX) - 1 || *end != '/' || dev_num < 0)
+		return -1;
+
+	/* Look up the path relative to the device dir, without trailing slash */
+	strncpy(rel_path, end + 1, PATH_MAX - 1);
+	rel_path[PATH_MAX - 1] = '\0';
+
+	len = strlen(rel_path);
+
+	while (len && rel_path[len - 1] == '/')
+		rel_path[--len] = '\0';
+
+	/* We only scanned the device dir and its direct subdirs ; leave anything outside of that to the caller */
+	slash = strchr(rel_path, '/');
+
+	if (strstr(rel_path, "..") || (slash && strchr(slash + 1, '/')))
+		return -1;
+
+	if (slash) {
+		memcpy(parent, rel_path, slash - rel_path + 1);
+		parent[slash - rel_path + 1] = '\0';
+	}
+
+	pthread_mutex_lock(&attr_cache_mutex);
+
+	if (dev_num >= attr_cache_size && grow_attr_cache(dev_num + 1)) {
+		pthread_mutex_unlock(&attr_cache_mutex);
+		return -1;
+	}
+
+	if (attr_cache[dev_num].state == ATTR_CACHE_EMPTY)
+		scan_device_attributes(dev_num);
+
+	if (attr_cache[dev_num].state == ATTR_CACHE_ABSENT)
+		found = 0;
+	else if (!rel_path[0])
+		found = 1;	/* Device directory itself */
+	else if (bsearch(&key, attr_cache[dev_num].names, attr_cache[dev_num].count, sizeof(char*), compare_names))
+		found = 1;
+	else if (!slash)
+		found = 0;
+	else if (bsearch(&parent_key, attr_cache[dev_num].names, attr_cache[dev_num].count, sizeof(char*), compare_names))
+		found = 0;	/* Scanned subdirectory that doesn't hold that entry */
+	else {
+		/* Unless the parent is absent as well, it's a symlink or a dir we could not open: we can't tell */
+		parent[slash - rel_path] = '\0';
+		found = bsearch(&parent_key, attr_cache[dev_num].names, attr_cache[dev_num].count, sizeof(char*), compare_names) ? -1 : 0;
+	}
+
+	pthread_mutex_unlock(&attr_cache_mutex);
+
+	return found;
+}
+
+
+void sysfs_attr_cache_invalidate (int dev_num)
+{
+	/* Forget what we learnt about the sysfs entries of a iio device, or of all of them if dev_num is -1 */
+
+	int d, i;
+
+	pthread_mutex_lock(&attr_cache_mutex);
+
+	for (d=0; d<attr_cache_size; d++)
+		if (dev_num == -1 || d == dev_num) {
+			for (i=0; i<attr_cache[d].count; i++)
+				free(attr_cache[d].names[i]);
+
+			free(attr_cache[d].names);
+			memset(&attr_cache[d], 0, sizeof(attr_cache_t));
+		}
+
+	pthread_mutex_unlock(&attr_cache_mutex);
+}
+
+
+static int get_entry_count (const char *prefix)
+{
+	/* Return one more than the highest N such that IIO_DEVICES contains a <prefix>N entry, i.e. the size of a table indexed by N */
+
+	DIR *dir;
+	struct dirent *entry;
+	size_t len = strlen(prefix);
+	char *end;
+	int n;
+	int count = 0;
+
+	dir = opendir(IIO_DEVICES);
+
+	if (!dir)
+		return 0;
+
+	while ((entry = readdir(dir)))
+		if (!strncmp(entry->d_name, prefix, len)) {
+			n = strtol(entry->d_name + len, &end, 10);
+
+			if (end != entry->d_name + len && !*end && n >= count)
+				count = n + 1;
+		}
+
+	closedir(dir);
+	return count;
+}
+
+
+int get_iio_device_count (void)
+{
+	return get_entry_count("iio:device");
+}
+
+
+int get_iio_trigger_count (void)
+{
+	return get_entry_count("trigger");
+}
+
+
 int sysfs_read(const char path[PATH_MAX], void *buf, int buf_len)
 {
 	int fd, len;
@@ -41,6 +303,11 @@ int sysfs_read(const char path[PATH_MAX], void *buf, int buf_len)
 	if (!path[0] || !buf || buf_len < 1)
 		return -1;
 
+	if (!sysfs_attr_exists(path)) {
+		errno = ENOENT;
+		return -1;
+	}
+
 	fd = open(path, O_RDONLY);
 
 	if (fd == -1) {
@@ -68,6 +335,11 @@ int sysfs_write(const char path[PATH_MAX], const void *buf, const int buf_len)
 	if (!path[0] || !buf || buf_len < 1)
 		return -1;
 
+	if (!sysfs_attr_exists(path)) {
+		errno = ENOENT;
+		return -1;
+	}
+
 	fd = open(path, O_WRONLY);
 
 	if (fd == -1) {
@@ -143,6 +415,38 @@ int sysfs_read_uint64(const char path[PATH_MAX], uint64_t *value)
 }
 
 
+static int sysfs_pread_num(int fd, void *v,
+		void (*str2num)(const char* buf, void *v))
+{
+	/* Read a number from an already open sysfs file ; rewinding is implicit as we always read from offset 0 */
+	char buf[20];
+	int len = pread(fd, buf, sizeof(buf) - 1, 0);
+
+	if (len <= 0) {
+		ALOGW("Cannot read number from fd %d (%s)\n", fd,
+		      strerror(errno));
+		return -1;
+	}
+
+	buf[len] = '\0';
+
+	str2num(buf, v);
+	return 0;
+}
+
+
+int sysfs_pread_float(int fd, float *value)
+{
+	return sysfs_pread_num(fd, value, str2float);
+}
+
+
+int sysfs_pread_uint64(int fd, uint64_t *value)
+{
+	return sysfs_pread_num(fd, value, str2uint64);
+}
+
+
 int sysfs_write_int(const char path[PATH_MAX], int value)
 {
 	char buf[20];
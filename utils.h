@@ -30,6 +30,14 @@ int	sysfs_write_float(const char path[PATH_MAX], float value);
 
 int	sysfs_read_uint64(const char path[PATH_MAX], uint64_t *value);
 
+int	sysfs_attr_exists (const char path[PATH_MAX]);
+int	get_iio_device_count  (void);
+int	get_iio_trigger_count (void);
+void	sysfs_attr_cache_invalidate (int dev_num);
+
+int	sysfs_pread_float (int fd, float *value);
+int	sysfs_pread_uint64(int fd, uint64_t *value);
+
 void	set_timestamp	(struct timespec *out, int64_t target_ns);
 
 int64_t get_timestamp_boot	(void);